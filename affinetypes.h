@@ -0,0 +1,120 @@
+/*  affinetypes.h
+
+    Fixed size affine matrix and parameter types for FLIRT
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// Small stack-allocated versions of the 4x4 affine matrix and the 12 affine
+//  parameters, for the parts of the cost evaluation that are called for
+//  every cost function evaluation (NEWMAT matrices are heap allocated).
+// Indexing is from 1, as for NEWMAT, and the parameter order is the usual
+//  3 rotations + 3 translations + 3 scales + 3 skews.
+
+#if !defined(__affinetypes_h)
+#define __affinetypes_h
+
+#include <cmath>
+
+#include "armawrap/newmat.h"
+
+class Affine4 {
+ public:
+  constexpr Affine4() : m{{1,0,0,0},{0,1,0,0},{0,0,1,0},{0,0,0,1}} {}
+  explicit Affine4(const NEWMAT::Matrix& aff)
+    { for (int r=0; r<4; r++) for (int c=0; c<4; c++) m[r][c]=aff(r+1,c+1); }
+
+  double& operator()(int r, int c) { return m[r-1][c-1]; }
+  constexpr double operator()(int r, int c) const { return m[r-1][c-1]; }
+
+  Affine4 operator*(const Affine4& b) const
+    {
+      Affine4 res;
+      for (int r=0; r<4; r++) {
+	for (int c=0; c<4; c++) {
+	  res.m[r][c] = m[r][0]*b.m[0][c] + m[r][1]*b.m[1][c]
+	    + m[r][2]*b.m[2][c] + m[r][3]*b.m[3][c];
+	}
+      }
+      return res;
+    }
+
+  void to_matrix(NEWMAT::Matrix& aff) const
+    {
+      aff.ReSize(4,4);
+      for (int r=0; r<4; r++) for (int c=0; c<4; c++) aff(r+1,c+1)=m[r][c];
+    }
+
+ private:
+  double m[4][4];
+};
+
+
+class Params12 {
+ public:
+  constexpr Params12() : p{0,0,0, 0,0,0, 1,1,1, 0,0,0} {}
+  Params12(const NEWMAT::ColumnVector& params, int n) : Params12()
+    { for (int i=0; i<n && i<12; i++) p[i]=params(i+1); }
+
+  double& operator()(int i) { return p[i-1]; }
+  constexpr double operator()(int i) const { return p[i-1]; }
+
+ private:
+  double p[12];
+};
+
+
+// Rotation by angle about coordinate axis (1=x, 2=y, 3=z) that leaves
+//  centre fixed, with the same sign conventions as MISCMATHS::make_rot
+inline Affine4 axis_rotation(int axis, double angle, const double centre[3])
+{
+  Affine4 rot;
+  double c=cos(angle), s=sin(angle);
+  int a1 = axis % 3 + 1, a2 = (axis+1) % 3 + 1;   // the other two axes, in cyclic order
+  rot(a1,a1) = c;  rot(a1,a2) = s;
+  rot(a2,a1) = -s; rot(a2,a2) = c;
+  for (int r=1; r<=3; r++) {
+    double t = centre[r-1];
+    for (int k=1; k<=3; k++) t -= rot(r,k)*centre[k-1];
+    rot(r,4) = t;
+  }
+  return rot;
+}
+
+
+// Equivalent of MISCMATHS::compose_aff with construct_rotmat_euler
+inline void compose_affine_euler(const Params12& params, int n,
+				 const double centre[3], Affine4& aff)
+{
+  aff = Affine4();
+  if (n<=0) return;
+  for (int i=1; i<=3 && i<=n; i++) {
+    if (fabs(params(i))>=1e-8) aff = aff * axis_rotation(i,params(i),centre);
+  }
+  for (int i=4; i<=6 && i<=n; i++) aff(i-3,4) += params(i);
+  if (n<=6) return;
+
+  // scales then skews, each fixed so that the centre does not move
+  Affine4 scale, skew;
+  scale(1,1) = params(7);
+  scale(2,2) = (n>=8) ? params(8) : params(7);
+  scale(3,3) = (n>=9) ? params(9) : params(7);
+  if (n>=10) skew(1,2) = params(10);
+  if (n>=11) skew(1,3) = params(11);
+  if (n>=12) skew(2,3) = params(12);
+  for (int r=1; r<=3; r++) {
+    double st = centre[r-1], kt = centre[r-1];
+    for (int k=1; k<=3; k++) {
+      st -= scale(r,k)*centre[k-1];
+      kt -= skew(r,k)*centre[k-1];
+    }
+    scale(r,4) = st;
+    skew(r,4) = kt;
+  }
+  aff = aff * skew * scale;
+}
+
+#endif
@@ -8,11 +8,19 @@
 
 #include <string>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include "armawrap/newmat.h"
 #include "miscmaths/miscmaths.h"
 #include "newimage/newimageall.h"
 #include "newimage/fmribmain.h"
+#include "niftistream.h"
+#include "boundedqueue.h"
+#include "parallelfor.h"
+#include "matseries.h"
+#include "fastresample.h"
 
 using namespace std;
 using namespace NEWMAT;
@@ -22,17 +30,260 @@ using namespace NEWIMAGE;
 // Globals - needed by fmrib_main
 
 string oname, iname, transname, refname, usrinterp="sinc", matprefix="/MAT_0";
-bool singlematrix, fourd, verbose;
+bool singlematrix, fourd, verbose, streaming;
+int nthreads = 1;
 interpolation interpmethod = sinc;
+std::mutex printmutex;
+MatrixSeries transseries;   // used if transname is a matrix series file
+bool useseries = false;
 //////////////////////////////////////////////////////////////////////
 
+string matrix_name(int m)
+{
+  string matname = transname + matprefix;
+  char nc='0';
+  int n = m;
+  matname += (nc + (char) (n / 1000));
+  n -= (n/1000)*1000;
+  matname += (nc + (char) (n / 100));
+  n -= (n/100)*100;
+  matname += (nc + (char) (n / 10));
+  n -= (n/10)*10;
+  matname += (nc + (char) n);
+  return matname;
+}
+
+
+// reads the matrix for volume m (called from several threads at once)
+Matrix read_volume_matrix(int m)
+{
+  if (useseries) return transseries.matrix(m);
+  string matname = matrix_name(m);
+  {
+    std::lock_guard<std::mutex> lock(printmutex);
+    cout << matname << endl;
+  }
+  return read_ascii_matrix(matname);
+}
+
+
+// loads the matrix series (if transname is one) and checks that it has
+//  a matrix for each of the nvols volumes
+
+bool check_series(int nvols)
+{
+  useseries = (!singlematrix && is_matrix_series(transname));
+  if (!useseries) return true;
+  if (transseries.read(transname)!=0) {
+    cerr << "Could not read matrix series " << transname << endl;
+    return false;
+  }
+  for (int m=0; m<nvols; m++) {
+    if (!transseries.has(m)) {
+      cerr << "Matrix series " << transname << " has no matrix for volume "
+	   << m << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// the 4D input volumes are never given a newimage sinc kernel (nor set to
+//  sinc interpolation, which makes a default one): those kernels live in a
+//  shared registry that is not thread safe, and the volumes are set up,
+//  copied and freed in the resampling threads.  The sinc resampling takes
+//  the kernel from its window and width instead.
+
+template <class T>
+void setup_input_volume(const volume<T>& invol)
+{
+  invol.setpadvalue(invol.backgroundval());
+  invol.setextrapolationmethod(extraslice);
+  if (interpmethod != sinc) invol.setinterpolationmethod(interpmethod);
+}
+
+
+// resamples one volume of a 4D input (set up as by setup_input_volume),
+//  with the table-driven sinc or the threaded spline resampling when they
+//  are used - other types are converted to float for these, and back
+//  again as newimage would
+
+void resample_volume(const volume<float>& invol, volume<float>& outvol,
+		     const Matrix& affmat)
+{
+  if (interpmethod == sinc) {
+    fast_sinc_transform(invol,outvol,affmat,0.0,"b",7,1);
+  } else if (interpmethod == spline) {
+    fast_spline_transform(invol,outvol,affmat,0.0,1);
+  } else {
+    affine_transform(invol,outvol,affmat);
+  }
+}
+
+
+template <class T>
+void resample_volume(const volume<T>& invol, volume<T>& outvol,
+		     const Matrix& affmat)
+{
+  if ((interpmethod != sinc) && (interpmethod != spline)) {
+    affine_transform(invol,outvol,affmat);
+    return;
+  }
+  volume<float> finvol, foutvol;
+  copyconvert(invol,finvol);
+  copyconvert(outvol,foutvol);
+  finvol.setpadvalue((float) invol.getpadvalue());
+  finvol.setextrapolationmethod(extraslice);
+  if (interpmethod == spline) finvol.setinterpolationmethod(spline);
+  resample_volume(finvol,foutvol,affmat);
+  copyconvert(foutvol,outvol);
+}
+
+
+// 4D mode, one volume at a time: a reader thread and a writer thread are
+//  joined to the resampling by queues, and the resampling takes batches of
+//  nthreads volumes, so only a few times nthreads volumes (and the
+//  reference) are held in memory at any time
+// returns 1, having done nothing, if the images cannot be streamed
+
+template <class T>
+int stream_applyxfm4D()
+{
+  NiftiStreamReader reader, refreader;
+  if ( (reader.open(iname)!=0) || (refreader.open(refname)!=0) ) return 1;
+  refreader.close();   // only the header is needed
+  int nvols = reader.nvolumes();
+  if (!check_series(nvols)) return -1;
+  if (!useseries && (nvols > 10001)) {
+    cerr << "WARNING:: More than 10000 volumes - only doing first 10000" << endl;
+    nvols = 10001;
+  }
+
+  // the output has the reference header, with the input timing and type
+  nifti_1_header outhdr = refreader.header();
+  outhdr.pixdim[4] = ((reader.header().dim[0]>=4) ? reader.header().pixdim[4] : 1.0);
+  outhdr.xyzt_units = (refreader.header().xyzt_units & 0x07)
+                        | (reader.header().xyzt_units & 0x38);
+  volume<T> refvol, inprops;
+  read_volume(refvol,refname);
+  read_volume_hdr_only(inprops,iname);
+  NiftiStreamWriter writer;
+  if (writer.open(oname,outhdr,nvols,nifti_datatype((T*) 0))!=0) return 1;
+  if (verbose) {
+    cout << "using interpolation method (enum, string): " << interpmethod << ", " << usrinterp << endl;
+    cout << "streaming " << nvols << " volumes" << endl;
+  }
+  int nx=reader.xsize(), ny=reader.ysize(), nz=reader.zsize();
+
+  BoundedQueue<volume<T>*> readqueue(Max(2,nthreads)), writequeue(Max(2,nthreads));
+  bool readerror=false, writeerror=false;
+  std::atomic<bool> abandoned(false);
+  std::thread readthread([&]() {
+      for (int m=0; m<nvols; m++) {
+	volume<T> *invol = new volume<T>(nx,ny,nz);
+	invol->copyproperties(inprops);
+	if (reader.read_next(invol->nsfbegin())!=0) {
+	  readerror = true;
+	  delete invol;
+	  break;
+	}
+	if (!readqueue.push(invol)) { delete invol; break; }
+      }
+      readqueue.close();
+    });
+  std::thread writethread([&]() {
+      volume<T> *outvol;
+      while (writequeue.pop(outvol)) {
+	if (!abandoned && !writeerror && (writer.write_next(outvol->fbegin())!=0)) {
+	  writeerror = true;
+	}
+	delete outvol;
+      }
+    });
+
+  std::vector<volume<T>*> invols, outvols;
+  // after an error: stops both threads (the writer discards anything still
+  //  queued), frees the volumes in flight and removes the partial output
+  auto abandon = [&]() {
+    abandoned = true;
+    readqueue.close();
+    writequeue.close();
+    readthread.join();
+    writethread.join();
+    volume<T> *vol;
+    while (readqueue.pop(vol)) { delete vol; }
+    for (unsigned int n=0; n<invols.size(); n++) { delete invols[n]; }
+    for (unsigned int n=0; n<outvols.size(); n++) { delete outvols[n]; }
+    writer.discard();
+  };
+  int m=0;
+  try {
+    Matrix singlemat(4,4);
+    if (singlematrix) { singlemat = read_matrix_or_series_entry(transname); }
+    bool done=false;
+    while (!done) {
+      // take the next batch of volumes and resample them concurrently
+      invols.clear();
+      volume<T> *invol;
+      while (((int) invols.size()<nthreads) && !(done = !readqueue.pop(invol))) {
+	invols.push_back(invol);
+      }
+      outvols.assign(invols.size(),(volume<T>*) 0);
+      for (unsigned int n=0; n<invols.size(); n++) {
+	outvols[n] = new volume<T>(refvol);
+      }
+      parallel_for(invols.size(),nthreads,[&](int n, int thread) {
+	  Matrix affmat = (singlematrix ? singlemat : read_volume_matrix(m+n));
+	  setup_input_volume(*(invols[n]));
+	  resample_volume(*(invols[n]),*(outvols[n]),affmat);
+	  delete invols[n];
+	  invols[n] = 0;
+	});
+      for (unsigned int n=0; n<outvols.size(); n++) {
+	writequeue.push(outvols[n]);
+	outvols[n] = 0;
+      }
+      m += invols.size();
+    }
+  }
+  catch (std::exception& e) {
+    abandon();
+    cerr << e.what() << endl;
+    return -1;
+  }
+  catch (...) {
+    abandon();
+    throw;
+  }
+  writequeue.close();
+  readthread.join();
+  writethread.join();
+
+  if (readerror) cerr << "Error reading volume " << m << " of " << iname << endl;
+  if (writeerror) cerr << "Error writing " << oname << endl;
+  if ((writer.close()!=0) || readerror || writeerror) {
+    writer.discard();
+    return -1;
+  }
+  return 0;
+}
+
+
+
 template <class T>
 int fmrib_main(int argc, char* argv[])
 {
+  if (fourd && streaming) {
+    int retval = stream_applyxfm4D<T>();
+    if (retval<=0) return retval;
+    cerr << "WARNING:: Cannot stream these images (only .nii and .nii.gz) - reading the whole input instead" << endl;
+  }
+
   if (fourd) {
     // 4D mode
     volume4D<T> invol, outvol;
-    volume<T> refvol, dummy;
+    volume<T> refvol;
     read_volume4D(invol,iname);
     for (int t=0; t<invol.tsize(); t++) {
       invol[t].setpadvalue(invol[t].backgroundval());
@@ -41,45 +292,37 @@ int fmrib_main(int argc, char* argv[])
       cout << "using interpolation method (enum, string): " << interpmethod << ", " << usrinterp << endl;
     }
     invol.setextrapolationmethod(extraslice);
-    invol.setinterpolationmethod(interpmethod);
-    if (interpmethod == sinc) {
-        invol.definesincinterpolation("b",7);
-    }
+    if (interpmethod != sinc) invol.setinterpolationmethod(interpmethod);
 
     // old form used a volume number
     //    refvol = invol[atoi(refname.c_str())];
 
     read_volume(refvol,refname);
 
-    Matrix affmat(4,4);
-    string matname;
-    if (singlematrix) { affmat = read_ascii_matrix(transname); }
+    Matrix singlemat(4,4);
+    if (singlematrix) { singlemat = read_matrix_or_series_entry(transname); }
 
-    if (invol.maxt() - invol.mint() > 10000) {
+    // the 10000 volume limit only applies to the MAT_NNNN files
+    int mint = invol.mint();
+    int nvols = invol.maxt() - mint + 1;
+    if (!check_series(nvols)) return -1;
+    if (!useseries && (invol.maxt() - invol.mint() > 10000)) {
       cerr << "WARNING:: More than 10000 volumes - only doing first 10000" << endl;
+      nvols = 10001;
     }
 
-    for (int m=invol.mint(); m<=Min(invol.maxt(),invol.mint()+10000); m++) {
-
-      if (!singlematrix) {
-	matname = transname + matprefix;
-	char nc='0';
-	int n = m;
-	matname += (nc + (char) (n / 1000));
-	n -= (n/1000)*1000;
-	matname += (nc + (char) (n / 100));
-	n -= (n/100)*100;
-	matname += (nc + (char) (n / 10));
-	n -= (n/10)*10;
-	matname += (nc + (char) n);
-	cout << matname << endl;
-	affmat = read_ascii_matrix(matname);
-      }
-
-      dummy = refvol;
-      affine_transform(invol[m],dummy,affmat);
-      outvol.addvolume(dummy);
+    // make all the output volumes first, then fill them concurrently
+    //  (the 4D volumes are only indexed here, not in the threads)
+    std::vector<volume<T>*> inslots(nvols), outslots(nvols);
+    for (int n=0; n<nvols; n++) { outvol.addvolume(refvol); }
+    for (int n=0; n<nvols; n++) {
+      inslots[n] = &(invol[mint+n]);
+      outslots[n] = &(outvol[n]);
     }
+    parallel_for(nvols,nthreads,[&](int n, int thread) {
+	Matrix affmat = (singlematrix ? singlemat : read_volume_matrix(mint+n));
+	resample_volume(*(inslots[n]),*(outslots[n]),affmat);
+      });
     outvol.settdim(invol.tdim());
     outvol.setDisplayMaximumMinimum(0,0);
     save_volume4D(outvol,oname);
@@ -97,7 +340,7 @@ int fmrib_main(int argc, char* argv[])
     }
 
     Matrix affmat(4,4);
-    affmat = read_ascii_matrix(transname);
+    affmat = read_matrix_or_series_entry(transname);
 
     affine_transform(invol,outvol,affmat);
     outvol.settdim(invol.tdim());
@@ -135,11 +378,13 @@ int main(int argc,char *argv[])
   Tracer tr("main");
   if (argc<5) {
     cerr << "Usage: " << argv[0] << " <input volume> <ref volume>"
-    << " <output volume> <transformation matrix file/dir>\n\n" <<
+    << " <output volume> <transformation matrix file/dir/series>\n\n" <<
     "\t--interp, -interp <nearestneighbour (or nn), trilinear, spline, sinc (default)>\n" <<
     "\t--singlematrix, -singlematrix (flag option, do not provide an argument)\n" <<
     "\t--fourdigit, -fourdigit (flag option, do not provide an argument)\n" <<
-    "\t--userprefix, -userprefix <prefix>\n" << endl;
+    "\t--userprefix, -userprefix <prefix>\n" <<
+    "\t--stream, -stream (flag option, read, resample and write one volume at a time)\n" <<
+    "\t--nthreads, -nthreads <number of volumes resampled at once (default 1)>\n" << endl;
     return -1;
   }
 
@@ -148,6 +393,7 @@ int main(int argc,char *argv[])
   singlematrix = false;
   fourd = true;
   verbose = false;
+  streaming = false;
   // first four arguments are postional and must be in the correct order
   iname = argv[1];
   refname = argv[2];
@@ -176,6 +422,18 @@ int main(int argc,char *argv[])
     else if (option == "-3D" || option == "--3D" || option == "-3d" || option == "--3d") {
         fourd = false;
     }
+    else if (option == "-stream" || option == "--stream") {
+        streaming = true;
+    }
+    else if (option == "-nthreads" || option == "--nthreads") {
+        if (i++ <= argc) {
+            nthreads = atoi(argv[i]);
+            if (nthreads<1) {
+              cerr << "Number of threads must be at least 1" << endl;
+              exit(EXIT_FAILURE);
+            }
+        }
+    }
     else if (option == "--verbose" || option == "-verbose" || option == "-v") {
         verbose = true;
     }
@@ -0,0 +1,68 @@
+/*  boundedqueue.h
+
+    A fixed capacity queue for passing work between threads
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// push() waits while the queue is full and pop() waits while it is empty,
+//  so a chain of threads joined by these queues never holds more than the
+//  capacity of each queue in flight.  close() is called by the producer
+//  once it has finished (or failed), after which pop() returns false as
+//  soon as the queue has been emptied.  A consumer that gives up can also
+//  call close(), which makes any further push() return false at once.
+
+#if !defined(__boundedqueue_h)
+#define __boundedqueue_h
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(unsigned int capacity) : maxsize(capacity), closed(false)
+    { if (maxsize<1) maxsize=1; }
+
+  bool push(const T& item)
+    {
+      std::unique_lock<std::mutex> lock(qmutex);
+      notfull.wait(lock,[this]() { return (items.size()<maxsize) || closed; });
+      if (closed) return false;
+      items.push_back(item);
+      notempty.notify_one();
+      return true;
+    }
+
+  bool pop(T& item)
+    {
+      std::unique_lock<std::mutex> lock(qmutex);
+      notempty.wait(lock,[this]() { return !items.empty() || closed; });
+      if (items.empty()) return false;
+      item = items.front();
+      items.pop_front();
+      notfull.notify_one();
+      return true;
+    }
+
+  void close()
+    {
+      std::lock_guard<std::mutex> lock(qmutex);
+      closed = true;
+      notempty.notify_all();
+      notfull.notify_all();
+    }
+
+ private:
+  unsigned int maxsize;
+  bool closed;
+  std::deque<T> items;
+  std::mutex qmutex;
+  std::condition_variable notfull, notempty;
+};
+
+#endif
@@ -10,10 +10,12 @@
 #include <iostream>
 #include <fstream>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "armawrap/newmat.h"
 #include "newimage/newimageall.h"
 #include "miscmaths/miscmaths.h"
+#include "matseries.h"
 
 using namespace std;
 using namespace MISCMATHS;
@@ -74,6 +76,8 @@ void print_usage(int argc, char *argv[])
        << "Copyright(c) 1999-2007, University of Oxford (Mark Jenkinson)" << endl
        << endl
        << "Usage: " << argv[0] << " [options] <input-matrix-filename>" << endl
+       << "  (a matrix may be given as <series-file>:<index>, and a whole packed" << endl
+       << "   series file or MAT directory as input gives a packed series output)" << endl
        << "  e.g. " << argv[0] << " -omat <outmat> -inverse <inmat>" << endl
        << "       " << argv[0] << " -omat <outmat_AtoC> -concat <mat_BtoC> <mat_AtoB>" << endl << endl
        << "  Available options are:" << endl
@@ -188,6 +192,107 @@ int affmat2vector(const Matrix& aff, ColumnVector& params)
 }
 
 
+////////////////////////////////////////////////////////////////////////////
+
+// applies the requested operations to one matrix
+//  (fixmat and concatmat are empty if not used)
+
+void convert_matrix(Matrix& affmat, const Matrix& fixmat, const Matrix& concatmat)
+{
+  if (fixmat.Nrows()>=4) {
+    if (globalopts.verbose>2) {
+      cout << "Initial matrix:" << endl << affmat << endl;
+      cout << "Fix Scale-Skew matrix:" << endl << fixmat << endl;
+    }
+    // do the work of combining scale/skew from fix and rest from init
+    ColumnVector initp(12), fixp(12), combp(12);
+    affmat2vector(affmat,initp);
+    affmat2vector(fixmat,fixp);
+    combp.SubMatrix(1,6,1,1) = initp.SubMatrix(1,6,1,1);
+    combp.SubMatrix(7,12,1,1) = fixp.SubMatrix(7,12,1,1);
+    vector2affine(combp,affmat);
+  }
+
+  if (concatmat.Nrows()>=4) {
+    if (globalopts.verbose>2) {
+      cout << "Initial matrix:" << endl << affmat << endl;
+      cout << "Second matrix:" << endl << concatmat << endl;
+    }
+    affmat = concatmat * affmat;
+  }
+
+  // apply inverse (if requested)
+  if (globalopts.inverse) {
+    affmat = affmat.i();
+  }
+}
+
+
+// reads the matrix series for -fixscaleskew or -concat, if the file is a
+//  series (or a MAT directory), or else a single matrix (to use for all)
+
+bool read_second_matrix(const string& fname, MatrixSeries& series, Matrix& mat)
+{
+  if (is_matrix_series(fname)) return (series.read(fname)==0);
+  struct stat info;
+  if ((stat(fname.c_str(),&info)==0) && S_ISDIR(info.st_mode)) {
+    return (series.read_directory(fname)==0);
+  }
+  mat = read_matrix_or_series_entry(fname);
+  return (mat.Nrows()>=4);
+}
+
+
+// the series form: each matrix of the input series (a packed series file
+//  or a MAT directory) is converted, using the matching entry of any
+//  second series, and the results are written as a packed series
+
+int convert_series(MatrixSeries& inseries)
+{
+  MatrixSeries fixseries, concatseries;
+  Matrix fixmat, concatmat;
+  if (globalopts.fixfname.size() >= 1) {
+    if (!read_second_matrix(globalopts.fixfname,fixseries,fixmat)) {
+      cerr << "Cannot read fixscaleskew-matrix" << endl;
+      return -3;
+    }
+  }
+  if (globalopts.concatfname.size() >= 1) {
+    if (!read_second_matrix(globalopts.concatfname,concatseries,concatmat)) {
+      cerr << "Cannot read concat-matrix" << endl;
+      return -3;
+    }
+  }
+
+  MatrixSeries outseries;
+  std::vector<int> indices = inseries.indices();
+  for (unsigned int n=0; n<indices.size(); n++) {
+    int index = indices[n];
+    Matrix affmat = inseries.matrix(index);
+    if (fixseries.size()>0) fixmat = fixseries.matrix(index);
+    if (concatseries.size()>0) concatmat = concatseries.matrix(index);
+    if ( ((globalopts.fixfname.size() >= 1) && (fixmat.Nrows()<4)) ||
+	 ((globalopts.concatfname.size() >= 1) && (concatmat.Nrows()<4)) ) {
+      cerr << "No second matrix for entry " << index << endl;
+      return -3;
+    }
+    convert_matrix(affmat,fixmat,concatmat);
+    outseries.add(index,affmat);
+    if (globalopts.verbose>0) {
+      cout << index << ":" << endl << affmat << endl;
+    }
+  }
+
+  if (globalopts.outputmatascii.size() >= 1) {
+    if (outseries.write(globalopts.outputmatascii)!=0) {
+      cerr << "Cannot write matrix series " << globalopts.outputmatascii << endl;
+      return -4;
+    }
+  }
+  return 0;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////
 
 int main(int argc,char *argv[])
@@ -197,58 +302,50 @@ int main(int argc,char *argv[])
 
   volume<float> testvol, refvol, intervol;
 
+  // a series of matrices (packed file or MAT directory) as input
+  MatrixSeries inseries;
+  struct stat info;
+  if (is_matrix_series(globalopts.initmatfname)) {
+    if (inseries.read(globalopts.initmatfname)!=0) {
+      cerr << "Cannot read input-matrix series" << endl;
+      return -2;
+    }
+    return convert_series(inseries);
+  }
+  if ( (stat(globalopts.initmatfname.c_str(),&info)==0) && S_ISDIR(info.st_mode) ) {
+    if (inseries.read_directory(globalopts.initmatfname)!=0) {
+      cerr << "Cannot read input-matrix directory" << endl;
+      return -2;
+    }
+    return convert_series(inseries);
+  }
+
   // read matrices
   Matrix affmat(4,4);
-  affmat = read_ascii_matrix(globalopts.initmatfname);
+  affmat = read_matrix_or_series_entry(globalopts.initmatfname);
   if (affmat.Nrows()<4) {
     cerr << "Cannot read input-matrix" << endl;
     return -2;
   }
 
-
+  Matrix fixmat, concatmat;
   if (globalopts.fixfname.size() >= 1) {
-    Matrix fixmat(4,4);
-    fixmat = read_ascii_matrix(globalopts.fixfname);
-
+    fixmat = read_matrix_or_series_entry(globalopts.fixfname);
     if (fixmat.Nrows()<4) {
       cerr << "Cannot read fixscaleskew-matrix" << endl;
       return -3;
-    } else {
-      if (globalopts.verbose>2) {
-	cout << "Initial matrix:" << endl << affmat << endl;
-	cout << "Fix Scale-Skew matrix:" << endl << fixmat << endl;
-      }
-      // do the work of combining scale/skew from fix and rest from init
-      ColumnVector initp(12), fixp(12), combp(12);
-      affmat2vector(affmat,initp);
-      affmat2vector(fixmat,fixp);
-      combp.SubMatrix(1,6,1,1) = initp.SubMatrix(1,6,1,1);
-      combp.SubMatrix(7,12,1,1) = fixp.SubMatrix(7,12,1,1);
-      vector2affine(combp,affmat);
     }
   }
 
-
   if (globalopts.concatfname.size() >= 1) {
-    Matrix concatmat(4,4);
-    concatmat = read_ascii_matrix(globalopts.concatfname);
-
+    concatmat = read_matrix_or_series_entry(globalopts.concatfname);
     if (concatmat.Nrows()<4) {
       cerr << "Cannot read concat-matrix" << endl;
       return -3;
-    } else {
-      if (globalopts.verbose>2) {
-	cout << "Initial matrix:" << endl << affmat << endl;
-	cout << "Second matrix:" << endl << concatmat << endl;
-      }
-      affmat = concatmat * affmat;
     }
   }
 
-  // apply inverse (if requested)
-  if (globalopts.inverse) {
-    affmat = affmat.i();
-  }
+  convert_matrix(affmat,fixmat,concatmat);
 
 
   // Write outputs
@@ -0,0 +1,106 @@
+/*  costcache.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <cmath>
+
+#include "costcache.h"
+
+using namespace NEWMAT;
+using namespace NEWIMAGE;
+
+// quantisation steps for the linear part and the translations (mm)
+static const double linearquantum = 1e-6;
+static const double transquantum = 1e-5;
+
+
+CostCache::CostCache()
+  : maxsize(0), nhits(0), nmisses(0)
+{
+}
+
+
+void CostCache::set_capacity(int maxentries)
+{
+  std::lock_guard<std::mutex> lock(cachemutex);
+  maxsize = maxentries;
+  if (maxsize<0) maxsize=0;
+  while ((int) entries.size()>maxsize) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+}
+
+
+CostCache::CacheKey CostCache::make_key(const Matrix& affmat,
+					 const Costfn& pair, float scale) const
+{
+  CacheKey key;
+  for (int r=1; r<=3; r++) {
+    for (int c=1; c<=3; c++) {
+      key.push_back((long long) floor(affmat(r,c)/linearquantum + 0.5));
+    }
+    key.push_back((long long) floor(affmat(r,4)/transquantum + 0.5));
+  }
+  key.push_back((long long) floor(scale/linearquantum + 0.5));
+  key.push_back((long long) pair.get_costfn());
+  key.push_back((long long) pair.get_no_bins());
+  key.push_back((long long) floor(pair.smoothsize/linearquantum + 0.5));
+  key.push_back((long long) floor(pair.fuzzyfrac/linearquantum + 0.5));
+  return key;
+}
+
+
+bool CostCache::lookup(const Matrix& affmat, const Costfn& pair,
+		       float scale, float& cost)
+{
+  if (!enabled()) return false;
+  CacheKey key = make_key(affmat,pair,scale);
+  std::lock_guard<std::mutex> lock(cachemutex);
+  std::map<CacheKey,std::list<CacheEntry>::iterator>::iterator it
+    = index.find(key);
+  if (it==index.end()) {
+    nmisses++;
+    return false;
+  }
+  // move to the front (most recently used)
+  entries.splice(entries.begin(),entries,it->second);
+  cost = it->second->second;
+  nhits++;
+  return true;
+}
+
+
+void CostCache::store(const Matrix& affmat, const Costfn& pair,
+		      float scale, float cost)
+{
+  if (!enabled()) return;
+  CacheKey key = make_key(affmat,pair,scale);
+  std::lock_guard<std::mutex> lock(cachemutex);
+  std::map<CacheKey,std::list<CacheEntry>::iterator>::iterator it
+    = index.find(key);
+  if (it!=index.end()) {
+    // another thread got here first
+    it->second->second = cost;
+    entries.splice(entries.begin(),entries,it->second);
+    return;
+  }
+  entries.push_front(CacheEntry(key,cost));
+  index[key] = entries.begin();
+  if ((int) entries.size()>maxsize) {
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+}
+
+
+void CostCache::clear()
+{
+  std::lock_guard<std::mutex> lock(cachemutex);
+  entries.clear();
+  index.clear();
+}
@@ -0,0 +1,62 @@
+/*  costcache.h
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#ifndef __COSTCACHE_
+#define __COSTCACHE_
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "armawrap/newmat.h"
+#include "newimage/costfns.h"
+
+// A least-recently-used store of cost function values, so that schedules
+//  that re-measure the same matrix (at the same scale and with the same
+//  cost function settings) do not recompute it.
+//
+// Entries are keyed on the 12 affine matrix parameters (quantised, so that
+//  matrices equal to within rounding share an entry) together with the
+//  sampling scale, cost function type, number of bins, smoothing and fuzzy
+//  fraction.  A capacity of zero (the default) disables the cache.
+//  Lookups and stores may be made from several threads at once.
+
+class CostCache {
+ public:
+  CostCache();
+
+  void set_capacity(int maxentries);
+  int capacity() const { return maxsize; }
+  bool enabled() const { return (maxsize>0); }
+
+  bool lookup(const NEWMAT::Matrix& affmat, const NEWIMAGE::Costfn& pair,
+	      float scale, float& cost);
+  void store(const NEWMAT::Matrix& affmat, const NEWIMAGE::Costfn& pair,
+	     float scale, float cost);
+  void clear();
+
+  long hits() const { return nhits; }
+  long misses() const { return nmisses; }
+
+ private:
+  typedef std::vector<long long> CacheKey;
+  typedef std::pair<CacheKey,float> CacheEntry;
+
+  int maxsize;
+  long nhits;
+  long nmisses;
+  std::list<CacheEntry> entries;  // most recently used first
+  std::map<CacheKey,std::list<CacheEntry>::iterator> index;
+  std::mutex cachemutex;
+
+  CacheKey make_key(const NEWMAT::Matrix& affmat,
+		    const NEWIMAGE::Costfn& pair, float scale) const;
+};
+
+#endif
@@ -0,0 +1,683 @@
+/*  fastfilters.cc
+
+    Separable, vectorised and multi-threaded versions of the newimage
+    filters used to build the FLIRT multi-resolution volumes
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <cmath>
+#include <vector>
+// the vector code is compiled for AVX-512 and AVX whatever the compiler
+//  flags, and only called when the processor has them
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTFILTERS_X86
+#include <immintrin.h>
+#endif
+
+#include "NewNifti/NewNifti.h"
+#include "miscmaths/miscmaths.h"
+#include "fastfilters.h"
+#include "parallelfor.h"
+
+using namespace NiftiIO;
+using namespace NEWMAT;
+using namespace MISCMATHS;
+using namespace NEWIMAGE;
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// the widest vectors the processor (and operating system) support:
+//  2 for AVX-512, 1 for AVX and 0 for neither
+
+static int simd_level()
+{
+#if defined(FASTFILTERS_X86)
+  static const int level = (__builtin_cpu_init(),
+			    (__builtin_cpu_supports("avx512f") ? 2 :
+			     (__builtin_cpu_supports("avx") ? 1 : 0)));
+  return level;
+#else
+  return 0;
+#endif
+}
+
+
+#if defined(FASTFILTERS_X86)
+// the vector parts of axpy, each returning the first i not done
+
+__attribute__((target("avx")))
+static int axpy_avx(float *out, const float *in, float k, int n)
+{
+  int i=0;
+  __m256 kv8 = _mm256_set1_ps(k);
+  for (; i+8<=n; i+=8) {
+    __m256 prod = _mm256_mul_ps(_mm256_loadu_ps(in+i),kv8);
+    _mm256_storeu_ps(out+i,_mm256_add_ps(_mm256_loadu_ps(out+i),prod));
+  }
+  return i;
+}
+
+
+__attribute__((target("avx512f")))
+static int axpy_avx512(float *out, const float *in, float k, int n)
+{
+  int i=0;
+  __m512 kv = _mm512_set1_ps(k);
+  for (; i+16<=n; i+=16) {
+    __m512 prod = _mm512_mul_ps(_mm512_loadu_ps(in+i),kv);
+    _mm512_storeu_ps(out+i,_mm512_add_ps(_mm512_loadu_ps(out+i),prod));
+  }
+  __m256 kv8 = _mm256_set1_ps(k);
+  for (; i+8<=n; i+=8) {
+    __m256 prod = _mm256_mul_ps(_mm256_loadu_ps(in+i),kv8);
+    _mm256_storeu_ps(out+i,_mm256_add_ps(_mm256_loadu_ps(out+i),prod));
+  }
+  return i;
+}
+#endif
+
+
+// out[i] += k * in[i] for i = 0 to n-1
+
+static inline void axpy(float *out, const float *in, float k, int n)
+{
+  int i=0;
+#if defined(FASTFILTERS_X86)
+  int level = simd_level();
+  if (level==2) i = axpy_avx512(out,in,k,n);
+  else if (level==1) i = axpy_avx(out,in,k,n);
+#endif
+  for (; i<n; i++) { out[i] += in[i]*k; }
+}
+
+
+// true if everything outside the volume is treated as zero by newimage
+
+static bool zero_outside(const volume<float>& vol)
+{
+  extrapolation ex = vol.getextrapolationmethod();
+  if (ex==zeropad) return true;
+  if ( (ex==constpad) || (ex==boundsassert) || (ex==boundsexception) )
+    return (vol.getpadvalue()==0.0f);
+  return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// BLURRING
+
+// the newimage gaussian_kernel1D, stored as float as in convolve_separable
+
+static void gaussian_kernel(float sigma, int radius, std::vector<float>& kern)
+{
+  std::vector<double> vals(2*radius+1);
+  float sum=0.0, val=0.0;
+  for (int j=-radius; j<=radius; j++) {
+    if (sigma>1e-6) {
+      val = exp(-(j*j)/(2.0*sigma*sigma));
+    } else {
+      val = (j==0) ? 1.0 : 0.0;
+    }
+    vals[j+radius] = val;
+    sum += val;
+  }
+  kern.resize(vals.size());
+  for (unsigned int n=0; n<vals.size(); n++) { kern[n] = vals[n]*(1.0/sum); }
+}
+
+
+// the same kernels as newimage blur
+
+static void blur_kernels(const volume<float>& source, float iso_resel_size,
+			 std::vector<float>& kernelx, std::vector<float>& kernely,
+			 std::vector<float>& kernelz)
+{
+  float sigmax = 0.85*(iso_resel_size/source.xdim());
+  float sigmay = 0.85*(iso_resel_size/source.ydim());
+  float sigmaz = 0.85*(iso_resel_size/source.zdim());
+  int nx=((int) (sigmax-0.001))*2 + 3;
+  int ny=((int) (sigmay-0.001))*2 + 3;
+  int nz=((int) (sigmaz-0.001))*2 + 3;
+  gaussian_kernel(sigmax,nx,kernelx);
+  gaussian_kernel(sigmay,ny,kernely);
+  gaussian_kernel(sigmaz,nz,kernelz);
+}
+
+
+// convolve along one axis (0=x, 1=y, 2=z) with zero padding, summing the
+//  kernel terms in the same order as newimage convolve
+
+static void convolve_axis(const float *in, float *out, int nx, int ny, int nz,
+			  int axis, const std::vector<float>& kern, int nthreads)
+{
+  int klen = kern.size();
+  int mid = (klen-1)/2;
+  long slice = (long) nx*ny;
+  parallel_for(nz,nthreads,[&](int z, int thread) {
+      float *oslice = out + z*slice;
+      if (axis==2) {
+	for (long i=0; i<slice; i++) oslice[i]=0.0f;
+	for (int m=0; m<klen; m++) {
+	  int zs = z + m - mid;
+	  if ((zs<0) || (zs>=nz)) continue;
+	  axpy(oslice,in + zs*slice,kern[m],slice);
+	}
+      } else if (axis==1) {
+	const float *islice = in + z*slice;
+	for (int y=0; y<ny; y++) {
+	  float *orow = oslice + y*nx;
+	  for (int x=0; x<nx; x++) orow[x]=0.0f;
+	  for (int m=0; m<klen; m++) {
+	    int ys = y + m - mid;
+	    if ((ys<0) || (ys>=ny)) continue;
+	    axpy(orow,islice + ys*nx,kern[m],nx);
+	  }
+	}
+      } else {
+	const float *islice = in + z*slice;
+	for (int y=0; y<ny; y++) {
+	  const float *irow = islice + y*nx;
+	  float *orow = oslice + y*nx;
+	  for (int x=0; x<nx; x++) orow[x]=0.0f;
+	  for (int m=0; m<klen; m++) {
+	    int shift = m - mid;
+	    int x0 = (shift<0) ? -shift : 0;
+	    int x1 = (shift>0) ? nx-shift : nx;
+	    if (x1>x0) axpy(orow+x0,irow+x0+shift,kern[m],x1-x0);
+	  }
+	}
+      }
+    });
+}
+
+
+volume<float> fast_blur(const volume<float>& source, float iso_resel_size,
+			int nthreads)
+{
+  if (!zero_outside(source)) return blur(source,iso_resel_size);
+
+  std::vector<float> kernelx, kernely, kernelz;
+  blur_kernels(source,iso_resel_size,kernelx,kernely,kernelz);
+
+  volume<float> result(source);
+  int sx=source.xsize(), sy=source.ysize(), sz=source.zsize();
+  std::vector<float> tmp((long) sx*sy*sz);
+  convolve_axis(source.fbegin(),result.nsfbegin(),sx,sy,sz,0,kernelx,nthreads);
+  convolve_axis(result.nsfbegin(),&(tmp[0]),sx,sy,sz,1,kernely,nthreads);
+  convolve_axis(&(tmp[0]),result.nsfbegin(),sx,sy,sz,2,kernelz,nthreads);
+  return result;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// ISOTROPIC RESAMPLING
+
+// the newimage trilinear interpolation formula
+
+static inline float q_tri(float v000, float v001, float v010, float v011,
+			  float v100, float v101, float v110, float v111,
+			  float dx, float dy, float dz)
+{
+  float temp1, temp2, temp3, temp4, temp5, temp6;
+  temp1 = (v100 - v000)*dx + v000;
+  temp2 = (v101 - v001)*dx + v001;
+  temp3 = (v110 - v010)*dx + v010;
+  temp4 = (v111 - v011)*dx + v011;
+  temp5 = (temp3 - temp1)*dy + temp1;
+  temp6 = (temp4 - temp2)*dy + temp2;
+  return (temp6 - temp5)*dz + temp5;
+}
+
+
+// the lower neighbour and fraction for each output sample along one axis
+//  (positions are accumulated in float, as in newimage)
+
+static void sample_table(int nout, float step, std::vector<int>& idx,
+			 std::vector<float>& frac)
+{
+  idx.resize(nout);
+  frac.resize(nout);
+  float f=0.0;
+  for (int n=0; n<nout; n++, f+=step) {
+    idx[n] = (int) floor(f);
+    frac[n] = f - idx[n];
+  }
+}
+
+
+// the sampling steps and output size used by newimage isotropic_resample
+
+static void resample_steps(const volume<float>& aniso, float scale,
+			   float& stepx, float& stepy, float& stepz,
+			   int& sx, int& sy, int& sz)
+{
+  stepx = scale / aniso.xdim();
+  stepy = scale / aniso.ydim();
+  stepz = scale / aniso.zdim();
+  sz = (int) Max(1.0, ( ((float) (aniso.maxz() - aniso.minz() + 1.0)) / stepz));
+  sy = (int) Max(1.0, ( ((float) (aniso.maxy() - aniso.miny() + 1.0)) / stepy));
+  sx = (int) Max(1.0, ( ((float) (aniso.maxx() - aniso.minx() + 1.0)) / stepx));
+}
+
+
+static void set_resample_properties(volume<float>& iso,
+				    const volume<float>& aniso, float scale)
+{
+  float stepx, stepy, stepz;
+  int sx, sy, sz;
+  resample_steps(aniso,scale,stepx,stepy,stepz,sx,sy,sz);
+  iso.copyproperties(aniso);
+  iso.setdims(scale,scale,scale);
+  // transform the sform and qform matrix appropriately (if set)
+  Matrix iso2aniso(4,4);
+  iso2aniso = 0.0;
+  iso2aniso(1,1)=stepx;
+  iso2aniso(2,2)=stepy;
+  iso2aniso(3,3)=stepz;
+  iso2aniso(4,4)=1.0;
+  if (aniso.sform_code()!=NIFTI_XFORM_UNKNOWN) {
+    iso.set_sform(aniso.sform_code(), aniso.sform_mat() * iso2aniso);
+  }
+  if (aniso.qform_code()!=NIFTI_XFORM_UNKNOWN) {
+    iso.set_qform(aniso.qform_code(), aniso.qform_mat() * iso2aniso);
+  }
+}
+
+
+volume<float> fast_isotropic_resample(const volume<float>& aniso, float scale,
+				      int nthreads)
+{
+  if ( (aniso.getinterpolationmethod()!=trilinear) || !zero_outside(aniso) )
+    return isotropic_resample(aniso,scale);
+  if (scale<0.0) scale = fabs(scale);   // newimage gives a warning
+
+  float stepx, stepy, stepz;
+  int sx, sy, sz;
+  resample_steps(aniso,scale,stepx,stepy,stepz,sx,sy,sz);
+
+  std::vector<int> ix, iy, iz;
+  std::vector<float> dx, dy, dz;
+  sample_table(sx,stepx,ix,dx);
+  sample_table(sy,stepy,iy,dy);
+  sample_table(sz,stepz,iz,dz);
+
+  volume<float> iso(sx,sy,sz);
+  const float *in = aniso.fbegin();
+  float *out = iso.nsfbegin();
+  int nx=aniso.xsize(), ny=aniso.ysize(), nz=aniso.zsize();
+  long slice = (long) nx*ny;
+  parallel_for(sz,nthreads,[&](int z, int thread) {
+      int z0=iz[z];
+      bool zin0 = (z0>=0) && (z0<nz), zin1 = (z0+1>=0) && (z0+1<nz);
+      for (int y=0; y<sy; y++) {
+	int y0=iy[y];
+	bool yin0 = (y0>=0) && (y0<ny), yin1 = (y0+1>=0) && (y0+1<ny);
+	const float *r00 = (zin0 && yin0) ? in + z0*slice + (long) y0*nx : 0;
+	const float *r10 = (zin0 && yin1) ? in + z0*slice + (long) (y0+1)*nx : 0;
+	const float *r01 = (zin1 && yin0) ? in + (z0+1)*slice + (long) y0*nx : 0;
+	const float *r11 = (zin1 && yin1) ? in + (z0+1)*slice + (long) (y0+1)*nx : 0;
+	float *orow = out + ((long) z*sy + y)*sx;
+	for (int x=0; x<sx; x++) {
+	  int x0=ix[x];
+	  bool xin0 = (x0>=0) && (x0<nx), xin1 = (x0+1>=0) && (x0+1<nx);
+	  float v000 = (r00 && xin0) ? r00[x0] : 0.0f;
+	  float v100 = (r00 && xin1) ? r00[x0+1] : 0.0f;
+	  float v010 = (r10 && xin0) ? r10[x0] : 0.0f;
+	  float v110 = (r10 && xin1) ? r10[x0+1] : 0.0f;
+	  float v001 = (r01 && xin0) ? r01[x0] : 0.0f;
+	  float v101 = (r01 && xin1) ? r01[x0+1] : 0.0f;
+	  float v011 = (r11 && xin0) ? r11[x0] : 0.0f;
+	  float v111 = (r11 && xin1) ? r11[x0+1] : 0.0f;
+	  orow[x] = q_tri(v000,v001,v010,v011,v100,v101,v110,v111,
+			  dx[x],dy[y],dz[z]);
+	}
+      }
+    });
+
+  set_resample_properties(iso,aniso,scale);
+  return iso;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// SUBSAMPLING
+
+// The centred newimage subsample_by_2 takes every other voxel after a
+//  3x3x3 blur whose weight depends only on how many of the directions are
+//  off-centre: 0.125 for the centre, 0.0625 for the 6 face neighbours,
+//  0.0312 for the 12 edge neighbours and 0.0156 for the 8 corners.  These
+//  are (1/4 1/2 1/4) in each direction, truncated, so they sum to 0.9992
+//  and the blur is not quite separable.  Here it is still done in three
+//  passes, each halving one dimension: along x the centre and the sum of
+//  the two neighbours are kept apart, along y they are weighted into the
+//  two sums that the centre and the neighbours along z need, and along z
+//  those sums are added.
+
+static const float subsample_weights[4] = { 0.125f, 0.0625f, 0.0312f, 0.0156f };
+
+
+static void halve_x(const float *in, float *cen, float *nbr,
+		    int nx, int ny, int nz, int nthreads)
+{
+  int ox = (nx+1)/2;
+  parallel_for(nz,nthreads,[&](int z, int thread) {
+      for (int y=0; y<ny; y++) {
+	const float *irow = in + ((long) z*ny + y)*nx;
+	float *crow = cen + ((long) z*ny + y)*ox;
+	float *nrow = nbr + ((long) z*ny + y)*ox;
+	for (int x=0; x<ox; x++) {
+	  int bx = 2*x;
+	  float val = 0.0f;
+	  if (bx>0) val += irow[bx-1];
+	  if (bx+1<nx) val += irow[bx+1];
+	  crow[x] = irow[bx];
+	  nrow[x] = val;
+	}
+      }
+    });
+}
+
+
+// cen and nbr (nx by ny by nz, halved along x already) into the sums that
+//  the centre and the neighbours along z take, each halved along y
+
+static void halve_y(const float *cen, const float *nbr, float *csum, float *nsum,
+		    int nx, int ny, int nz, int nthreads)
+{
+  const float *w = subsample_weights;
+  int oy = (ny+1)/2;
+  long islice = (long) nx*ny, oslice = (long) nx*oy;
+  parallel_for(nz,nthreads,[&](int z, int thread) {
+      for (int y=0; y<oy; y++) {
+	float *crow = csum + z*oslice + (long) y*nx;
+	float *nrow = nsum + z*oslice + (long) y*nx;
+	for (int x=0; x<nx; x++) { crow[x]=0.0f;  nrow[x]=0.0f; }
+	for (int by=2*y-1; by<=2*y+1; by++) {
+	  if ((by<0) || (by>=ny)) continue;
+	  int ky = ((by==2*y) ? 0 : 1);   // off-centre along y
+	  const float *c = cen + z*islice + (long) by*nx;
+	  const float *n = nbr + z*islice + (long) by*nx;
+	  axpy(crow,c,w[ky],nx);
+	  axpy(crow,n,w[ky+1],nx);
+	  axpy(nrow,c,w[ky+1],nx);
+	  axpy(nrow,n,w[ky+2],nx);
+	}
+      }
+    });
+}
+
+
+static void halve_z(const float *csum, const float *nsum, float *out,
+		    int nx, int ny, int nz, int nthreads)
+{
+  int oz = (nz+1)/2;
+  long slice = (long) nx*ny;
+  parallel_for(oz,nthreads,[&](int z, int thread) {
+      float *os = out + z*slice;
+      int bz = 2*z;
+      for (long i=0; i<slice; i++) os[i]=0.0f;
+      if (bz>0) axpy(os,nsum + (bz-1)*slice,1.0f,slice);
+      axpy(os,csum + bz*slice,1.0f,slice);
+      if (bz+1<nz) axpy(os,nsum + (bz+1)*slice,1.0f,slice);
+    });
+}
+
+
+static void set_subsample_properties(volume<float>& halfvol,
+				     const volume<float>& refvol)
+{
+  halfvol.copyproperties(refvol);
+  halfvol.setdims(refvol.xdim() * 2.0, refvol.ydim() * 2.0, refvol.zdim() * 2.0);
+  // set sform and qform appropriately (if set)
+  Matrix sub2mat(4,4);
+  sub2mat = IdentityMatrix(4);
+  sub2mat(1,1) = 2.0;
+  sub2mat(2,2) = 2.0;
+  sub2mat(3,3) = 2.0;
+  if (refvol.sform_code()!=NIFTI_XFORM_UNKNOWN) {
+    halfvol.set_sform(refvol.sform_code(),refvol.sform_mat()*sub2mat);
+  }
+  if (refvol.qform_code()!=NIFTI_XFORM_UNKNOWN) {
+    halfvol.set_qform(refvol.qform_code(),refvol.qform_mat()*sub2mat);
+  }
+}
+
+
+volume<float> fast_subsample_by_2(const volume<float>& refvol, int nthreads)
+{
+  if (!zero_outside(refvol)) return subsample_by_2(refvol);
+
+  int nx=refvol.xsize(), ny=refvol.ysize(), nz=refvol.zsize();
+  int sx=(nx+1)/2, sy=(ny+1)/2, sz=(nz+1)/2;
+  volume<float> halfvol(sx,sy,sz);
+  set_subsample_properties(halfvol,refvol);
+
+  std::vector<float> cenx((long) sx*ny*nz), nbrx((long) sx*ny*nz);
+  halve_x(refvol.fbegin(),&(cenx[0]),&(nbrx[0]),nx,ny,nz,nthreads);
+  std::vector<float> csum((long) sx*sy*nz), nsum((long) sx*sy*nz);
+  halve_y(&(cenx[0]),&(nbrx[0]),&(csum[0]),&(nsum[0]),sx,ny,nz,nthreads);
+  halve_z(&(csum[0]),&(nsum[0]),halfvol.nsfbegin(),sx,sy,nz,nthreads);
+  return halfvol;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// FUSED WEIGHTED FILTERING
+
+// Each of the filters is applied as a linear operator along each axis in
+//  turn: out[j] = sum over t of wts[t]*in[idx[t]], for t from start[j] to
+//  start[j+1]-1 (with zero padding outside).  The blurs are separable, but
+//  the subsampling is not quite (see above), so each tap also has a class
+//  (0 for the centre, 1 for a neighbour) and the 3D weight of a tap is the
+//  product of its weights times classweight[cx+cy+cz].
+
+class LineOperator {
+ public:
+  int nout;
+  std::vector<int> start;
+  std::vector<int> idx;
+  std::vector<float> wts;
+  std::vector<int> cls;
+
+  void begin(int n) { nout=n; start.assign(1,0); idx.clear(); wts.clear(); cls.clear(); }
+  void add(int i, float w, int c=0) { idx.push_back(i); wts.push_back(w); cls.push_back(c); }
+  void next() { start.push_back(idx.size()); }
+  // the range of inputs needed for outputs j0 to j1-1
+  void input_range(int j0, int j1, int& i0, int& i1) const
+    {
+      i0=-1; i1=-1;
+      for (int t=start[j0]; t<start[j1]; t++) {
+	if ((i0<0) || (idx[t]<i0)) i0=idx[t];
+	if (idx[t]+1>i1) i1=idx[t]+1;
+      }
+      if (i0<0) { i0=0; i1=0; }
+    }
+};
+
+
+static void blur_operator(int n, const std::vector<float>& kern, LineOperator& op)
+{
+  int klen=kern.size(), mid=(klen-1)/2;
+  op.begin(n);
+  for (int j=0; j<n; j++) {
+    for (int m=0; m<klen; m++) {
+      int i = j + m - mid;
+      if ((i>=0) && (i<n)) op.add(i,kern[m]);
+    }
+    op.next();
+  }
+}
+
+
+static void subsample_operator(int n, LineOperator& op)
+{
+  op.begin((n+1)/2);
+  for (int j=0; j<op.nout; j++) {
+    if (2*j-1>=0) op.add(2*j-1,1.0f,1);
+    op.add(2*j,1.0f,0);
+    if (2*j+1<n) op.add(2*j+1,1.0f,1);
+    op.next();
+  }
+}
+
+
+static void resample_blur_operator(int n, const std::vector<float>& kern,
+				   int nout, float step, LineOperator& op)
+{
+  // linear interpolation (at positions accumulated in float, as in newimage)
+  //  of the blurred line, combined into a single set of weights
+  int klen=kern.size(), mid=(klen-1)/2;
+  op.begin(nout);
+  float f=0.0;
+  for (int j=0; j<nout; j++, f+=step) {
+    int i0 = (int) floor(f);
+    float d = f - i0;
+    for (int p=i0-mid; p<=i0+1+mid; p++) {
+      if ((p<0) || (p>=n)) continue;
+      float w=0.0;
+      if ((i0>=0) && (i0<n) && (p-i0+mid>=0) && (p-i0+mid<klen))
+	w += (1.0f-d)*kern[p-i0+mid];
+      if ((i0+1>=0) && (i0+1<n) && (p-i0-1+mid>=0) && (p-i0-1+mid<klen))
+	w += d*kern[p-i0-1+mid];
+      if (w!=0.0f) op.add(p,w);
+    }
+    op.next();
+  }
+}
+
+
+bool fast_masked_filter(volume<float>& result, const volume<float>& image,
+			const volume<float>& weight, float weightthresh,
+			bool normalise, float maskthresh, FastFilterType type,
+			float sampling, int nthreads)
+{
+  int nx=image.xsize(), ny=image.ysize(), nz=image.zsize();
+  if ( (weight.xsize()!=nx) || (weight.ysize()!=ny) || (weight.zsize()!=nz) )
+    return false;
+  // the filters see the properties of both the image and the weight
+  if (!zero_outside(image) || !zero_outside(weight)) return false;
+  if ( (type==FastResampBlur) && ( (image.getinterpolationmethod()!=trilinear)
+				   || (weight.getinterpolationmethod()!=trilinear) ) )
+    return false;
+  if ((type!=FastSubsample2) && (sampling<=0.0)) return false;
+
+  // set up the operators for each axis and the output volume
+  LineOperator opx, opy, opz;
+  volume<float> outvol;
+  int ncls=1;
+  float classweight[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+  if (type==FastSubsample2) {
+    ncls=2;
+    for (int k=0; k<4; k++) classweight[k] = subsample_weights[k];
+    subsample_operator(nx,opx);
+    subsample_operator(ny,opy);
+    subsample_operator(nz,opz);
+    outvol.reinitialize(opx.nout,opy.nout,opz.nout);
+    set_subsample_properties(outvol,image);
+  } else {
+    std::vector<float> kernelx, kernely, kernelz;
+    blur_kernels(image,sampling,kernelx,kernely,kernelz);
+    if (type==FastBlur) {
+      blur_operator(nx,kernelx,opx);
+      blur_operator(ny,kernely,opy);
+      blur_operator(nz,kernelz,opz);
+      outvol.reinitialize(nx,ny,nz);
+      outvol.copyproperties(image);
+    } else {
+      float stepx, stepy, stepz;
+      int sx, sy, sz;
+      resample_steps(image,sampling,stepx,stepy,stepz,sx,sy,sz);
+      resample_blur_operator(nx,kernelx,sx,stepx,opx);
+      resample_blur_operator(ny,kernely,sy,stepy,opy);
+      resample_blur_operator(nz,kernelz,sz,stepz,opz);
+      outvol.reinitialize(sx,sy,sz);
+      set_resample_properties(outvol,image,sampling);
+    }
+  }
+
+  const float *im = image.fbegin();
+  const float *wt = weight.fbegin();
+  float *out = outvol.nsfbegin();
+  int ox=opx.nout, oy=opy.nout, oz=opz.nout;
+  long islice = (long) nx*ny, oslice = (long) ox*oy;
+
+  // the output slices are done in blocks, each block first filtering (in x
+  //  and y) just the input slices it needs, for both the numerator and B;
+  //  the x filtering keeps the sums over each class of tap apart, and the y
+  //  filtering forms, for each class of z tap, the sum weighted as it needs
+  int nblocks = Min(oz,4*Max(nthreads,1));
+  parallel_for(nblocks,nthreads,[&](int b, int thread) {
+      int j0 = (int) (((long) oz*b)/nblocks), j1 = (int) (((long) oz*(b+1))/nblocks);
+      if (j1<=j0) return;
+      int z0, z1;
+      opz.input_range(j0,j1,z0,z1);
+      long xysize = (long) (z1-z0)*oslice, xsize = (long) ox*ny;
+      std::vector<float> numxy(ncls*xysize), denxy(ncls*xysize);
+      std::vector<float> numx(ncls*xsize), denx(ncls*xsize);
+      for (int z=z0; z<z1; z++) {
+	// x filtering, forming the numerator (I.*B or I) and B on the fly
+	for (int y=0; y<ny; y++) {
+	  const float *irow = im + z*islice + (long) y*nx;
+	  const float *wrow = wt + z*islice + (long) y*nx;
+	  for (int j=0; j<ox; j++) {
+	    float nval[2] = { 0.0f, 0.0f }, dval[2] = { 0.0f, 0.0f };
+	    for (int t=opx.start[j]; t<opx.start[j+1]; t++) {
+	      int i=opx.idx[t], c=opx.cls[t];
+	      float bval = (wrow[i]>=weightthresh) ? 1.0f : 0.0f;
+	      nval[c] += (normalise ? irow[i]*bval : irow[i])*opx.wts[t];
+	      dval[c] += bval*opx.wts[t];
+	    }
+	    for (int c=0; c<ncls; c++) {
+	      numx[c*xsize + (long) y*ox + j] = nval[c];
+	      denx[c*xsize + (long) y*ox + j] = dval[c];
+	    }
+	  }
+	}
+	// y filtering
+	for (int cz=0; cz<ncls; cz++) {
+	  float *nslice = &(numxy[cz*xysize + (long) (z-z0)*oslice]);
+	  float *dslice = &(denxy[cz*xysize + (long) (z-z0)*oslice]);
+	  for (long i=0; i<oslice; i++) { nslice[i]=0.0f; dslice[i]=0.0f; }
+	  for (int j=0; j<oy; j++) {
+	    for (int t=opy.start[j]; t<opy.start[j+1]; t++) {
+	      for (int cx=0; cx<ncls; cx++) {
+		float w = opy.wts[t]*classweight[cx+opy.cls[t]+cz];
+		long offset = cx*xsize + (long) opy.idx[t]*ox;
+		axpy(nslice + (long) j*ox,&(numx[offset]),w,ox);
+		axpy(dslice + (long) j*ox,&(denx[offset]),w,ox);
+	      }
+	    }
+	  }
+	}
+      }
+      // z filtering and the final combination
+      std::vector<float> nsum(oslice), dsum(oslice);
+      for (int j=j0; j<j1; j++) {
+	for (long i=0; i<oslice; i++) { nsum[i]=0.0f; dsum[i]=0.0f; }
+	for (int t=opz.start[j]; t<opz.start[j+1]; t++) {
+	  long offset = opz.cls[t]*xysize + (long) (opz.idx[t]-z0)*oslice;
+	  axpy(&(nsum[0]),&(numxy[offset]),opz.wts[t],oslice);
+	  axpy(&(dsum[0]),&(denxy[offset]),opz.wts[t],oslice);
+	}
+	float *oslicep = out + j*oslice;
+	for (long i=0; i<oslice; i++) {
+	  if (normalise) {
+	    oslicep[i] = (dsum[i]!=0.0f) ? nsum[i]/dsum[i] : 0.0f;
+	  } else {
+	    oslicep[i] = (dsum[i]>=maskthresh) ? nsum[i] : 0.0f;
+	  }
+	}
+      }
+    });
+  result = outvol;
+  return true;
+}
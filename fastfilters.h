@@ -0,0 +1,49 @@
+/*  fastfilters.h
+
+    Separable, vectorised and multi-threaded versions of the newimage
+    filters used to build the FLIRT multi-resolution volumes
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// Each function gives the same result (to within float rounding) as the
+//  newimage function of the same name, and falls back to that function
+//  for any volume it does not handle (non-zero padding or non-trilinear
+//  interpolation).  The inner loops use AVX-512 or AVX when the processor
+//  has them - this is checked at run time, so no special compiler flags
+//  are needed - and slices are shared over nthreads.
+
+#if !defined(__fastfilters_h)
+#define __fastfilters_h
+
+#include "newimage/newimageall.h"
+
+NEWIMAGE::volume<float> fast_blur(const NEWIMAGE::volume<float>& source,
+				  float iso_resel_size, int nthreads);
+
+NEWIMAGE::volume<float> fast_isotropic_resample(const NEWIMAGE::volume<float>& aniso,
+						float scale, int nthreads);
+
+NEWIMAGE::volume<float> fast_subsample_by_2(const NEWIMAGE::volume<float>& refvol,
+					    int nthreads);
+
+
+// Fused weighted filtering, where B is weight binarised at weightthresh:
+//  normalise=true   gives filter(I.*B)./filter(B)  (zero where filter(B) is 0)
+//  normalise=false  gives filter(I).*Thresh(filter(B))  (at maskthresh)
+// Both filters are done together, a block of slices at a time, without
+//  forming B, I.*B or the full size filtered volumes.  Returns false,
+//  leaving result unchanged, for volumes that it does not handle.
+
+enum FastFilterType { FastBlur, FastResampBlur, FastSubsample2 };
+
+bool fast_masked_filter(NEWIMAGE::volume<float>& result,
+			const NEWIMAGE::volume<float>& image,
+			const NEWIMAGE::volume<float>& weight,
+			float weightthresh, bool normalise, float maskthresh,
+			FastFilterType type, float sampling, int nthreads);
+
+#endif
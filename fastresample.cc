@@ -0,0 +1,781 @@
+/*  fastresample.cc
+
+    Affine resampling of whole volumes for the final FLIRT outputs
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+// the vector code is compiled for AVX2 (or, for the spline sums, the SSE
+//  every x86-64 processor has) whatever the compiler flags, and the AVX2
+//  parts are only called when the processor has it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTRESAMPLE_X86
+#include <immintrin.h>
+#endif
+
+#include "NewNifti/NewNifti.h"
+#include "miscmaths/miscmaths.h"
+#include "fastresample.h"
+#include "parallelfor.h"
+
+using namespace NEWMAT;
+using namespace MISCMATHS;
+using namespace NEWIMAGE;
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// distance (in voxels) kept between the directly sampled part of a row
+//  and the edge of the input volume, to allow for coordinate rounding
+static const double edge_margin = 1e-3;
+
+
+// whether the processor (and operating system) support AVX2
+
+static bool have_avx2()
+{
+#if defined(FASTRESAMPLE_X86)
+  static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+
+// narrows [x0,x1] to the x for which lo <= b + a*x <= hi
+//  (leaving x0>x1 if there are none)
+
+static void clip_row(double b, double a, double lo, double hi, int& x0, int& x1)
+{
+  if (x0>x1) return;
+  if (fabs(a)<1e-12) {
+    if ((b<lo) || (b>hi)) x1 = x0 - 1;
+    return;
+  }
+  double t0 = (lo-b)/a, t1 = (hi-b)/a;
+  if (t0>t1) std::swap(t0,t1);
+  if (t0>x0) x0 = (int) Min(ceil(t0),(double) x1+1);
+  if (t1<x1) x1 = (int) Max(floor(t1),(double) x0-1);
+}
+
+
+// trilinear interpolation, with the terms in the same order as newimage
+
+static inline float q_tri(float v000, float v001, float v010, float v011,
+			  float v100, float v101, float v110, float v111,
+			  float dx, float dy, float dz)
+{
+  float temp1, temp2, temp3, temp4, temp5, temp6;
+  temp1 = (v100 - v000)*dx + v000;
+  temp2 = (v101 - v001)*dx + v001;
+  temp3 = (v110 - v010)*dx + v010;
+  temp4 = (v111 - v011)*dx + v011;
+  temp5 = (temp3 - temp1)*dy + temp1;
+  temp6 = (temp4 - temp2)*dy + temp2;
+  return (temp6 - temp5)*dz + temp5;
+}
+
+
+// one output row: in voxel coordinates of the input, output voxel x is
+//  at (b1,b2,b3) + x*(a1,a2,a3)
+
+struct RowMap {
+  float b1, b2, b3, a1, a2, a3;
+};
+
+
+static void row_coefficients(const Matrix& vox2vox, int y, int z, double *b, double *a)
+{
+  for (int k=0; k<3; k++) {
+    a[k] = vox2vox(k+1,1);
+    b[k] = vox2vox(k+1,2)*y + vox2vox(k+1,3)*z + vox2vox(k+1,4);
+  }
+}
+
+
+static RowMap row_map(const Matrix& vox2vox, int y, int z)
+{
+  double b[3], a[3];
+  row_coefficients(vox2vox,y,z,b,a);
+  RowMap r;
+  r.b1=b[0];  r.b2=b[1];  r.b3=b[2];
+  r.a1=a[0];  r.a2=a[1];  r.a3=a[2];
+  return r;
+}
+
+
+// output blocks are tile_row voxels along x (so that the direct runs stay
+//  long enough to vectorise) by t by t, with t chosen so that the input
+//  footprint of a block, including kw voxels of kernel support, is about
+//  256KB of floats
+
+static const int tile_row = 64;
+
+static int tile_size(const Matrix& vox2vox, int kw)
+{
+  double scale = Max(pow(fabs(vox2vox.SubMatrix(1,3,1,3).Determinant()),1.0/3.0),0.01);
+  double t = (sqrt(65536.0/(tile_row*scale + kw)) - kw) / scale;
+  return (int) Max(4.0,Min(64.0,t));
+}
+
+
+// calls func(y,z,x0,x1) for every output row segment, either for whole
+//  rows (shared over threads a row at a time) or, if tile>0, for the rows
+//  of each block of tile_row x tile x tile output voxels (shared a block
+//  at a time), so that the input voxels read stay in cache even when a
+//  rotation makes the output rows stride across the input
+
+template <class F>
+static void traverse_output(int ox, int oy, int oz, int tile, int nthreads, F func)
+{
+  if (tile<=0) {
+    parallel_for(oy*oz,nthreads,[&](int row, int thread) {
+	func(row % oy,row / oy,0,ox-1);
+      });
+    return;
+  }
+  int nbx=(ox+tile_row-1)/tile_row, nby=(oy+tile-1)/tile, nbz=(oz+tile-1)/tile;
+  parallel_for(nbx*nby*nbz,nthreads,[&](int blk, int thread) {
+      int x0 = (blk % nbx)*tile_row, y0 = ((blk / nbx) % nby)*tile, z0 = (blk / (nbx*nby))*tile;
+      int x1 = Min(x0+tile_row,ox) - 1, y1 = Min(y0+tile,oy) - 1, z1 = Min(z0+tile,oz) - 1;
+      for (int z=z0; z<=z1; z++) {
+	for (int y=y0; y<=y1; y++) { func(y,z,x0,x1); }
+      }
+    });
+}
+
+
+// gives vout the sform and qform that newimage affine_transform would: a
+//  missing one is copied from the other, and if it has neither, those of
+//  vin are carried through the transform (vox2vox, from vout voxels to
+//  vin voxels)
+
+static void set_output_transforms(const volume<float>& vin, volume<float>& vout,
+				  const Matrix& vox2vox)
+{
+  if ( (vout.sform_code()==NIFTI_XFORM_UNKNOWN) &&
+       (vout.qform_code()!=NIFTI_XFORM_UNKNOWN) ) {
+    vout.set_sform(vout.qform_code(),vout.qform_mat());
+  }
+  if ( (vout.qform_code()==NIFTI_XFORM_UNKNOWN) &&
+       (vout.sform_code()!=NIFTI_XFORM_UNKNOWN) ) {
+    vout.set_qform(vout.sform_code(),vout.sform_mat());
+  }
+  if ( (vout.qform_code()==NIFTI_XFORM_UNKNOWN) &&
+       (vout.sform_code()==NIFTI_XFORM_UNKNOWN) ) {
+    if (vin.sform_code()!=NIFTI_XFORM_UNKNOWN) {
+      Matrix nmat = vin.sform_mat() * vox2vox;
+      vout.set_sform(vin.sform_code(),nmat);
+      vout.set_qform(vin.sform_code(),nmat);
+    } else if (vin.qform_code()!=NIFTI_XFORM_UNKNOWN) {
+      Matrix nmat = vin.qform_mat() * vox2vox;
+      vout.set_sform(vin.qform_code(),nmat);
+      vout.set_qform(vin.qform_code(),nmat);
+    }
+  }
+}
+
+
+#if defined(FASTRESAMPLE_X86)
+// the AVX2 part of sample_run: samples 8 voxels at a time from x0, and
+//  returns the first x not done
+
+__attribute__((target("avx2")))
+static int sample_run_avx2(const float *in, int nx, long slice, bool trilinear,
+			   const RowMap& r, float *orow, int x0, int x1)
+{
+  int x=x0;
+  const __m256 lane = _mm256_setr_ps(0,1,2,3,4,5,6,7);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  __m256 b1 = _mm256_set1_ps(r.b1), b2 = _mm256_set1_ps(r.b2), b3 = _mm256_set1_ps(r.b3);
+  __m256 a1 = _mm256_set1_ps(r.a1), a2 = _mm256_set1_ps(r.a2), a3 = _mm256_set1_ps(r.a3);
+  __m256i nxv = _mm256_set1_epi32(nx), slv = _mm256_set1_epi32((int) slice);
+  for (; x+8<=x1+1; x+=8) {
+    __m256 xs = _mm256_add_ps(_mm256_set1_ps((float) x),lane);
+    __m256 o1 = _mm256_add_ps(b1,_mm256_mul_ps(xs,a1));
+    __m256 o2 = _mm256_add_ps(b2,_mm256_mul_ps(xs,a2));
+    __m256 o3 = _mm256_add_ps(b3,_mm256_mul_ps(xs,a3));
+    if (!trilinear) {
+      o1 = _mm256_floor_ps(_mm256_add_ps(o1,half));
+      o2 = _mm256_floor_ps(_mm256_add_ps(o2,half));
+      o3 = _mm256_floor_ps(_mm256_add_ps(o3,half));
+    }
+    __m256 f1 = _mm256_floor_ps(o1), f2 = _mm256_floor_ps(o2), f3 = _mm256_floor_ps(o3);
+    __m256i idx = _mm256_add_epi32(_mm256_cvttps_epi32(f1),
+		    _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(f2),nxv),
+				     _mm256_mullo_epi32(_mm256_cvttps_epi32(f3),slv)));
+    if (!trilinear) {
+      _mm256_storeu_ps(orow+x,_mm256_i32gather_ps(in,idx,4));
+      continue;
+    }
+    __m256 dx = _mm256_sub_ps(o1,f1), dy = _mm256_sub_ps(o2,f2), dz = _mm256_sub_ps(o3,f3);
+    __m256 v000 = _mm256_i32gather_ps(in,idx,4);
+    __m256 v100 = _mm256_i32gather_ps(in+1,idx,4);
+    __m256 v010 = _mm256_i32gather_ps(in+nx,idx,4);
+    __m256 v110 = _mm256_i32gather_ps(in+nx+1,idx,4);
+    __m256 v001 = _mm256_i32gather_ps(in+slice,idx,4);
+    __m256 v101 = _mm256_i32gather_ps(in+slice+1,idx,4);
+    __m256 v011 = _mm256_i32gather_ps(in+slice+nx,idx,4);
+    __m256 v111 = _mm256_i32gather_ps(in+slice+nx+1,idx,4);
+    __m256 t1 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v100,v000),dx),v000);
+    __m256 t2 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v101,v001),dx),v001);
+    __m256 t3 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v110,v010),dx),v010);
+    __m256 t4 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(v111,v011),dx),v011);
+    __m256 t5 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(t3,t1),dy),t1);
+    __m256 t6 = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(t4,t2),dy),t2);
+    _mm256_storeu_ps(orow+x,_mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(t6,t5),dz),t5));
+  }
+  return x;
+}
+#endif
+
+
+// samples x0 to x1 of a row, all of which (and, for trilinear, their
+//  upper neighbours) must lie inside the input volume
+
+static void sample_run(const float *in, int nx, long slice, bool trilinear,
+		       bool usesimd, const RowMap& r, float *orow, int x0, int x1)
+{
+  int x=x0;
+#if defined(FASTRESAMPLE_X86)
+  if (usesimd) x = sample_run_avx2(in,nx,slice,trilinear,r,orow,x0,x1);
+#endif
+  for (; x<=x1; x++) {
+    float o1 = r.b1 + ((float) x)*r.a1;
+    float o2 = r.b2 + ((float) x)*r.a2;
+    float o3 = r.b3 + ((float) x)*r.a3;
+    if (!trilinear) {
+      orow[x] = in[(long) MISCMATHS::round(o3)*slice + (long) MISCMATHS::round(o2)*nx
+		   + MISCMATHS::round(o1)];
+      continue;
+    }
+    float f1 = floor(o1), f2 = floor(o2), f3 = floor(o3);
+    const float *p = in + (long) f3*slice + (long) f2*nx + (int) f1;
+    orow[x] = q_tri(p[0],p[slice],p[nx],p[slice+nx],
+		    p[1],p[slice+1],p[nx+1],p[slice+nx+1],
+		    o1-f1,o2-f2,o3-f3);
+  }
+}
+
+
+// samples x0 to x1 of a row near (or beyond) the edge of the input volume
+
+static void edge_run(const volume<float>& vin, float paddingsize, float padval,
+		     const RowMap& r, float *orow, int x0, int x1)
+{
+  float xb1 = vin.xsize() - 1 + paddingsize;
+  float yb1 = vin.ysize() - 1 + paddingsize;
+  float zb1 = vin.zsize() - 1 + paddingsize;
+  for (int x=x0; x<=x1; x++) {
+    float o1 = r.b1 + ((float) x)*r.a1;
+    float o2 = r.b2 + ((float) x)*r.a2;
+    float o3 = r.b3 + ((float) x)*r.a3;
+    if ( (o1<-paddingsize) || (o2<-paddingsize) || (o3<-paddingsize) ||
+	 (o1>xb1) || (o2>yb1) || (o3>zb1) ) {
+      orow[x] = padval;
+    } else {
+      orow[x] = vin.interpolate(o1,o2,o3);
+    }
+  }
+}
+
+
+void fast_affine_transform(const volume<float>& vin, volume<float>& vout,
+			   const Matrix& aff, float paddingsize, int nthreads,
+			   bool tiled)
+{
+  interpolation interp = vin.getinterpolationmethod();
+  extrapolation ex = vin.getextrapolationmethod();
+  if ( ((interp!=trilinear) && (interp!=nearestneighbour)) ||
+       (ex==boundsassert) || (ex==boundsexception) || (vout.nvoxels()<=0) ) {
+    affine_transform(vin,vout,aff,paddingsize,false);
+    return;
+  }
+
+  // output voxel coordinates to input voxel coordinates
+  Matrix vox2vox = vin.sampling_mat().i() * aff.i() * vout.sampling_mat();
+  set_output_transforms(vin,vout,vox2vox);
+
+  int nx=vin.xsize(), ny=vin.ysize(), nz=vin.zsize();
+  int ox=vout.xsize(), oy=vout.ysize(), oz=vout.zsize();
+  double nmax[3] = { nx-1.0, ny-1.0, nz-1.0 };
+  long slice = (long) nx*ny;
+  const float *in = vin.fbegin();
+  float *out = vout.nsfbegin();
+  float padval = vin.getpadvalue();
+  bool usetri = (interp==trilinear);
+  // the gathers use 32 bit voxel offsets
+  bool usesimd = have_avx2() && ((double) slice*nz < 2147483647.0);
+
+  int tile = (tiled ? tile_size(vox2vox,1) : 0);
+
+  // voxels outside [p0,p1] of a row are well beyond the padding, and those
+  //  in [i0,i1] have all their neighbours inside the input volume
+  auto clip = [&](int y, int z, int xstart, int xend,
+		  int& p0, int& p1, int& i0, int& i1) {
+    double b[3], a[3];
+    row_coefficients(vox2vox,y,z,b,a);
+    p0=xstart;  p1=xend;  i0=xstart;  i1=xend;
+    for (int k=0; k<3; k++) {
+      clip_row(b[k],a[k],-paddingsize-edge_margin,nmax[k]+paddingsize+edge_margin,p0,p1);
+      clip_row(b[k],a[k],edge_margin,nmax[k]-edge_margin,i0,i1);
+    }
+    if (i0>i1) { i0=p1+1;  i1=p1; }
+  };
+
+  std::atomic<bool> edges(false);
+  traverse_output(ox,oy,oz,tile,nthreads,[&](int y, int z, int xstart, int xend) {
+      RowMap r = row_map(vox2vox,y,z);
+      int p0, p1, i0, i1;
+      clip(y,z,xstart,xend,p0,p1,i0,i1);
+      float *orow = out + ((long) z*oy + y)*ox;
+      for (int x=xstart; x<=xend; x++) {
+	if ((x<p0) || (x>p1)) orow[x] = padval;
+      }
+      if (i0<=i1) sample_run(in,nx,slice,usetri,usesimd,r,orow,i0,i1);
+      if ((p0<i0) || (i1<p1)) edges = true;
+    });
+  if (!edges) return;
+
+  // the voxels near (or beyond) the edge, in this thread alone, as
+  //  vin.interpolate() writes vin's extrapolation value
+  traverse_output(ox,oy,oz,tile,1,[&](int y, int z, int xstart, int xend) {
+      RowMap r = row_map(vox2vox,y,z);
+      int p0, p1, i0, i1;
+      clip(y,z,xstart,xend,p0,p1,i0,i1);
+      float *orow = out + ((long) z*oy + y)*ox;
+      edge_run(vin,paddingsize,padval,r,orow,p0,i0-1);
+      edge_run(vin,paddingsize,padval,r,orow,i1+1,p1);
+    });
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// WINDOWED SINC
+
+// the newimage sinc kernel (of half-width hw voxels) sampled at nstore
+//  points, or false for an unknown window
+
+static bool sinc_table(const std::string& window, int hw, int nstore,
+		       std::vector<float>& table)
+{
+  int wintype=0;
+  if ((window=="hanning") || (window=="h")) { wintype=1; }
+  else if ((window=="blackman") || (window=="b")) { wintype=2; }
+  else if ((window=="rectangular") || (window=="r")) { wintype=3; }
+  else return false;
+  table.resize(nstore);
+  float halfnk = (nstore-1.0)/2.0;
+  for (int n=0; n<nstore; n++) {
+    float x = (n-halfnk)/halfnk*hw;
+    float val = 1.0 - fabs(x);
+    if (fabs(x)>=1e-7) { float y=M_PI*x;  val = sin(y)/y; }
+    if (wintype==1) val *= 0.5 + 0.5*cos(M_PI*x/hw);
+    if (wintype==2) val *= 0.42 + 0.5*cos(M_PI*x/hw) + 0.08*cos(2.0*M_PI*x/hw);
+    table[n] = val;
+  }
+  return true;
+}
+
+
+// the kernel at x (in voxels), linearly interpolated from the table as
+//  in newimage
+
+static inline float table_value(float x, int hw, const std::vector<float>& table)
+{
+  if (fabs(x)>hw) return 0.0f;
+  int nk = table.size();
+  float halfnk = (nk-1.0)/2.0;
+  float dn = x/hw*halfnk + halfnk + 1.0;
+  int n = (int) floor(dn);
+  dn -= n;
+  if ((n>=nk) || (n<1)) return 0.0f;
+  return table[n-1]*(1.0-dn) + table[n]*dn;
+}
+
+
+// sum of weighted taps jx0-jx1, jy0-jy1, jz0-jz1 from p (the first tap)
+
+static float sinc_sum(const float *p, int nx, long slice,
+		      const float *wx, int jx0, int jx1,
+		      const float *wy, int jy0, int jy1,
+		      const float *wz, int jz0, int jz1)
+{
+  float conv=0.0f;
+  for (int jz=jz0; jz<=jz1; jz++) {
+    float sumy=0.0f;
+    for (int jy=jy0; jy<=jy1; jy++) {
+      const float *row = p + jz*slice + jy*nx;
+      float sumx=0.0f;
+      for (int jx=jx0; jx<=jx1; jx++) { sumx += wx[jx]*row[jx]; }
+      sumy += wy[jy]*sumx;
+    }
+    conv += wz[jz]*sumy;
+  }
+  return conv;
+}
+
+
+#if defined(FASTRESAMPLE_X86)
+// the same over all ntap (at most 8) taps in each direction, with the
+//  rows of x taps read by one masked load
+
+__attribute__((target("avx")))
+static float sinc_sum8(const float *p, int nx, long slice, int ntap,
+		       const float *wx, const float *wy, const float *wz)
+{
+  __m256i xmask = _mm256_castps_si256(_mm256_cmp_ps(_mm256_set1_ps((float) ntap),
+				      _mm256_setr_ps(0,1,2,3,4,5,6,7),_CMP_GT_OQ));
+  __m256 accz = _mm256_setzero_ps();
+  for (int jz=0; jz<ntap; jz++) {
+    const float *row = p + jz*slice;
+    __m256 accy = _mm256_setzero_ps();
+    for (int jy=0; jy<ntap; jy++, row+=nx) {
+      accy = _mm256_add_ps(accy,_mm256_mul_ps(_mm256_set1_ps(wy[jy]),
+					      _mm256_maskload_ps(row,xmask)));
+    }
+    accz = _mm256_add_ps(accz,_mm256_mul_ps(_mm256_set1_ps(wz[jz]),accy));
+  }
+  accz = _mm256_mul_ps(accz,_mm256_maskload_ps(wx,xmask));
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(accz),_mm256_extractf128_ps(accz,1));
+  s = _mm_hadd_ps(s,s);
+  s = _mm_hadd_ps(s,s);
+  return _mm_cvtss_f32(s);
+}
+#endif
+
+
+// the value newimage's extrapolate() gives at voxel ix,iy,iz, which is
+//  what its sinc interpolation returns when none of the taps can be used -
+//  worked out here so that the threads never call vin.interpolate(), and
+//  vin needs no newimage sinc kernel
+
+static int mirror_index(int i, int n)
+{
+  if (n<2) return 0;
+  int d = 2*(n-1);
+  int j = i % d;
+  if (j<0) j+=d;
+  return ((j>n-1) ? d-j : j);
+}
+
+static float sinc_extrapolate(const volume<float>& vin, int ix, int iy, int iz)
+{
+  int nx=vin.xsize(), ny=vin.ysize(), nz=vin.zsize();
+  switch (vin.getextrapolationmethod()) {
+  case zeropad:
+    return 0.0f;
+  case periodic:
+    ix %= nx;  iy %= ny;  iz %= nz;
+    if (ix<0) ix+=nx;
+    if (iy<0) iy+=ny;
+    if (iz<0) iz+=nz;
+    break;
+  case mirror:
+    ix = mirror_index(ix,nx);  iy = mirror_index(iy,ny);  iz = mirror_index(iz,nz);
+    break;
+  case extraslice:
+    if ( (ix<-1) || (iy<-1) || (iz<-1) || (ix>nx) || (iy>ny) || (iz>nz) ) {
+      return vin.getpadvalue();
+    }
+    ix = Max(0,Min(ix,nx-1));  iy = Max(0,Min(iy,ny-1));  iz = Max(0,Min(iz,nz-1));
+    break;
+  default:
+    return vin.getpadvalue();
+  }
+  return vin.fbegin()[((long) iz*ny + iy)*nx + ix];
+}
+
+
+void fast_sinc_transform(const volume<float>& vin, volume<float>& vout,
+			 const Matrix& aff, float paddingsize,
+			 const std::string& window, int width, int nthreads,
+			 bool tiled)
+{
+  // newimage takes the half-width from the full width like this
+  int hw = (width-1)/2;
+  std::vector<float> table;
+  extrapolation ex = vin.getextrapolationmethod();
+  if ( (hw<1) || !sinc_table(window,hw,1201,table) ||
+       (ex==boundsassert) || (ex==boundsexception) || (ex==userextrapolation) ||
+       (vout.nvoxels()<=0) ) {
+    affine_transform(vin,vout,aff,paddingsize,false);
+    return;
+  }
+
+  Matrix vox2vox = vin.sampling_mat().i() * aff.i() * vout.sampling_mat();
+  set_output_transforms(vin,vout,vox2vox);
+
+  int nx=vin.xsize(), ny=vin.ysize(), nz=vin.zsize();
+  int ox=vout.xsize(), oy=vout.ysize(), oz=vout.zsize();
+  long slice = (long) nx*ny;
+  const float *in = vin.fbegin();
+  float *out = vout.nsfbegin();
+  float padval = vin.getpadvalue();
+  float xb1 = nx - 1 + paddingsize, yb1 = ny - 1 + paddingsize, zb1 = nz - 1 + paddingsize;
+  int ntap = 2*hw + 1;
+  bool useavx = have_avx2();
+
+  traverse_output(ox,oy,oz,(tiled ? tile_size(vox2vox,2*hw) : 0),nthreads,
+		  [&](int y, int z, int xstart, int xend) {
+      std::vector<float> wx(Max(ntap,8),0.0f), wy(ntap), wz(ntap);
+      RowMap r = row_map(vox2vox,y,z);
+      float *orow = out + ((long) z*oy + y)*ox;
+      for (int x=xstart; x<=xend; x++) {
+	float o1 = r.b1 + ((float) x)*r.a1;
+	float o2 = r.b2 + ((float) x)*r.a2;
+	float o3 = r.b3 + ((float) x)*r.a3;
+	if ( (o1<-paddingsize) || (o2<-paddingsize) || (o3<-paddingsize) ||
+	     (o1>xb1) || (o2>yb1) || (o3>zb1) ) {
+	  orow[x] = padval;
+	  continue;
+	}
+	// tap j is at voxel i0-hw+j, and only those inside vin are used
+	int ix0 = (int) floor(o1), iy0 = (int) floor(o2), iz0 = (int) floor(o3);
+	int jx0 = Max(0,hw-ix0), jx1 = Min(ntap-1,nx-1-ix0+hw);
+	int jy0 = Max(0,hw-iy0), jy1 = Min(ntap-1,ny-1-iy0+hw);
+	int jz0 = Max(0,hw-iz0), jz1 = Min(ntap-1,nz-1-iz0+hw);
+	if ((jx0>jx1) || (jy0>jy1) || (jz0>jz1)) {
+	  orow[x] = sinc_extrapolate(vin,ix0,iy0,iz0);
+	  continue;
+	}
+	float fx = o1 - ix0, fy = o2 - iy0, fz = o3 - iz0;
+	float sumx=0.0f, sumy=0.0f, sumz=0.0f;
+	for (int j=0; j<ntap; j++) {
+	  wx[j] = table_value(fx + (hw-j),hw,table);
+	  wy[j] = table_value(fy + (hw-j),hw,table);
+	  wz[j] = table_value(fz + (hw-j),hw,table);
+	}
+	for (int j=jx0; j<=jx1; j++) sumx += wx[j];
+	for (int j=jy0; j<=jy1; j++) sumy += wy[j];
+	for (int j=jz0; j<=jz1; j++) sumz += wz[j];
+	float kersum = sumx*sumy*sumz;
+	if (fabs(kersum)<=1e-9) {
+	  orow[x] = sinc_extrapolate(vin,ix0,iy0,iz0);
+	  continue;
+	}
+	const float *p = in + (long) (iz0-hw)*slice + (long) (iy0-hw)*nx + (ix0-hw);
+	float conv;
+      #if defined(FASTRESAMPLE_X86)
+	if ( useavx && (ntap<=8) && (jx0==0) && (jy0==0) && (jz0==0) &&
+	     (jx1==ntap-1) && (jy1==ntap-1) && (jz1==ntap-1) ) {
+	  conv = sinc_sum8(p,nx,slice,ntap,&(wx[0]),&(wy[0]),&(wz[0]));
+	} else
+      #endif
+	conv = sinc_sum(p,nx,slice,&(wx[0]),jx0,jx1,&(wy[0]),jy0,jy1,&(wz[0]),jz0,jz1);
+	orow[x] = conv / kersum;
+      }
+    });
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+// CUBIC SPLINES
+
+// the pole of the cubic B-spline prefilter, and the precision to which
+//  the mirrored start of each line is summed (as in the newimage
+//  spline interpolator)
+static const double spline_pole = sqrt(3.0) - 2.0;
+static const double spline_prec = 1e-8;
+
+
+// turns m interleaved lines of n samples (element i of line j at
+//  p[i*stride+j]) into cubic B-spline coefficients, with the recursive
+//  filter running along the lines and over j in the inner loops
+
+static void spline_prefilter(float *p, int n, long stride, int m,
+			     std::vector<double>& buf)
+{
+  if (n<2) return;
+  const double z = spline_pole;
+  buf.resize((long) n*m);
+  for (int i=0; i<n; i++) {
+    const float *src = p + i*stride;
+    double *dst = &(buf[(long) i*m]);
+    for (int j=0; j<m; j++) dst[j] = 6.0*src[j];
+  }
+  // causal start, from the mirrored line
+  int nh = (int) (log(spline_prec)/log(fabs(z))) + 1;
+  if (nh>n) nh=n;
+  double zi = z;
+  for (int i=1; i<nh; i++, zi*=z) {
+    const double *ci = &(buf[(long) i*m]);
+    for (int j=0; j<m; j++) buf[j] += zi*ci[j];
+  }
+  for (int i=1; i<n; i++) {
+    double *ci = &(buf[(long) i*m]);
+    const double *cprev = ci - m;
+    for (int j=0; j<m; j++) ci[j] += z*cprev[j];
+  }
+  // anti-causal start and sweep
+  double *clast = &(buf[(long) (n-1)*m]);
+  const double *cnext = clast - m;
+  for (int j=0; j<m; j++) clast[j] = (z/(z*z-1.0))*(clast[j] + z*cnext[j]);
+  for (int i=n-2; i>=0; i--) {
+    double *ci = &(buf[(long) i*m]);
+    const double *cafter = ci + m;
+    for (int j=0; j<m; j++) ci[j] = z*(cafter[j] - ci[j]);
+  }
+  for (int i=0; i<n; i++) {
+    float *dst = p + i*stride;
+    const double *src = &(buf[(long) i*m]);
+    for (int j=0; j<m; j++) dst[j] = src[j];
+  }
+}
+
+
+// the spline coefficients of a whole volume, a line at a time along x
+//  (over slices) and then a row of lines at a time along y and z
+
+static void spline_coefficients(const volume<float>& vin, std::vector<float>& coef,
+				int nthreads)
+{
+  int nx=vin.xsize(), ny=vin.ysize(), nz=vin.zsize();
+  long slice = (long) nx*ny;
+  coef.assign(vin.fbegin(),vin.fbegin() + slice*nz);
+  float *c = &(coef[0]);
+  parallel_for(nz,nthreads,[&](int z, int thread) {
+      std::vector<double> buf;
+      for (int y=0; y<ny; y++) spline_prefilter(c + z*slice + (long) y*nx,nx,1,1,buf);
+      spline_prefilter(c + z*slice,ny,nx,nx,buf);
+    });
+  parallel_for(ny,nthreads,[&](int y, int thread) {
+      std::vector<double> buf;
+      spline_prefilter(c + (long) y*nx,nz,slice,nx,buf);
+    });
+}
+
+
+// the cubic B-spline weights of the 4 taps from floor(o)-1 to floor(o)+2
+
+static inline void spline_weights(float t, float *w)
+{
+  float s = 1.0f - t;
+  w[0] = s*s*s/6.0f;
+  w[1] = (3.0f*t*t*t - 6.0f*t*t + 4.0f)/6.0f;
+  w[2] = (-3.0f*t*t*t + 3.0f*t*t + 3.0f*t + 1.0f)/6.0f;
+  w[3] = t*t*t/6.0f;
+}
+
+
+// the value at o of the spline with coefficients c, for an o whose 4 taps
+//  in each direction all lie inside the volume
+
+static inline float spline_value(const float *c, int nx, long slice,
+				 float o1, float o2, float o3)
+{
+  float wx[4], wy[4], wz[4];
+  int ix = (int) floor(o1), iy = (int) floor(o2), iz = (int) floor(o3);
+  spline_weights(o1-ix,wx);
+  spline_weights(o2-iy,wy);
+  spline_weights(o3-iz,wz);
+  const float *p = c + (long) (iz-1)*slice + (long) (iy-1)*nx + (ix-1);
+#if defined(FASTRESAMPLE_X86) && defined(__SSE2__)
+  // the 4 x taps of each of the 16 rows as one vector
+  __m128 acc = _mm_setzero_ps();
+  for (int jz=0; jz<4; jz++) {
+    for (int jy=0; jy<4; jy++) {
+      acc = _mm_add_ps(acc,_mm_mul_ps(_mm_set1_ps(wz[jz]*wy[jy]),
+				      _mm_loadu_ps(p + jz*slice + jy*nx)));
+    }
+  }
+  acc = _mm_mul_ps(acc,_mm_loadu_ps(wx));
+  __m128 sh = _mm_shuffle_ps(acc,acc,_MM_SHUFFLE(2,3,0,1));
+  acc = _mm_add_ps(acc,sh);
+  acc = _mm_add_ss(acc,_mm_movehl_ps(sh,acc));
+  return _mm_cvtss_f32(acc);
+#else
+  float val=0.0f;
+  for (int jz=0; jz<4; jz++) {
+    for (int jy=0; jy<4; jy++) {
+      const float *row = p + jz*slice + jy*nx;
+      val += wz[jz]*wy[jy]*(wx[0]*row[0] + wx[1]*row[1] + wx[2]*row[2] + wx[3]*row[3]);
+    }
+  }
+  return val;
+#endif
+}
+
+
+void fast_spline_transform(const volume<float>& vin, volume<float>& vout,
+			   const Matrix& aff, float paddingsize, int nthreads,
+			   bool tiled)
+{
+  extrapolation ex = vin.getextrapolationmethod();
+  if ( (vin.getinterpolationmethod()!=spline) || (ex==periodic) ||
+       (ex==boundsassert) || (ex==boundsexception) ||
+       (vout.nvoxels()<=0) ) {
+    affine_transform(vin,vout,aff,paddingsize,false);
+    return;
+  }
+
+  std::vector<float> coef;
+  spline_coefficients(vin,coef,nthreads);
+
+  Matrix vox2vox = vin.sampling_mat().i() * aff.i() * vout.sampling_mat();
+  set_output_transforms(vin,vout,vox2vox);
+
+  int nx=vin.xsize(), ny=vin.ysize(), nz=vin.zsize();
+  int ox=vout.xsize(), oy=vout.ysize(), oz=vout.zsize();
+  double nmax[3] = { nx-1.0, ny-1.0, nz-1.0 };
+  long slice = (long) nx*ny;
+  const float *c = &(coef[0]);
+  float *out = vout.nsfbegin();
+  float padval = vin.getpadvalue();
+  int tile = (tiled ? tile_size(vox2vox,2) : 0);
+
+  // voxels outside [p0,p1] of a row are well beyond the padding, and those
+  //  in [i0,i1] have all their taps inside the input volume
+  auto clip = [&](int y, int z, int xstart, int xend,
+		  int& p0, int& p1, int& i0, int& i1) {
+    double b[3], a[3];
+    row_coefficients(vox2vox,y,z,b,a);
+    p0=xstart;  p1=xend;  i0=xstart;  i1=xend;
+    for (int k=0; k<3; k++) {
+      clip_row(b[k],a[k],-paddingsize-edge_margin,nmax[k]+paddingsize+edge_margin,p0,p1);
+      clip_row(b[k],a[k],1.0+edge_margin,nmax[k]-1.0-edge_margin,i0,i1);
+    }
+    if (i0>i1) { i0=p1+1;  i1=p1; }
+  };
+
+  // the interior of each row, from the coefficients found here
+  std::atomic<bool> edges(false);
+  traverse_output(ox,oy,oz,tile,nthreads,[&](int y, int z, int xstart, int xend) {
+      RowMap r = row_map(vox2vox,y,z);
+      int p0, p1, i0, i1;
+      clip(y,z,xstart,xend,p0,p1,i0,i1);
+      float *orow = out + ((long) z*oy + y)*ox;
+      for (int x=xstart; x<=xend; x++) {
+	if ((x<p0) || (x>p1)) orow[x] = padval;
+      }
+      for (int x=i0; x<=i1; x++) {
+	orow[x] = spline_value(c,nx,slice,r.b1 + ((float) x)*r.a1,
+			       r.b2 + ((float) x)*r.a2,r.b3 + ((float) x)*r.a3);
+      }
+      if ((p0<i0) || (i1<p1)) edges = true;
+    });
+  if (!edges) return;
+
+  // near (or beyond) the edge, newimage gives the value, so that its
+  //  boundary conditions and extrapolation are kept exactly - in this
+  //  thread alone, as vin.interpolate() makes vin's spline coefficients
+  //  and writes its extrapolation value
+  traverse_output(ox,oy,oz,tile,1,[&](int y, int z, int xstart, int xend) {
+      RowMap r = row_map(vox2vox,y,z);
+      int p0, p1, i0, i1;
+      clip(y,z,xstart,xend,p0,p1,i0,i1);
+      float *orow = out + ((long) z*oy + y)*ox;
+      edge_run(vin,paddingsize,padval,r,orow,p0,i0-1);
+      edge_run(vin,paddingsize,padval,r,orow,i1+1,p1);
+    });
+}
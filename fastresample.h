@@ -0,0 +1,85 @@
+/*  fastresample.h
+
+    Affine resampling of whole volumes for the final FLIRT outputs
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// Meant to give the same result (to within float rounding) as the newimage
+//  affine_transform(vin,vout,aff,paddingsize), filling vout (which must
+//  already have the output size and voxel dimensions) and setting any
+//  sform/qform it lacks as newimage does - resamplecheck compares the two
+//  for each interpolation and extrapolation method.  Trilinear and
+//  nearest neighbour interpolation are done here, a row at a time:
+//  - each row is clipped analytically to the part whose neighbours all
+//    lie inside vin, and that part is sampled directly (8 voxels at a
+//    time using AVX2 gathers when the processor has them - this is
+//    checked at run time, so no special compiler flags are needed)
+//  - voxels near the edge of vin use vin.interpolate(), so that the
+//    extrapolation method is honoured, in one thread after the rest (it
+//    writes vin's extrapolation value, so no other thread may use vin
+//    during the call), and those more than paddingsize voxels outside vin
+//    are set to the pad value
+//  - rows are shared over nthreads, or with tiled=true the output is
+//    done in blocks (shared over nthreads), sized so that the input
+//    voxels each block reads stay in cache when whole output rows stride
+//    across the input (this only helps some rotations - see resamplebench
+//    - and is slower for the rest, so FLIRT always uses rows and tiled is
+//    only there for resamplebench and resamplecheck)
+// Anything else (e.g. sinc or spline interpolation) uses newimage.
+
+#if !defined(__fastresample_h)
+#define __fastresample_h
+
+#include <string>
+#include "armawrap/newmat.h"
+#include "newimage/newimageall.h"
+
+void fast_affine_transform(const NEWIMAGE::volume<float>& vin,
+			   NEWIMAGE::volume<float>& vout,
+			   const NEWMAT::Matrix& aff, float paddingsize,
+			   int nthreads, bool tiled=false);
+
+
+// The same for windowed sinc interpolation, with the kernel that newimage
+//  definesincinterpolation(window,width) gives (window is "hanning",
+//  "blackman" or "rectangular", or their first letter).  The kernel is
+//  looked up in a finely sampled table and applied separably: the x taps
+//  of each row are combined with one vector multiply (for widths up to 7,
+//  when the processor has AVX2)
+//  and slabs of output slices are shared over nthreads.  Edge voxels use
+//  only the taps inside vin, renormalised, as newimage does, and where
+//  there are none the value of vin's extrapolation method is worked out
+//  here.  The kernel comes only from window and width, so vin need not be
+//  set to sinc interpolation, and newimage's kernel (whose registry is
+//  shared and not thread safe) is never made or used - except when vin
+//  has a bounds checking or user extrapolation, or vout is empty, and
+//  newimage (with vin's own interpolation) is used instead.
+
+void fast_sinc_transform(const NEWIMAGE::volume<float>& vin,
+			 NEWIMAGE::volume<float>& vout,
+			 const NEWMAT::Matrix& aff, float paddingsize,
+			 const std::string& window, int width, int nthreads,
+			 bool tiled=false);
+
+
+// The same for cubic spline interpolation.  The spline coefficients are
+//  found here (not by newimage) with the recursive prefilter run along
+//  whole rows of lines at a time, over nthreads, and each output voxel
+//  whose 4x4x4 taps all lie inside vin combines its coefficients with one
+//  short vector per row.  Voxels nearer the edge (or beyond it) use
+//  vin.interpolate(), in one thread after the rest, so newimage's boundary
+//  conditions and extrapolation are kept - newimage then makes its own
+//  coefficients as well, once, if any output voxel needs them, so no other
+//  thread may use vin during the call.  vin must be set to spline
+//  interpolation (and not periodic extrapolation), or newimage is used.
+
+void fast_spline_transform(const NEWIMAGE::volume<float>& vin,
+			   NEWIMAGE::volume<float>& vout,
+			   const NEWMAT::Matrix& aff, float paddingsize,
+			   int nthreads, bool tiled=false);
+
+#endif
@@ -0,0 +1,246 @@
+/*  filtercheck.cc
+
+    Compares the FLIRT multi-resolution filters (fastfilters) with the
+    newimage blur, isotropic_resample and subsample_by_2, alone and in
+    the weighted filtering of filter_image and filter_weight
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+
+#include "armawrap/newmat.h"
+#include "miscmaths/miscmaths.h"
+#include "newimage/newimageall.h"
+#include "NewNifti/NewNifti.h"
+#include "fastfilters.h"
+
+using namespace std;
+using namespace NEWMAT;
+using namespace MISCMATHS;
+using namespace NEWIMAGE;
+
+
+bool same_matrix(const Matrix& a, const Matrix& b)
+{
+  for (int r=1; r<=4; r++) {
+    for (int c=1; c<=4; c++) {
+      if (fabs(a(r,c)-b(r,c)) > 1e-4*(1.0 + fabs(a(r,c)))) return false;
+    }
+  }
+  return true;
+}
+
+
+// a smooth pattern plus texture, with anisotropic voxels and an sform
+
+volume<float> test_volume(int nx, int ny, int nz)
+{
+  volume<float> vol(nx,ny,nz);
+  vol.setdims(1.5,1.25,2.0);
+  for (int z=0; z<nz; z++) {
+    for (int y=0; y<ny; y++) {
+      for (int x=0; x<nx; x++) {
+	vol(x,y,z) = 100.0 + 40.0*sin(0.3*x)*cos(0.2*y) + 20.0*sin(0.4*z)
+	  + (float) ((((long) x*7919 + y*104729 + z*1299709) % 1000)/50.0);
+      }
+    }
+  }
+  Matrix sform = IdentityMatrix(4);
+  sform(1,1) = -1.5;  sform(2,2) = 1.25;  sform(3,3) = 2.0;
+  sform(1,4) = 30.0;  sform(2,4) = -22.0;  sform(3,4) = -20.0;
+  vol.set_sform(NIFTI_XFORM_MNI_152,sform);
+  vol.set_qform(NIFTI_XFORM_SCANNER_ANAT,sform);
+  vol.setextrapolationmethod(zeropad);
+  return vol;
+}
+
+
+// a weight that is zero over the low x end of the volume (wide enough for
+//  some of the filtered B to be exactly zero) and otherwise varies, with
+//  some values below the binarising threshold
+
+volume<float> test_weight(const volume<float>& vol)
+{
+  volume<float> weight(vol);
+  for (int z=0; z<vol.zsize(); z++) {
+    for (int y=0; y<vol.ysize(); y++) {
+      for (int x=0; x<vol.xsize(); x++) {
+	weight(x,y,z) = ( (x<16) ? 0.0 :
+			  (float) (((long) x*31 + y*17 + z*7) % 100)/100.0 );
+      }
+    }
+  }
+  return weight;
+}
+
+
+// the newimage filters that FLIRT uses for each FastFilterType
+
+volume<float> newimage_filter(const volume<float>& vol, FastFilterType type,
+			      float sampling)
+{
+  if (type==FastSubsample2) return subsample_by_2(vol);
+  volume<float> result = blur(vol,sampling);
+  if (type==FastResampBlur) {
+    result.setinterpolationmethod(trilinear);
+    result = isotropic_resample(result,sampling);
+  }
+  return result;
+}
+
+
+// the weighted filtering of FLIRT without the fused filters: as in
+//  filter_image (normalise) or filter_weight (not)
+
+volume<float> newimage_masked_filter(const volume<float>& image,
+				     const volume<float>& weight,
+				     float weightthresh, bool normalise,
+				     float maskthresh, FastFilterType type,
+				     float sampling)
+{
+  volume<float> result, tmpvol;
+  if (normalise) {
+    tmpvol = binarise(weight,weightthresh);
+    result = newimage_filter(image*tmpvol,type,sampling);
+    tmpvol = newimage_filter(tmpvol,type,sampling);
+    result = divide(result,tmpvol,tmpvol);
+  } else {
+    tmpvol = binarise(weight,weightthresh);
+    tmpvol = newimage_filter(tmpvol,type,sampling);
+    tmpvol.binarise(maskthresh);
+    result = newimage_filter(image,type,sampling);
+    result *= tmpvol;
+  }
+  return result;
+}
+
+
+// prints one line of the comparison, returning false if refout and
+//  fastout differ by more than tol (as a fraction of the range) anywhere,
+//  or in size, voxel size or sform/qform
+
+bool compare(const string& name, const volume<float>& refout,
+	     const volume<float>& fastout, float range, float tol)
+{
+  bool samesize = (refout.xsize()==fastout.xsize()) &&
+    (refout.ysize()==fastout.ysize()) && (refout.zsize()==fastout.zsize()) &&
+    (fabs(refout.xdim()-fastout.xdim())<1e-4) &&
+    (fabs(refout.ydim()-fastout.ydim())<1e-4) &&
+    (fabs(refout.zdim()-fastout.zdim())<1e-4);
+  if (!samesize) {
+    cout << name << "\tsizes differ   <-- FAIL" << endl;
+    return false;
+  }
+  float maxdiff=0.0;
+  long ndiff=0, nvox=0;
+  for (int z=0; z<refout.zsize(); z++) {
+    for (int y=0; y<refout.ysize(); y++) {
+      for (int x=0; x<refout.xsize(); x++) {
+	float d = fabs(refout(x,y,z) - fastout(x,y,z));
+	maxdiff = Max(maxdiff,d);
+	if (d > tol*range) ndiff++;
+	nvox++;
+      }
+    }
+  }
+  bool sameform = (refout.sform_code()==fastout.sform_code()) &&
+    (refout.qform_code()==fastout.qform_code()) &&
+    same_matrix(refout.sform_mat(),fastout.sform_mat()) &&
+    same_matrix(refout.qform_mat(),fastout.qform_mat());
+  bool ok = sameform && (ndiff==0);
+  cout << name << "\t" << maxdiff << "\t" << maxdiff/range << "\t" << ndiff
+       << "/" << nvox << "\t" << (sameform ? "same" : "DIFFERENT")
+       << (ok ? "" : "   <-- FAIL") << endl;
+  return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if ((argc>1) && (string(argv[1])=="-help")) {
+    cerr << "Usage: " << argv[0] << " [nthreads (def 2)]" << endl;
+    cerr << "        Compares fast_blur, fast_isotropic_resample and" << endl;
+    cerr << "        fast_subsample_by_2 with the newimage blur," << endl;
+    cerr << "        isotropic_resample and subsample_by_2, and reports the" << endl;
+    cerr << "        largest differences, and does the same for the fused" << endl;
+    cerr << "        weighted filtering (fast_masked_filter) used by" << endl;
+    cerr << "        filter_image and filter_weight (the exit status is 1 if" << endl;
+    cerr << "        any are beyond the expected float rounding)" << endl;
+    return -1;
+  }
+  int nthreads = (argc>1) ? atoi(argv[1]) : 2;
+
+  // odd and even sizes, so that subsampling sees both kinds of edge
+  int sizes[2][3] = { { 41, 37, 23 }, { 40, 36, 24 } };
+  float scales[3] = { 2.0, 4.0, 8.0 };
+  const float tol = 1e-5;
+
+  bool allok=true;
+  cout << "filter              size  scale\tmax diff  (fraction of range)  "
+       << "voxels differing  sform/qform" << endl;
+  for (int s=0; s<2; s++) {
+    volume<float> invol = test_volume(sizes[s][0],sizes[s][1],sizes[s][2]);
+    float range = invol.max() - invol.min();
+    string sizename = ((s==0) ? "odd " : "even");
+
+    for (int k=0; k<3; k++) {
+      ostringstream scalename;
+      scalename << scales[k];
+      volume<float> refout = blur(invol,scales[k]);
+      volume<float> fastout = fast_blur(invol,scales[k],nthreads);
+      if (!compare("blur                " + sizename + "  " + scalename.str(),
+		   refout,fastout,range,tol)) allok=false;
+
+      invol.setinterpolationmethod(trilinear);
+      refout = isotropic_resample(invol,scales[k]);
+      fastout = fast_isotropic_resample(invol,scales[k],nthreads);
+      if (!compare("isotropic_resample  " + sizename + "  " + scalename.str(),
+		   refout,fastout,range,tol)) allok=false;
+    }
+
+    volume<float> refout = subsample_by_2(invol);
+    volume<float> fastout = fast_subsample_by_2(invol,nthreads);
+    if (!compare("subsample_by_2      " + sizename + "  -",
+		 refout,fastout,range,tol)) allok=false;
+
+    // the fused filtering, with the thresholds that FLIRT uses: the image
+    //  normalised by the filtered B (zero where that is zero), and the
+    //  weight masked where the filtered B is below 0.9
+    volume<float> weight = test_weight(invol);
+    FastFilterType types[3] = { FastBlur, FastResampBlur, FastSubsample2 };
+    const char *typenames[3] = { "blur", "resampblur", "subsample" };
+    for (int t=0; t<3; t++) {
+      for (int k=0; k<3; k++) {
+	if ((types[t]==FastSubsample2) && (k>0)) continue;
+	ostringstream scalename;
+	if (types[t]==FastSubsample2) scalename << "-";
+	else scalename << scales[k];
+	for (int norm=0; norm<2; norm++) {
+	  const volume<float>& image = (norm ? invol : weight);
+	  float thresh = 0.01, maskthresh = (norm ? 0.0 : 0.9);
+	  refout = newimage_masked_filter(image,weight,thresh,(norm==1),maskthresh,
+					  types[t],scales[k]);
+	  if (!fast_masked_filter(fastout,image,weight,thresh,(norm==1),maskthresh,
+				  types[t],scales[k],nthreads)) {
+	    cout << "masked " << typenames[t] << "\tnot handled   <-- FAIL" << endl;
+	    allok=false;
+	    continue;
+	  }
+	  string name = string(norm ? "filter_image " : "filter_weight ") + typenames[t];
+	  name.resize(20,' ');
+	  if (!compare(name + sizename + "  " + scalename.str(),refout,fastout,
+		       (norm ? range : 1.0f),(norm ? 1e-4 : tol))) allok=false;
+	}
+      }
+    }
+  }
+  cout << (allok ? "All results agree" : "Some results differ") << endl;
+  return (allok ? 0 : 1);
+}
@@ -11,10 +11,15 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <unistd.h>
 #include <time.h>
+#include <ftw.h>
+#include <sys/stat.h>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <chrono>
 
 #ifndef EXPOSE_TREACHEROUS
 #define EXPOSE_TREACHEROUS
@@ -28,6 +33,15 @@
 #include "newimage/newimageall.h"
 #include "defaultschedule.h"
 #include "globaloptions.h"
+#include "registrationcontext.h"
+#include "parallelfor.h"
+#include "costcache.h"
+#include "lbfgs.h"
+#include "affinetypes.h"
+#include "fastfilters.h"
+#include "fastresample.h"
+#include "refcache.h"
+#include "flirtserver.h"
 
 using namespace std;
 using namespace NiftiIO;
@@ -46,9 +60,23 @@ volume<float> global_refweight, global_testweight, global_refweight1;
 volume<float> global_refweight2, global_refweight4, global_refweight8;
 volume<float> global_seg, global_init_testvol, global_init_testweight;
 volume<float> global_fmap, global_fmap_mask;
+volume<float> global_init_refvol, global_init_refweight;
+volume<float> global_raw_refvol, global_raw_testvol;   // as read from file
 Matrix global_coords, global_norms;
-bool global_scale1OK=true, read_testvol=false;
+bool read_testvol=false;
+bool global_refvol2OK=false, global_refvol4OK=false, global_refvol8OK=false;
 float global_sampling=1.0f;
+CostCache global_costcache;
+RefPyramidCache global_refcache;
+Matrix global_finalmat;          // the result of the registration
+float global_finalcost=0.0f;
+// reference volumes (as read) held by flirt -serve, named by preload_name(),
+//  with the preload_stamp() of their files when they were read
+struct PreloadedRef {
+  volume<float> vol;
+  string stamp;
+};
+std::map<string, PreloadedRef> global_preloaded_refs;
 
 ////////////////////////////////////////////////////////////////////////////
 
@@ -60,16 +88,27 @@ void print_vector(float x, float y, float z)
 
 //------------------------------------------------------------------------//
 
-void setupsinc(const volume<float>& invol)
+// the newimage name of the chosen sinc window
+
+string sinc_window_name()
 {
-  // the following full-width is in voxels
-  int w = MISCMATHS::round(globaloptions::get().sincwidth);
   if (globaloptions::get().sincwindow==Hanning) {
-    invol.definesincinterpolation("hanning",w);
+    return "hanning";
   } else if (globaloptions::get().sincwindow==Blackman) {
-    invol.definesincinterpolation("blackman",w);
+    return "blackman";
   } else if (globaloptions::get().sincwindow==Rect) {
-    invol.definesincinterpolation("rectangular",w);
+    return "rectangular";
+  }
+  return "";
+}
+
+
+void setupsinc(const volume<float>& invol)
+{
+  // the following full-width is in voxels
+  int w = MISCMATHS::round(globaloptions::get().sincwidth);
+  if (sinc_window_name().size()>0) {
+    invol.definesincinterpolation(sinc_window_name(),w);
   }
 }
 
@@ -108,34 +147,92 @@ int FLIRT_read_volume4D(volume4D<float>& target, const string& filename)
   return retval;
 }
 
-int FLIRT_read_volume(volume<float>& target, const string& filename)
+void apply_basescale(volume<float>& target)
 {
   // make voxels bigger if basescale is smaller than 1.0 (and vice versa)
-  int retval = read_volume(target,filename);  // as radiological
   // if basescale != 1.0
   if (fabs(globaloptions::get().basescale - 1.0)>1e-5) {
     target.setxdim(target.xdim() / globaloptions::get().basescale);
     target.setydim(target.ydim() / globaloptions::get().basescale);
     target.setzdim(target.zdim() / globaloptions::get().basescale);
   }
+}
+
+int FLIRT_read_volume(volume<float>& target, const string& filename)
+{
+  int retval = read_volume(target,filename);  // as radiological
+  apply_basescale(target);
+  return retval;
+}
+
+int FLIRT_read_volume(volume<float>& target, const string& filename,
+		      volume<float>& rawcopy)
+{
+  // as above, but also keeps the volume as read (before any basescale)
+  int retval = read_volume(rawcopy,filename);  // as radiological
+  target = rawcopy;
+  apply_basescale(target);
   return retval;
 }
 
 
+// the name a reference is known by in the server: the absolute name
+//  without any image extension, so that it matches however a job names it
+
+string preload_name(const string& filename)
+{
+  string name = fslbasename(filename);
+  if ((name.length()>0) && (name[0]!='/')) {
+    char *cwd = getcwd(NULL,0);
+    if (cwd!=NULL) {
+      name = string(cwd) + "/" + name;
+      free(cwd);
+    }
+  }
+  return name;
+}
+
+
+// the sizes and modification times of the image files for a preload_name(),
+//  so that a reference that has changed since the server read it is read
+//  again rather than taken from memory
+
+string preload_stamp(const string& name)
+{
+  const char *exts[] = { "", ".nii", ".nii.gz", ".hdr", ".img", ".hdr.gz",
+			 ".img.gz" };
+  std::ostringstream stamp;
+  for (unsigned int n=0; n<sizeof(exts)/sizeof(exts[0]); n++) {
+    struct stat info;
+    if ((stat((name + exts[n]).c_str(),&info)==0) && S_ISREG(info.st_mode)) {
+      stamp << exts[n] << ":" << (long long) info.st_size << ":"
+	    << (long long) info.st_mtime << ";";
+    }
+  }
+  return stamp.str();
+}
+
+
 //------------------------------------------------------------------------//
 
 
 int vector2affine(const ColumnVector& params, int n, const ColumnVector& centre,
-		  Matrix& aff)
+		  Matrix& aff, anglereps anglerep)
 {
   if (n<=0) return 0;
   // order of parameters is 3 rotation + 3 translation + 3 scales + 3 skews
   // angles are in radians
 
-  switch (globaloptions::get().anglerep)
+  switch (anglerep)
     {
     case Euler:
-      compose_aff(params,n,centre,aff,construct_rotmat_euler);
+      {
+	// fixed size equivalent of compose_aff(...,construct_rotmat_euler)
+	double cvec[3] = { centre(1), centre(2), centre(3) };
+	Affine4 faff;
+	compose_affine_euler(Params12(params,n),n,cvec,faff);
+	faff.to_matrix(aff);
+      }
       break;
     case Quaternion:
       compose_aff(params,n,centre,aff,construct_rotmat_quat);
@@ -148,6 +245,20 @@ int vector2affine(const ColumnVector& params, int n, const ColumnVector& centre,
 }
 
 
+int vector2affine(const ColumnVector& params, int n, const ColumnVector& centre,
+		  Matrix& aff)
+{
+  return vector2affine(params,n,centre,aff,globaloptions::get().anglerep);
+}
+
+
+int vector2affine(const RegistrationContext& ctx, const ColumnVector& params,
+		  int n, Matrix& aff)
+{
+  return vector2affine(params,n,ctx.impair->testCog,aff,ctx.anglerep);
+}
+
+
 int vector2affine(const ColumnVector& params, int n, Matrix& aff)
 {
   return vector2affine(params,n,globaloptions::get().impair->testCog,aff);
@@ -164,9 +275,9 @@ int vector2affine(const float params[], int n, Matrix& aff)
 
 
 int affmat2vector(const Matrix& aff, int n, const ColumnVector& centre,
-		  ColumnVector& params)
+		  ColumnVector& params, anglereps anglerep)
 {
-  switch (globaloptions::get().anglerep)
+  switch (anglerep)
     {
     case Euler:
       decompose_aff(params,aff,centre,rotmat2euler);
@@ -181,6 +292,20 @@ int affmat2vector(const Matrix& aff, int n, const ColumnVector& centre,
 }
 
 
+int affmat2vector(const Matrix& aff, int n, const ColumnVector& centre,
+		  ColumnVector& params)
+{
+  return affmat2vector(aff,n,centre,params,globaloptions::get().anglerep);
+}
+
+
+int affmat2vector(const RegistrationContext& ctx, const Matrix& aff, int n,
+		  ColumnVector& params)
+{
+  return affmat2vector(aff,n,ctx.impair->testCog,params,ctx.anglerep);
+}
+
+
 int affmat2vector(const Matrix& aff, int n, ColumnVector& params)
 {
   return affmat2vector(aff,n,globaloptions::get().impair->testCog,params);
@@ -196,13 +321,13 @@ void set_param_basis(Matrix &parambasis, int no_params)
 }
 
 
-ColumnVector default_nonlin_params(void)
+ColumnVector default_nonlin_params(const RegistrationContext& ctx)
 {
   int pe_dir = globaloptions::get().pe_dir;
   int N=0;
-  if (abs(pe_dir)==1) N=globaloptions::get().impair->testvol.xsize();
-  if (abs(pe_dir)==2) N=globaloptions::get().impair->testvol.ysize();
-  if (abs(pe_dir)==3) N=globaloptions::get().impair->testvol.zsize();
+  if (abs(pe_dir)==1) N=ctx.impair->testvol.xsize();
+  if (abs(pe_dir)==2) N=ctx.impair->testvol.ysize();
+  if (abs(pe_dir)==3) N=ctx.impair->testvol.zsize();
   float fmapscaling = globaloptions::get().echo_spacing * N / (2.0*M_PI);
   if (pe_dir<0) fmapscaling *= -1;
   ColumnVector nonlin_params(1);
@@ -211,6 +336,12 @@ ColumnVector default_nonlin_params(void)
 }
 
 
+ColumnVector default_nonlin_params(void)
+{
+  return default_nonlin_params(RegistrationContext::current());
+}
+
+
 // cost function interfaces
 
 int setcostfntype(Costfn* imagepair, costfns ctype) {
@@ -260,49 +391,55 @@ int setup_costfn(Costfn* imagepair, costfns curcostfn, int no_bins, float smooth
 }
 
 
-float costfn(const Matrix& uninitaffmat, const ColumnVector& nonlin_params)
+float costfn(RegistrationContext& ctx, const Matrix& uninitaffmat,
+	     const ColumnVector& nonlin_params)
 {
   Tracer tr("costfn");
   Matrix affmat = uninitaffmat * globaloptions::get().initmat;  // apply initial matrix
-  setcostfntype(globaloptions::get().currentcostfn);
+  setcostfntype(ctx.impair,ctx.currentcostfn);
   float retval = 0.0;
-  retval = globaloptions::get().impair->cost(affmat,nonlin_params);
+  retval = ctx.impair->cost(affmat,nonlin_params);
   return retval;
 }
 
 
-float costfn(const Matrix& uninitaffmat)
+float costfn(RegistrationContext& ctx, const Matrix& uninitaffmat)
 {
   Tracer tr("costfn");
   float retval = 0.0;
-  if ((globaloptions::get().currentcostfn==BBR) && (globaloptions::get().pe_dir!=0)) {
+  if ((ctx.currentcostfn==BBR) && (globaloptions::get().pe_dir!=0)) {
     // call the non-linear version of costfn, which will apply the initmat there
-    retval = costfn(uninitaffmat,default_nonlin_params());
+    retval = costfn(ctx,uninitaffmat,default_nonlin_params(ctx));
   } else {
-    Matrix affmat = uninitaffmat * globaloptions::get().initmat;  // apply initial matrix
-    setcostfntype(globaloptions::get().currentcostfn);
-    retval = globaloptions::get().impair->cost(affmat);
+    Matrix affmat;
+    (Affine4(uninitaffmat) * Affine4(globaloptions::get().initmat)).to_matrix(affmat);  // apply initial matrix
+    setcostfntype(ctx.impair,ctx.currentcostfn);
+    float scale = globaloptions::get().lastsampling;
+    if (!global_costcache.lookup(affmat,*(ctx.impair),scale,retval)) {
+      retval = ctx.impair->cost(affmat);
+      global_costcache.store(affmat,*(ctx.impair),scale,retval);
+    }
   }
   return retval;
 }
 
 
-float costfn(const ColumnVector& params)
+float costfn(RegistrationContext& ctx, const ColumnVector& params)
 {
   Tracer tr("costfn");
   Matrix affmat(4,4);
-  vector2affine(params,globaloptions::get().no_params,affmat);
+  vector2affine(ctx,params,ctx.no_params,affmat);
   float retval;
   int pe_dir=globaloptions::get().pe_dir;
-  if ((globaloptions::get().impair->get_costfn()==BBR) && (pe_dir!=0)) {
-    retval = costfn(affmat,default_nonlin_params());
+  if ((ctx.impair->get_costfn()==BBR) && (pe_dir!=0)) {
+    retval = costfn(ctx,affmat,default_nonlin_params(ctx));
   } else {
-    retval = costfn(affmat);
+    retval = costfn(ctx,affmat);
   }
-  if (globaloptions::get().verbose>=5) {
-    cout << globaloptions::get().impair->count() << " : ";
+  if (ctx.verbose>=5) {
+    cout << ctx.impair->count() << " : ";
     cout << retval << " :: ";
-    for (int i=1; i<=globaloptions::get().no_params; i++)
+    for (int i=1; i<=ctx.no_params; i++)
       { cout << params(i) << " "; }
     cout << endl;
   }
@@ -310,6 +447,28 @@ float costfn(const ColumnVector& params)
 }
 
 
+float costfn(const Matrix& uninitaffmat)
+{
+  return costfn(RegistrationContext::current(),uninitaffmat);
+}
+
+
+float costfn(const ColumnVector& params)
+{
+  // this is the form passed to MISCMATHS::optimise, so the context is the
+  //  one bound to this thread by optimise()
+  return costfn(RegistrationContext::current(),params);
+}
+
+
+void print_costcache_stats()
+{
+  if (!global_costcache.enabled()) return;
+  cout << "Cost cache: " << global_costcache.hits() << " hits, "
+       << global_costcache.misses() << " misses" << endl;
+}
+
+
 //----------------------------------------------------------------------//
 
 void affine_and_fmap_transform(const volume<float>& testvol, const volume<float>& refvol,
@@ -321,8 +480,12 @@ void affine_and_fmap_transform(const volume<float>& testvol, const volume<float>
 }
 
 
-void final_transform(const volume<float>& testvol, const volume<float>& refvol,
-		     const Matrix& finalmat, volume<float>& outputvol)
+// sets testvol up for the final resampling: its interpolation (with any
+//  sinc kernel), pad value and extrapolation - this touches newimage state
+//  that is not thread safe (the shared kernel registry and the lazily found
+//  background value), so it must be done before any threads use testvol
+
+void prepare_final_transform(const volume<float>& testvol)
 {
   if (globaloptions::get().interpmethod == NearestNeighbour) {
     testvol.setinterpolationmethod(nearestneighbour);
@@ -342,14 +505,31 @@ void final_transform(const volume<float>& testvol, const volume<float>& refvol,
     testvol.setpadvalue(testvol.backgroundval());
     testvol.setextrapolationmethod(extraslice);
   }
+}
+
 
+// resamples testvol (set up by prepare_final_transform) into outputvol,
+//  using nthreads
 
+void apply_final_transform(const volume<float>& testvol, const volume<float>& refvol,
+			   const Matrix& finalmat, volume<float>& outputvol,
+			   int nthreads)
+{
   float paddingsize = globaloptions::get().paddingsize;
   if (globaloptions::get().mode2D) {
     paddingsize = Max(1.0,paddingsize);
   }
   if (globaloptions::get().pe_dir==0) {  // test to see if fieldmap is being used
-    affine_transform(testvol,outputvol,finalmat,paddingsize,false);
+    if (!globaloptions::get().fastresample) {
+      affine_transform(testvol,outputvol,finalmat,paddingsize,false);
+    } else if (globaloptions::get().interpmethod == NEWIMAGE::Sinc) {
+      fast_sinc_transform(testvol,outputvol,finalmat,paddingsize,sinc_window_name(),
+			  MISCMATHS::round(globaloptions::get().sincwidth),nthreads);
+    } else if (globaloptions::get().interpmethod == NEWIMAGE::Spline) {
+      fast_spline_transform(testvol,outputvol,finalmat,paddingsize,nthreads);
+    } else {
+      fast_affine_transform(testvol,outputvol,finalmat,paddingsize,nthreads);
+    }
   } else {
     // Only setup costfn if it isn't already done (normally first time around in a 4D)
     if (globaloptions::get().debug) { cerr << "Start affine_and_fmap_transform" << endl; }
@@ -366,6 +546,15 @@ void final_transform(const volume<float>& testvol, const volume<float>& refvol,
   }
 }
 
+
+void final_transform(const volume<float>& testvol, const volume<float>& refvol,
+		     const Matrix& finalmat, volume<float>& outputvol,
+		     int nthreads)
+{
+  prepare_final_transform(testvol);
+  apply_final_transform(testvol,refvol,finalmat,outputvol,nthreads);
+}
+
 template <class T>
 int safe_save_volume(const volume<T>& source, const string& filename)
 {
@@ -425,6 +614,125 @@ void set_param_tols(ColumnVector &param_tol, int no_params)
 
 
 
+Costfn* copy_costfn(const Costfn* srcpair)
+{
+  // makes an independent image pair, with the same images and settings
+  //  as srcpair, that can be used at the same time as srcpair
+  Tracer tr("copy_costfn");
+  Costfn *newpair=0;
+  if (globaloptions::get().useweights) {
+    newpair = new Costfn(srcpair->refvol,srcpair->testvol,
+			 srcpair->rweight,srcpair->tweight);
+  } else {
+    newpair = new Costfn(srcpair->refvol,srcpair->testvol);
+  }
+  setup_costfn(newpair,srcpair->get_costfn(),
+	       int(globaloptions::get().no_bins/globaloptions::get().lastsampling),
+	       srcpair->smoothsize,srcpair->fuzzyfrac);
+  if (globaloptions::get().bbrstep>0)
+    newpair->set_bbr_step(globaloptions::get().bbrstep);
+  return newpair;
+}
+
+
+// Copies of the image pair for the worker threads, kept from one set of
+//  worker contexts to the next while the pair (and the settings that it is
+//  copied with) stay the same, since copying a pair can be expensive (BBR
+//  finds its edge points again).  Cleared whenever a pair is deleted.
+
+struct WorkerPairs {
+  const Costfn *srcpair;
+  int no_bins;
+  float smoothsize;
+  float fuzzyfrac;
+  int bbrstep;
+  bool inuse;
+  std::vector<Costfn*> pairs;
+  WorkerPairs() : srcpair(0), no_bins(0), smoothsize(0), fuzzyfrac(0),
+		  bbrstep(0), inuse(false) { }
+};
+
+WorkerPairs global_workerpairs;
+
+
+void clear_worker_pairs()
+{
+  for (unsigned int t=0; t<global_workerpairs.pairs.size(); t++) {
+    delete global_workerpairs.pairs[t];
+  }
+  global_workerpairs.pairs.clear();
+  global_workerpairs.srcpair = 0;
+  global_workerpairs.inuse = false;
+}
+
+
+void setup_worker_contexts(RegistrationContext& ctx,
+			   std::vector<RegistrationContext*>& workers, int nthreads)
+{
+  // only use separate worker contexts when more than one thread is requested
+  //  (so the single threaded case works directly on ctx)
+  Tracer tr("setup_worker_contexts");
+  workers.clear();
+  if (nthreads<=1) return;
+  if (global_workerpairs.inuse) {
+    // the stored copies are already being used, so these get their own
+    for (int t=0; t<nthreads; t++) {
+      RegistrationContext *worker = new RegistrationContext(ctx);
+      worker->set_private_pair(copy_costfn(ctx.impair));
+      worker->nthreads = 1;  // workers do not start threads of their own
+      workers.push_back(worker);
+    }
+    return;
+  }
+  int no_bins = int(globaloptions::get().no_bins/globaloptions::get().lastsampling);
+  if ( (global_workerpairs.srcpair!=ctx.impair) ||
+       (global_workerpairs.no_bins!=no_bins) ||
+       (global_workerpairs.smoothsize!=ctx.impair->smoothsize) ||
+       (global_workerpairs.fuzzyfrac!=ctx.impair->fuzzyfrac) ||
+       (global_workerpairs.bbrstep!=globaloptions::get().bbrstep) ) {
+    clear_worker_pairs();
+    global_workerpairs.srcpair = ctx.impair;
+    global_workerpairs.no_bins = no_bins;
+    global_workerpairs.smoothsize = ctx.impair->smoothsize;
+    global_workerpairs.fuzzyfrac = ctx.impair->fuzzyfrac;
+    global_workerpairs.bbrstep = globaloptions::get().bbrstep;
+  }
+  while ((int) global_workerpairs.pairs.size()<nthreads) {
+    global_workerpairs.pairs.push_back(copy_costfn(ctx.impair));
+  }
+  global_workerpairs.inuse = true;
+  for (int t=0; t<nthreads; t++) {
+    RegistrationContext *worker = new RegistrationContext(ctx);
+    worker->impair = global_workerpairs.pairs[t];
+    worker->nthreads = 1;  // workers do not start threads of their own
+    workers.push_back(worker);
+  }
+}
+
+
+void free_worker_contexts(std::vector<RegistrationContext*>& workers)
+{
+  // the stored pairs are kept (the contexts do not own them) for next time
+  if ( (workers.size()>0) && (global_workerpairs.pairs.size()>0) &&
+       (workers[0]->impair==global_workerpairs.pairs[0]) ) {
+    global_workerpairs.inuse = false;
+  }
+  for (unsigned int t=0; t<workers.size(); t++) {
+    delete workers[t];
+  }
+  workers.clear();
+}
+
+
+RegistrationContext& worker_context(RegistrationContext& ctx,
+				    std::vector<RegistrationContext*>& workers,
+				    int thread)
+{
+  if (thread<(int) workers.size()) return *(workers[thread]);
+  return ctx;
+}
+
+
 void initialise_params(ColumnVector& params)
 {
   Real paramsf[12] = {0, 0, 0, 0, 0, 0, 1, 1, 1, 0, 0, 0};
@@ -432,28 +740,75 @@ void initialise_params(ColumnVector& params)
 }
 
 
-void optimise(ColumnVector& params, int no_params, ColumnVector& param_tol,
-	      int &no_its, float *fans,
+// counts the calls that MISCMATHS::optimise makes to the cost function
+thread_local float (*counted_costfunc)(const ColumnVector &) = 0;
+thread_local long costfunc_calls = 0;
+
+float counting_costfn(const ColumnVector& params)
+{
+  costfunc_calls++;
+  return counted_costfunc(params);
+}
+
+
+void optimise(RegistrationContext& ctx, ColumnVector& params, int no_params,
+	      ColumnVector& param_tol, int &no_its, float *fans,
 	      float (*costfunc)(const ColumnVector &), int itmax=4)
 {
   // sets up the initial parameters and calls the optimisation routine
+  //  (with ctx bound to this thread so that costfunc uses it)
   if ((params.MaximumAbsoluteValue() < 0.001) && (params.Nrows()>=12) )
     initialise_params(params);
   {
     Matrix affmattst(4,4);
-    vector2affine(params,no_params,affmattst);
-    if (globaloptions::get().verbose>=5) {
+    vector2affine(ctx,params,no_params,affmattst);
+    if (ctx.verbose>=5) {
       cout << "Starting with : " << endl << affmattst;
     }
   }
   Matrix parambasis(no_params,no_params);
   set_param_basis(parambasis,no_params);
-  float ptol[13];
-  for (int i=1; i<=no_params; i++) { ptol[i] = param_tol(i); }
 
-  *fans = MISCMATHS::optimise(params,no_params,param_tol,costfunc,no_its,itmax,
-			      globaloptions::get().boundguess,
-			      globaloptions::get().optimisationtype);
+  // the number of cost evaluations and the time taken are reported, so
+  //  that the optimisation types can be compared
+  std::chrono::steady_clock::time_point starttime = std::chrono::steady_clock::now();
+  long no_evals=0;
+  if (globaloptions::get().optimisationtype=="lbfgs") {
+    // the finite difference gradients (and the trial steps of the line
+    //  search) are evaluated as a batch, spread over the threads available
+    //  to this context
+    std::vector<RegistrationContext*> workers;
+    setup_worker_contexts(ctx,workers,ctx.nthreads);
+    BatchCostFunction batchcost =
+      [&](const std::vector<ColumnVector>& points, std::vector<float>& costs) {
+      costs.resize(points.size());
+      no_evals += points.size();
+      parallel_for((int) points.size(),ctx.nthreads,[&](int i, int thread) {
+	  RegistrationContext& wctx = worker_context(ctx,workers,thread);
+	  ContextBinding binding(wctx);
+	  costs[i] = costfunc(points[i]);
+	});
+    };
+    *fans = lbfgs_optimise(params,no_params,param_tol,batchcost,no_its,itmax,
+			   (globaloptions::get().boundguess.Nrows()>0) ?
+			   globaloptions::get().boundguess(1) : 1.0,
+			   globaloptions::get().gradientstep,ctx.nthreads);
+    free_worker_contexts(workers);
+  } else {
+    ContextBinding binding(ctx);
+    counted_costfunc = costfunc;
+    costfunc_calls = 0;
+    *fans = MISCMATHS::optimise(params,no_params,param_tol,counting_costfn,
+				no_its,itmax,globaloptions::get().boundguess,
+				globaloptions::get().optimisationtype);
+    no_evals = costfunc_calls;
+  }
+  if (ctx.verbose>=3) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - starttime;
+    cout << "Optimisation (" << globaloptions::get().optimisationtype << ") used "
+	 << no_its << " iterations and " << no_evals << " cost evaluations in "
+	 << elapsed.count() << " seconds" << endl;
+  }
 }
 
 
@@ -461,47 +816,54 @@ void optimise(ColumnVector& params, int no_params, ColumnVector& param_tol,
 ////////////////////////////////////////////////////////////////////////////
 
 
-void params12toN(ColumnVector& params)
+void params12toN(const RegistrationContext& ctx, ColumnVector& params)
 {
   // Convert the full 12 dof param vector to a small param vector
   Tracer tr("params12toN");
   ColumnVector nparams;
-  nparams = pinv(globaloptions::get().parammask)*(params - globaloptions::get().refparams);
+  nparams = ctx.parammask_pinv()*(params - ctx.refparams);
   params = nparams;
 }
 
 
-void paramsNto12(ColumnVector& params)
+void paramsNto12(const RegistrationContext& ctx, ColumnVector& params)
 {
   // Convert small param vector to full 12 dof param vector
   Tracer tr("paramsNto12");
   ColumnVector param12;
-  param12 = globaloptions::get().parammask*params + globaloptions::get().refparams;
+  param12 = ctx.parammask*params + ctx.refparams;
   params = param12;
 }
 
 
 
-float subset_costfn(const ColumnVector& params)
+float subset_costfn(RegistrationContext& ctx, const ColumnVector& params)
 {
   Tracer tr("subset_costfn");
   ColumnVector param12;
   param12 = params;
-  paramsNto12(param12);
-  float retval = costfn(param12);
-  if (globaloptions::get().verbose>=7) {
-    cout << globaloptions::get().impair->count() << " : ";
+  paramsNto12(ctx,param12);
+  float retval = costfn(ctx,param12);
+  if (ctx.verbose>=7) {
+    cout << ctx.impair->count() << " : ";
     cout << retval << " :: " << param12.t() << endl;
   }
   return retval;
 }
 
+
+float subset_costfn(const ColumnVector& params)
+{
+  // as for costfn(params), this is the form passed to MISCMATHS::optimise
+  return subset_costfn(RegistrationContext::current(),params);
+}
+
 //------------------------------------------------------------------------//
 
 
 
 
-void find_cost_minima(Matrix& bestpts, const volume<float>& cost) {
+void find_cost_minima(Matrix& bestpts, const volume<float>& cost, int verbose) {
   Tracer tr("find_cost_minima");
   volume<float> minv(cost);
   ColumnVector bestpt(3);
@@ -557,7 +919,7 @@ void find_cost_minima(Matrix& bestpts, const volume<float>& cost) {
 	    bestpts(idx,2) = (float) y;
 	    bestpts(idx,3) = (float) z;
 	    idx++;
-	    if (globaloptions::get().verbose>=3)
+	    if (verbose>=3)
 	      cout << "COST minima at : " << x << "," << y << "," << z << endl;
 	  }
 	}
@@ -581,7 +943,7 @@ void set_rot_sampling(ColumnVector& rots, float lowerbound, float upperbound) {
 
 void set_rot_samplings(ColumnVector& rxcoarse, ColumnVector& rycoarse,
 		       ColumnVector& rzcoarse, ColumnVector& rxfine,
-		       ColumnVector& ryfine, ColumnVector& rzfine) {
+		       ColumnVector& ryfine, ColumnVector& rzfine, int verbose) {
   Tracer tr("set_rot_samplings");
   //int coarsesize = 4, finesize = 11;
   // sets the number of rows (angle samples) for each axis
@@ -616,7 +978,7 @@ void set_rot_samplings(ColumnVector& rxcoarse, ColumnVector& rycoarse,
 		   globaloptions::get().searchry(2));
   set_rot_sampling(rzfine,globaloptions::get().searchrz(1),
 		   globaloptions::get().searchrz(2));
-  if (globaloptions::get().verbose>=4) {
+  if (verbose>=4) {
     cout << "Coarse rotation samplings are:\n" << rxcoarse.t() << rycoarse.t()
 	 << rzcoarse.t() << " and fine rotation samplings are:\n"
 	 << rxfine.t() << ryfine.t() << rzfine.t() << endl;
@@ -625,51 +987,51 @@ void set_rot_samplings(ColumnVector& rxcoarse, ColumnVector& rycoarse,
 
 
 
-void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
+void search_cost(RegistrationContext& ctx, Matrix& paramlist,
+		 volume<float>& costs, volume<float>& tx,
 		 volume<float>& ty, volume<float>& tz, volume<float>& scale) {
   Tracer tr("search_cost");
-  int storedverbose = globaloptions::get().verbose;
-  int storeddof = globaloptions::get().dof;
-  anglereps useranglerep = globaloptions::get().anglerep;
-  globaloptions::get().verbose -= 2;
-  globaloptions::get().anglerep = Euler;  // a workaround hack
-  globaloptions::get().currentcostfn = globaloptions::get().searchcostfn;
-  globaloptions::get().dof = globaloptions::get().searchdof;
+  // the search settings only apply to ctx (globaloptions is left alone)
+  int storedctxverbose = ctx.verbose;
+  anglereps useranglerep = ctx.anglerep;
+  int searchdof = globaloptions::get().searchdof;
+  ctx.verbose -= 2;
+  ctx.anglerep = Euler;  // a workaround hack
+  ctx.currentcostfn = globaloptions::get().searchcostfn;
 
   ColumnVector coarserx, coarsery, coarserz, finerx, finery, finerz;
-  set_rot_samplings(coarserx,coarsery,coarserz,finerx,finery,finerz);
+  set_rot_samplings(coarserx,coarsery,coarserz,finerx,finery,finerz,ctx.verbose);
 
-  // set up the type of parameter subset (via the global mask)
+  // set up the type of parameter subset (via the context mask)
   // here 3 translations and 1 (common) scaling are used
-  if (globaloptions::get().dof>6) {
-    globaloptions::get().parammask.ReSize(12,4);  // was 3
-    globaloptions::get().parammask = 0.0;
-    globaloptions::get().parammask(7,1) = 1.0;  // didn't used to exist
-    globaloptions::get().parammask(8,1) = 1.0;  // didn't used to exist
-    globaloptions::get().parammask(9,1) = 1.0;  // didn't used to exist
-    globaloptions::get().parammask(4,2) = 1.0;
-    globaloptions::get().parammask(5,3) = 1.0;
-    globaloptions::get().parammask(6,4) = 1.0;
+  if (searchdof>6) {
+    ctx.parammask.ReSize(12,4);  // was 3
+    ctx.parammask = 0.0;
+    ctx.parammask(7,1) = 1.0;  // didn't used to exist
+    ctx.parammask(8,1) = 1.0;  // didn't used to exist
+    ctx.parammask(9,1) = 1.0;  // didn't used to exist
+    ctx.parammask(4,2) = 1.0;
+    ctx.parammask(5,3) = 1.0;
+    ctx.parammask(6,4) = 1.0;
   } else {
-    globaloptions::get().parammask.ReSize(12,3);
-    globaloptions::get().parammask = 0.0;
-    globaloptions::get().parammask(4,1) = 1.0;
-    globaloptions::get().parammask(5,2) = 1.0;
-    globaloptions::get().parammask(6,3) = 1.0;
+    ctx.parammask.ReSize(12,3);
+    ctx.parammask = 0.0;
+    ctx.parammask(4,1) = 1.0;
+    ctx.parammask(5,2) = 1.0;
+    ctx.parammask(6,3) = 1.0;
   }
 
   ColumnVector param_tol, param_tol0(12), param_tol1(12), params_8(12);
-  globaloptions::get().no_params = 12; // necessary for any subset_costfn call
-  param_tol0 = globaloptions::get().refparams;
-  params12toN(param_tol0);
+  ctx.no_params = 12; // necessary for any subset_costfn call
+  param_tol0 = ctx.refparams;
+  params12toN(ctx,param_tol0);
   set_param_tols(param_tol1,12);
-  param_tol1 = param_tol1 + globaloptions::get().refparams;
-  params12toN(param_tol1);
+  param_tol1 = param_tol1 + ctx.refparams;
+  params12toN(ctx,param_tol1);
   param_tol = param_tol1 - param_tol0;
 
   // search coarsely, optimising each point and storing the results
-  int no_its=0;
-  float fans=0.0, rx,ry,rz;
+  float rx,ry,rz;
   Matrix affmat(4,4);
   ColumnVector trans(3), testv(4), testv2(4);
   tx.reinitialize(coarserx.Nrows(),coarsery.Nrows(),coarserz.Nrows());
@@ -677,63 +1039,79 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
   tz.reinitialize(coarserx.Nrows(),coarsery.Nrows(),coarserz.Nrows());
   scale.reinitialize(coarserx.Nrows(),coarsery.Nrows(),coarserz.Nrows());
   // fix the reference parameter (starting estimates)
-  globaloptions::get().refparams = 0.0;
-  globaloptions::get().refparams(7) = 1.0;
-  globaloptions::get().refparams(8) = 1.0;
-  globaloptions::get().refparams(9) = 1.0;
+  ctx.refparams = 0.0;
+  ctx.refparams(7) = 1.0;
+  ctx.refparams(8) = 1.0;
+  ctx.refparams(9) = 1.0;
   // set the initial translation (to align cog's)
   //  trans = refvol.cog("scaled_mm") - initmat * testvol.cog("scaled_mm")
   ColumnVector testcog(4), tcog(3);
-  tcog = globaloptions::get().impair->testvol.cog("scaled_mm");
+  tcog = ctx.impair->testvol.cog("scaled_mm");
   testcog(1)=tcog(1); testcog(2)=tcog(2); testcog(3)=tcog(3); testcog(4)=1.0;
   testcog = globaloptions::get().initmat * testcog;
-  trans = globaloptions::get().impair->refvol.cog("scaled_mm");
+  trans = ctx.impair->refvol.cog("scaled_mm");
   trans(1) -= testcog(1);
   trans(2) -= testcog(2);
   trans(3) -= testcog(3);
-  globaloptions::get().refparams(4) = trans(1);
-  globaloptions::get().refparams(5) = trans(2);
-  globaloptions::get().refparams(6) = trans(3);
-  for (int ix=0; ix<coarserx.Nrows(); ix++) {
-    for (int iy=0; iy<coarsery.Nrows(); iy++) {
-      for (int iz=0; iz<coarserz.Nrows(); iz++) {
-	rx = coarserx(ix+1);
-	ry = coarsery(iy+1);
-	rz = coarserz(iz+1);
-	globaloptions::get().refparams(1) = rx;
-	globaloptions::get().refparams(2) = ry;
-	globaloptions::get().refparams(3) = rz;
-	params_8 = globaloptions::get().refparams;
-	if (globaloptions::get().verbose>=4) {
-	  cout << "Starting with " << params_8.t();
-	  cout << "  and tolerance " << param_tol.t();
-	}
-	params12toN(params_8);
-	optimise(params_8,globaloptions::get().parammask.Ncols(),
-		 param_tol,no_its,&fans,subset_costfn);
-	//		 param_tol,&no_its,&fans,subset_costfn);
-	paramsNto12(params_8);
-	tx(ix,iy,iz) = params_8(4);
-	ty(ix,iy,iz) = params_8(5);
-	tz(ix,iy,iz) = params_8(6);
-	scale(ix,iy,iz) = params_8(7);
-
-	if (globaloptions::get().verbose>=4) {
-	  cout << " dearranged: " << params_8.t();
-	}
+  ctx.refparams(4) = trans(1);
+  ctx.refparams(5) = trans(2);
+  ctx.refparams(6) = trans(3);
+  // each coarse point is optimised independently, so they are shared out
+  //  amongst the worker threads (each with its own context and image pair)
+  //  and the results gathered in coarseres (as 4 values: tx, ty, tz, scale)
+  int ncx=coarserx.Nrows(), ncy=coarsery.Nrows(), ncz=coarserz.Nrows();
+  int nthreads = globaloptions::get().nthreads;
+  std::vector<RegistrationContext*> workers;
+  setup_worker_contexts(ctx,workers,nthreads);
+  std::vector<float> coarseres(4*ncx*ncy*ncz);
+  parallel_for(ncx*ncy*ncz,nthreads,[&](int idx, int thread) {
+      RegistrationContext& wctx = worker_context(ctx,workers,thread);
+      int cix=idx/(ncy*ncz), ciy=(idx/ncz)%ncy, ciz=idx%ncz;
+      int c_its=0;
+      float cfans=0.0;
+      ColumnVector cparams(12);
+      wctx.refparams(1) = coarserx(cix+1);
+      wctx.refparams(2) = coarsery(ciy+1);
+      wctx.refparams(3) = coarserz(ciz+1);
+      cparams = wctx.refparams;
+      if (wctx.verbose>=4) {
+	cout << "Starting with " << cparams.t();
+	cout << "  and tolerance " << param_tol.t();
       }
-      if (globaloptions::get().verbose>=2) cout << "*";
+      params12toN(wctx,cparams);
+      optimise(wctx,cparams,wctx.parammask.Ncols(),
+	       param_tol,c_its,&cfans,subset_costfn);
+      paramsNto12(wctx,cparams);
+      coarseres[4*idx] = cparams(4);
+      coarseres[4*idx+1] = cparams(5);
+      coarseres[4*idx+2] = cparams(6);
+      coarseres[4*idx+3] = cparams(7);
+
+      if (wctx.verbose>=4) {
+	cout << " dearranged: " << cparams.t();
+      }
+    });
+  for (int ix=0; ix<ncx; ix++) {
+    for (int iy=0; iy<ncy; iy++) {
+      for (int iz=0; iz<ncz; iz++) {
+	int idx = (ix*ncy + iy)*ncz + iz;
+	tx(ix,iy,iz) = coarseres[4*idx];
+	ty(ix,iy,iz) = coarseres[4*idx+1];
+	tz(ix,iy,iz) = coarseres[4*idx+2];
+	scale(ix,iy,iz) = coarseres[4*idx+3];
+      }
+      if (ctx.verbose>=2) cout << "*";
     }
   }
-  if (globaloptions::get().verbose>=2) cout << endl;
+  if (ctx.verbose>=2) cout << endl;
 
   // scale = 1.0;  // for now disallow non-unity scalings
   float medianscale = scale.percentile(0.50);
   scale = medianscale;  // try a constant, median scale for all
-  if (globaloptions::get().verbose>=2)
+  if (ctx.verbose>=2)
     { cout << "Median scale = " << medianscale << endl; }
 
-  if (globaloptions::get().verbose>=4) {
+  if (ctx.verbose>=4) {
     safe_save_volume(tx,"tx");
     safe_save_volume(ty,"ty");
     safe_save_volume(tz,"tz");
@@ -749,16 +1127,21 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
                       / Max((float) 1.0,((float) finery.Nrows()-1));
   float factorz = ((float) coarserz.Nrows()-1)
                       / Max((float) 1.0,((float) finerz.Nrows()-1));
-  costs.reinitialize(finerx.Nrows(),finery.Nrows(),finerz.Nrows());
-  for (int ix=0; ix<finerx.Nrows(); ix++) {
-    for (int iy=0; iy<finery.Nrows(); iy++) {
-      for (int iz=0; iz<finerz.Nrows(); iz++) {
+  // the parameters for each fine point are set up first, then all the costs
+  //  are evaluated (independently) by the worker threads, with each result
+  //  written directly into its own cell of costs
+  int nfx=finerx.Nrows(), nfy=finery.Nrows(), nfz=finerz.Nrows();
+  costs.reinitialize(nfx,nfy,nfz);
+  Matrix fineparams(nfx*nfy*nfz,12);
+  for (int ix=0; ix<nfx; ix++) {
+    for (int iy=0; iy<nfy; iy++) {
+      for (int iz=0; iz<nfz; iz++) {
 	rx = finerx(ix+1);
 	ry = finery(iy+1);
 	rz = finerz(iz+1);
-	globaloptions::get().refparams(1) = rx;
-	globaloptions::get().refparams(2) = ry;
-	globaloptions::get().refparams(3) = rz;
+	ctx.refparams(1) = rx;
+	ctx.refparams(2) = ry;
+	ctx.refparams(3) = rz;
 	xf = ((float) ix)*factorx;
 	yf = ((float) iy)*factory;
 	zf = ((float) iz)*factorz;
@@ -767,22 +1150,31 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
 	tzv = tz.interpolate(xf,yf,zf);
 	scv = scale.interpolate(xf,yf,zf);
 	if ((scv<0.5) || (scv>2.0))  scv = 1.0;
-	if (globaloptions::get().dof<=6) scv = 1.0;
-	globaloptions::get().refparams(4) = txv;
-	globaloptions::get().refparams(5) = tyv;
-	globaloptions::get().refparams(6) = tzv;
-	globaloptions::get().refparams(7) = scv;
-	globaloptions::get().refparams(8) = scv;
-	globaloptions::get().refparams(9) = scv;
-	params_8 = globaloptions::get().refparams;
-	costs(ix,iy,iz) = costfn(params_8);
+	if (searchdof<=6) scv = 1.0;
+	ctx.refparams(4) = txv;
+	ctx.refparams(5) = tyv;
+	ctx.refparams(6) = tzv;
+	ctx.refparams(7) = scv;
+	ctx.refparams(8) = scv;
+	ctx.refparams(9) = scv;
+	int idx = ix + nfx*(iy + nfy*iz);  // same order as the voxels in costs
+	fineparams.SubMatrix(idx+1,idx+1,1,12) = ctx.refparams.t();
       }
-      if (globaloptions::get().verbose>=2) cout << "*";
     }
   }
-  if (globaloptions::get().verbose>=2) cout << endl;
+  float *costptr = costs.nsfbegin();
+  parallel_for(nfx*nfy*nfz,nthreads,[&](int idx, int thread) {
+      RegistrationContext& wctx = worker_context(ctx,workers,thread);
+      ColumnVector fparams;
+      fparams = fineparams.SubMatrix(idx+1,idx+1,1,12).t();
+      costptr[idx] = costfn(wctx,fparams);
+    });
+  if (ctx.verbose>=2) {
+    for (int n=0; n<nfx*nfy; n++) cout << "*";
+    cout << endl;
+  }
 
-  if (globaloptions::get().verbose>=4) {
+  if (ctx.verbose>=4) {
     safe_save_volume(costs,"costs");
   }
 
@@ -794,7 +1186,7 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
 			 costs.percentile(0.20));
   // avoid the percentile giving the costmin (or less)
   if (costthresh <= costmin)  costthresh = Max(costmin*1.0001,costmin*0.9999);
-  if (globaloptions::get().verbose>=4) {
+  if (ctx.verbose>=4) {
     cout << "Cost threshold = " << costthresh << " and minimum is "
 	 << costmin << endl;
   }
@@ -814,11 +1206,15 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
     cout << "WARNING: Found 0 or less sub-threshold costs" << endl;
     numsubcost = 1;
   }
-  Matrix bestparams(numsubcost,13);
-  int n=1;
-  for (int ix=0; ix<finerx.Nrows(); ix++) {
-    for (int iy=0; iy<finery.Nrows(); iy++) {
-      for (int iz=0; iz<finerz.Nrows(); iz++) {
+  // gather the sub-threshold cells (in the same order as a serial scan)
+  //  then optimise them as independent tasks on the worker threads, with
+  //  each result stored in its own slot, and finally fill in bestparams
+  //  and costs in order
+  std::vector<int> candcells;
+  std::vector<ColumnVector> candparams;
+  for (int ix=0; ix<nfx; ix++) {
+    for (int iy=0; iy<nfy; iy++) {
+      for (int iz=0; iz<nfz; iz++) {
 	if (costs(ix,iy,iz) < costthresh) {
 	  rx = finerx(ix+1);
 	  ry = finery(iy+1);
@@ -831,45 +1227,66 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
 	  tzv = tz.interpolate(xf,yf,zf);
 	  scv = scale.interpolate(xf,yf,zf);
 	  if ((scv<0.5) || (scv>2.0))  scv = 1.0;
-	  if (globaloptions::get().dof<=6) scv = 1.0;
+	  if (searchdof<=6) scv = 1.0;
 	  params_8 = 0.0;
 	  params_8(1) = rx;  params_8(2) = ry;  params_8(3) = rz;
 	  params_8(4) = txv; params_8(5) = tyv; params_8(6) = tzv;
 	  params_8(7) = scv; params_8(8) = scv; params_8(9) = scv;
-	  globaloptions::get().refparams = params_8;
-	  params12toN(params_8);
-	  optimise(params_8,globaloptions::get().parammask.Ncols(),
-		   param_tol,no_its,&fans,subset_costfn);
-	           //param_tol,&no_its,&fans,subset_costfn);
-	  paramsNto12(params_8);
-	  costs(ix,iy,iz) = fans;
-	  bestparams(n,1) = fans;
-	  bestparams.SubMatrix(n,n,2,13) = params_8.t();
-	  n++;
-	  if (globaloptions::get().verbose>=3) {
-	    cout << "(" << ix << "," << iy << "," << iz << ") => " << fans
-		 << " with " << params_8.t();
-	  }
+	  candcells.push_back(ix + nfx*(iy + nfy*iz));
+	  candparams.push_back(params_8);
 	}
       }
     }
   }
+  int ncand = candcells.size();
+  std::vector<float> candcosts(ncand);
+  parallel_for(ncand,nthreads,[&](int c, int thread) {
+      RegistrationContext& wctx = worker_context(ctx,workers,thread);
+      int c_its=0;
+      float cfans=0.0;
+      ColumnVector cparams;
+      cparams = candparams[c];
+      wctx.refparams = cparams;
+      params12toN(wctx,cparams);
+      optimise(wctx,cparams,wctx.parammask.Ncols(),
+	       param_tol,c_its,&cfans,subset_costfn);
+      paramsNto12(wctx,cparams);
+      candparams[c] = cparams;
+      candcosts[c] = cfans;
+    });
+  free_worker_contexts(workers);
 
-  if (globaloptions::get().verbose>=3) {
+  Matrix bestparams(numsubcost,13);
+  int n=1;
+  for (int c=0; c<ncand; c++) {
+    int ix = candcells[c] % nfx;
+    int iy = (candcells[c] / nfx) % nfy;
+    int iz = candcells[c] / (nfx*nfy);
+    costs(ix,iy,iz) = candcosts[c];
+    bestparams(n,1) = candcosts[c];
+    bestparams.SubMatrix(n,n,2,13) = candparams[c].t();
+    n++;
+    if (ctx.verbose>=3) {
+      cout << "(" << ix << "," << iy << "," << iz << ") => " << candcosts[c]
+	   << " with " << candparams[c].t();
+    }
+  }
+
+  if (ctx.verbose>=3) {
     safe_save_volume(costs,"costs");
     cout << "Costs (1st column) are:\n" << bestparams << endl;
   }
 
   // find the cost minima and return these
   Matrix bestpts;
-  find_cost_minima(bestpts,costs);
+  find_cost_minima(bestpts,costs,ctx.verbose);
   paramlist.ReSize(bestpts.Nrows(),12);
   int ix,iy,iz;
   for (int n=1; n<=paramlist.Nrows(); n++) {
     ix = MISCMATHS::round(bestpts(n,1));
     iy = MISCMATHS::round(bestpts(n,2));
     iz = MISCMATHS::round(bestpts(n,3));
-    if (globaloptions::get().verbose>=3)
+    if (ctx.verbose>=3)
       cout << "Cost minima at : " << ix << "," << iy << "," << iz << endl;
     rx = finerx(ix+1);
     ry = finery(iy+1);
@@ -882,7 +1299,7 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
     tzv = tz.interpolate(xf,yf,zf);
     scv = scale.interpolate(xf,yf,zf);
     if ((scv<0.5) || (scv>2.0))  scv = 1.0;
-    if (globaloptions::get().dof<=6) scv = 1.0;
+    if (searchdof<=6) scv = 1.0;
     params_8 = 0.0;
     params_8(1) = rx;  params_8(2) = ry;  params_8(3) = rz;
     params_8(4) = txv; params_8(5) = tyv; params_8(6) = tzv;
@@ -890,19 +1307,18 @@ void search_cost(Matrix& paramlist, volume<float>& costs, volume<float>& tx,
     paramlist.SubMatrix(n,n,1,12) = params_8.t();
   }
 
-  if (globaloptions::get().verbose>=3) {
+  if (ctx.verbose>=3) {
     cout << "Chosen parameters:\n" << paramlist << endl;
   }
 
-  globaloptions::get().anglerep = useranglerep;
-  globaloptions::get().verbose = storedverbose;
-  globaloptions::get().dof = storeddof;
+  ctx.anglerep = useranglerep;
+  ctx.verbose = storedctxverbose;
 }
 
 
 ////////////////////////////////////////////////////////////////////////////
 
-float measure_cost(Matrix& affmat, int input_dof)
+float measure_cost(RegistrationContext& ctx, Matrix& affmat, int input_dof)
 {
   Tracer tr("measure_cost");
   // the most basic strategy - just do a single optimisation run at the
@@ -917,7 +1333,7 @@ float measure_cost(Matrix& affmat, int input_dof)
     dof=12;
   }
 
-  return costfn(affmat);
+  return costfn(ctx,affmat);
 }
 
 
@@ -964,13 +1380,14 @@ void alignpaxes(Matrix& affmat)
 
 ////////////////////////////////////////////////////////////////////////////
 
-int optimise_strategy0(Matrix& matresult, float& fans, int max_iterations=4)
+int optimise_strategy0(RegistrationContext& ctx, Matrix& matresult, float& fans,
+		       int max_iterations=4)
 {
   Tracer tr("optimise_strategy0");
   // the most basic strategy - just do a single optimisation run at the
   //  specified dof
 
-  if (globaloptions::get().verbose>3) {
+  if (ctx.verbose>3) {
     cout << "Using subset cost function" << endl;
   }
 
@@ -978,39 +1395,39 @@ int optimise_strategy0(Matrix& matresult, float& fans, int max_iterations=4)
     param_tol1(12);
   int no_its=0;
 
-  globaloptions::get().no_params = 12; // necessary for any subset_costfn call
+  ctx.no_params = 12; // necessary for any subset_costfn call
 
-  affmat2vector(matresult,12,params);
-  globaloptions::get().refparams = params;
+  affmat2vector(ctx,matresult,12,params);
+  ctx.refparams = params;
 
   // calculate the parameter tolerances
-  param_tol0 = globaloptions::get().refparams;
-  params12toN(param_tol0);
+  param_tol0 = ctx.refparams;
+  params12toN(ctx,param_tol0);
   set_param_tols(param_tol1,12);
-  param_tol1 = param_tol1 + globaloptions::get().refparams;
-  params12toN(param_tol1);
+  param_tol1 = param_tol1 + ctx.refparams;
+  params12toN(ctx,param_tol1);
   param_tol = param_tol1 - param_tol0;
 
 
-  params_N = globaloptions::get().refparams;
-  params12toN(params_N);
-  if (globaloptions::get().verbose>6) {
+  params_N = ctx.refparams;
+  params12toN(ctx,params_N);
+  if (ctx.verbose>6) {
     cout << "Starting with " << params_N.t();
     cout << "  and tolerance " << param_tol.t();
   }
-  optimise(params_N,globaloptions::get().parammask.Ncols(),
+  optimise(ctx,params_N,ctx.parammask.Ncols(),
 	   param_tol,no_its,&fans,subset_costfn,max_iterations);
-  paramsNto12(params_N);
+  paramsNto12(ctx,params_N);
   params = params_N;
 
-  vector2affine(params,12,matresult);
+  vector2affine(ctx,params,12,matresult);
   return no_its;
 }
 
 
 
-int optimise_strategy1(Matrix& matresult, float& fans, int input_dof,
-		       int max_iterations=4)
+int optimise_strategy1(RegistrationContext& ctx, Matrix& matresult, float& fans,
+		       int input_dof, int max_iterations=4)
 {
   Tracer tr("optimise_strategy1");
   // the most basic strategy - just do a single optimisation run at the
@@ -1027,16 +1444,16 @@ int optimise_strategy1(Matrix& matresult, float& fans, int input_dof,
 
   ColumnVector params(12), param_tol(12);
   int no_its=0;
-  globaloptions::get().no_params = dof;
+  ctx.no_params = dof;
   set_param_tols(param_tol,12);  // 12 used to be dof
-  affmat2vector(matresult,dof,params);
+  affmat2vector(ctx,matresult,dof,params);
   //optimise(params,dof,param_tol,&no_its,&fans,costfn,max_iterations);
-  if (globaloptions::get().verbose>6) {
+  if (ctx.verbose>6) {
     cout << "Starting with " << params.t();
     cout << "  and tolerance " << param_tol.t();
   }
-  optimise(params,dof,param_tol,no_its,&fans,costfn,max_iterations);
-  vector2affine(params,dof,matresult);
+  optimise(ctx,params,dof,param_tol,no_its,&fans,costfn,max_iterations);
+  vector2affine(ctx,params,dof,matresult);
   return no_its;
 }
 
@@ -1140,8 +1557,9 @@ void optimise_strategy3(Matrix& opt_matrixlist)
 
   Matrix paramlist;
   volume<float> costs,tx,ty,tz,scale;
-  globaloptions::get().currentcostfn = globaloptions::get().searchcostfn;
-  search_cost(paramlist,costs,tx,ty,tz,scale);
+  RegistrationContext ctx;
+  ctx.currentcostfn = globaloptions::get().searchcostfn;
+  search_cost(ctx,paramlist,costs,tx,ty,tz,scale);
 
   int dof = Min(globaloptions::get().dof,7);
   ColumnVector params_8(12);
@@ -1150,7 +1568,7 @@ void optimise_strategy3(Matrix& opt_matrixlist)
   opt_matrixlist.ReSize(0,34);
   // freely optimise each member of the parameter list (allow rotns to vary)
   int verbose = globaloptions::get().verbose;
-  globaloptions::get().verbose-=2;
+  ctx.verbose = verbose - 2;
   if (verbose>=3) {
     cout << "After free optimisation, parameters are:" << endl;
   }
@@ -1158,12 +1576,12 @@ void optimise_strategy3(Matrix& opt_matrixlist)
     params_8 = paramlist.SubMatrix(n,n,1,12).t();
     vector2affine(params_8,dof,matresult);
     premat = matresult;
-    optimise_strategy1(matresult,costval,dof);
+    optimise_strategy1(ctx,matresult,costval,dof);
     // form the optimised and pre-optimised costs and matrices into a row
     reshape(reshapedmat,matresult,1,16);
     matrow(1,1) = costval;
     matrow.SubMatrix(1,1,2,17) = reshapedmat;
-    matrow(1,18) = costfn(premat);
+    matrow(1,18) = costfn(ctx,premat);
     reshape(reshapedmat,premat,1,16);
     matrow.SubMatrix(1,1,19,34) = reshapedmat;
     // add the row to the optimised list (ordered by optimised cost)
@@ -1173,10 +1591,13 @@ void optimise_strategy3(Matrix& opt_matrixlist)
       cout << costval << " ::: " << params_8.t();
     }
   }
-  globaloptions::get().verbose = verbose;
-  globaloptions::get().currentcostfn = globaloptions::get().maincostfn;
+  // the search has always left its parameter subset (translations and
+  //  scale) as the one used by later subset optimisations, and schedules
+  //  rely on this, so it is kept here
+  globaloptions::get().parammask = ctx.parammask;
+  globaloptions::get().no_params = ctx.no_params;
 
-  if (globaloptions::get().verbose>=3) {
+  if (verbose>=3) {
     cout << "Parameters (1st column costs) are:\n" << opt_matrixlist << endl;
   }
 }
@@ -1193,7 +1614,8 @@ void set_perturbations(Matrix& delta, Matrix& perturbmask)
   // the number of columns of perturbmask set the number of perturbations
   //  to be tried - it should always include a zero column = unperturbed case
   ColumnVector coarserx, coarsery, coarserz, finerx, finery, finerz;
-  set_rot_samplings(coarserx,coarsery,coarserz,finerx,finery,finerz);
+  set_rot_samplings(coarserx,coarsery,coarserz,finerx,finery,finerz,
+		    globaloptions::get().verbose);
   ColumnVector param_tol(12);
   set_param_tols(param_tol,12);
   // set the magnitude of the variations
@@ -1322,7 +1744,7 @@ int get_testvol(volume<float>& testvol)
   short dtype=0;
   float minval=0.0, maxval=0.0;
   if (!read_testvol) {
-    FLIRT_read_volume(testvol,globaloptions::get().inputfname);
+    FLIRT_read_volume(testvol,globaloptions::get().inputfname,global_raw_testvol);
     dtype = NEWIMAGE::dtype(globaloptions::get().inputfname);
     if (!globaloptions::get().forcedatatype)
       globaloptions::get().datatype = dtype;
@@ -1370,7 +1792,24 @@ int get_testvol(volume<float>& testvol)
 int get_refvol(volume<float>& refvol)
 {
   Tracer tr("get_refvol");
-  FLIRT_read_volume(refvol,globaloptions::get().reffname);
+  string refname = preload_name(globaloptions::get().reffname);
+  std::map<string, PreloadedRef>::const_iterator preloaded =
+    global_preloaded_refs.find(refname);
+  if ( (preloaded!=global_preloaded_refs.end()) &&
+       (preloaded->second.stamp!=preload_stamp(refname)) ) {
+    if (globaloptions::get().verbose>0) {
+      cout << "Reference " << globaloptions::get().reffname
+	   << " has changed since the server read it" << endl;
+    }
+    preloaded = global_preloaded_refs.end();
+  }
+  if (preloaded!=global_preloaded_refs.end()) {
+    global_raw_refvol = preloaded->second.vol;
+    refvol = global_raw_refvol;
+    apply_basescale(refvol);
+  } else {
+    FLIRT_read_volume(refvol,globaloptions::get().reffname,global_raw_refvol);
+  }
   if ((refvol.zsize()==1) && (globaloptions::get().do_optimise)) {
     double_end_slices(refvol);
   }
@@ -1430,26 +1869,43 @@ int get_refvol(volume<float>& refvol)
   return 0;
 }
 
+// the filters use the separable multi-threaded versions (in fastfilters.cc)
+//  of the newimage subsample_by_2, blur and isotropic_resample
+
 volume<float> filter_subsample_by_2(const volume<float>& vin)
 {
-  return subsample_by_2(vin);
+  return fast_subsample_by_2(vin,globaloptions::get().nthreads);
 }
 
 volume<float> filter_blur(const volume<float>& vin)
 {
   volume<float> tmpvol;
-  tmpvol = blur(vin,global_sampling);
+  tmpvol = fast_blur(vin,global_sampling,globaloptions::get().nthreads);
   return tmpvol;
 }
 
 volume<float> filter_resamp_blur(const volume<float>& vin)
 {
   volume<float> tmpvol;
-  tmpvol = blur(vin,global_sampling);
-  tmpvol = isotropic_resample(tmpvol,global_sampling);
+  tmpvol = fast_blur(vin,global_sampling,globaloptions::get().nthreads);
+  tmpvol = fast_isotropic_resample(tmpvol,global_sampling,
+				   globaloptions::get().nthreads);
   return tmpvol;
 }
 
+// maps the filters above onto the fused versions in fastfilters.cc
+//  (returns false for any other filter)
+
+bool fast_filter_type(volume<float> (*filter_func)(const volume<float>&),
+		      FastFilterType& type)
+{
+  if (filter_func==filter_blur) { type=FastBlur; return true; }
+  if (filter_func==filter_resamp_blur) { type=FastResampBlur; return true; }
+  if (filter_func==filter_subsample_by_2) { type=FastSubsample2; return true; }
+  return false;
+}
+
+
 int filter_weight(volume<float>& blur_w, const volume<float>& weight,
 		  volume<float> (*filter_func)(const volume<float>&))
 {
@@ -1457,6 +1913,16 @@ int filter_weight(volume<float>& blur_w, const volume<float>& weight,
   //                  where W is the weight and B is a binarised weight
   // filter(...) = isotropic_resample(blur(...))
   float thresh1=0.01, thresh2=0.9;
+  FastFilterType type;
+  if (fast_filter_type(filter_func,type)) {
+    // both filters in one pass (safe if blur_w = weight on input)
+    volume<float> fastvol;
+    if (fast_masked_filter(fastvol,weight,weight,thresh1,false,thresh2,type,
+			   global_sampling,globaloptions::get().nthreads)) {
+      blur_w = fastvol;
+      return 0;
+    }
+  }
   volume<float> tmpvol;
   // form B
   tmpvol = binarise(weight,thresh1);
@@ -1489,6 +1955,16 @@ int filter_image(volume<float>& blur_im, const volume<float>& orig_im,
   // filter(...) = isotropic_resample(blur(...))
   // form B then filter(I.*B)
   float thresh=0.01;
+  FastFilterType type;
+  if (fast_filter_type(filter_func,type)) {
+    // both filters in one pass (safe if blur_im = orig_im on input)
+    volume<float> fastvol;
+    if (fast_masked_filter(fastvol,orig_im,weight,thresh,true,0.0,type,
+			   global_sampling,globaloptions::get().nthreads)) {
+      blur_im = fastvol;
+      return 0;
+    }
+  }
   volume<float> tmpvol;
   tmpvol = binarise(weight,thresh);
   // NB: if blur_im = orig_im on input, then the following line changes orig_im!
@@ -1632,8 +2108,9 @@ void do_applyxfm()
 
   if (globaloptions::get().outputfname.size()>0) {
     volume4D<float> outputvol;
+    int ntimes = testvol.maxt() - testvol.mint() + 1;
+    std::vector<volume<float>*> inslots(ntimes), outslots(ntimes);
     for (int t0=testvol.mint(); t0<=testvol.maxt(); t0++) {
-      int tref=t0-testvol.mint();
       outputvol.addvolume(refvol);
       if ((globaloptions::get().interpmethod != NearestNeighbour) &&
 	  (globaloptions::get().interpblur)) {
@@ -1646,9 +2123,34 @@ void do_applyxfm()
 	print_volume_info(refvol,"refvol");
 	print_volume_info(testvol,"inputvol");
       }
-      ShadowVolume<float> tempvol(outputvol[tref]);
-      final_transform(testvol[t0],refvol,globaloptions::get().initmat,tempvol);
     }
+    // (the volumes are only indexed once all the outputs have been added)
+    for (int t0=testvol.mint(); t0<=testvol.maxt(); t0++) {
+      int tref=t0-testvol.mint();
+      inslots[tref] = &(testvol[t0]);
+      outslots[tref] = &(outputvol[tref]);
+    }
+    // timepoints are resampled concurrently, each with a share of the
+    //  threads (but one at a time with a fieldmap, as the Costfn is shared,
+    //  or for newimage sinc resampling, as the volumes share the workspace
+    //  of one kernel); all the volumes are set up (and their shadows made
+    //  and freed) here, so that the threads only resample
+    int nthreads = globaloptions::get().nthreads;
+    bool concurrent = ( (globaloptions::get().pe_dir==0) &&
+			( globaloptions::get().fastresample ||
+			  (globaloptions::get().interpmethod != NEWIMAGE::Sinc) ) );
+    int nconcurrent = (concurrent ? Min(nthreads,ntimes) : 1);
+    int nvolthreads = Max(1,nthreads/Max(1,nconcurrent));
+    std::vector<ShadowVolume<float>*> shadows(ntimes);
+    for (int tref=0; tref<ntimes; tref++) {
+      prepare_final_transform(*(inslots[tref]));
+      shadows[tref] = new ShadowVolume<float>(*(outslots[tref]));
+    }
+    parallel_for(ntimes,nconcurrent,[&](int tref, int thread) {
+	apply_final_transform(*(inslots[tref]),refvol,globaloptions::get().initmat,
+			      *(shadows[tref]),nvolthreads);
+      });
+    for (int tref=0; tref<ntimes; tref++) { delete shadows[tref]; }
     int outputdtype = output_dtype(outputvol);
     outputvol.setDisplayMaximumMinimum(0,0);
     outputvol.settdim(testvol.tdim());
@@ -2014,6 +2516,8 @@ int usrsetoption(const std::vector<string> &words)
       globaloptions::get().impair->fuzzyfrac = globaloptions::get().fuzzyfrac;
     return 0;
   } else if (option=="optimisationtype") {
+    // brent or powell (MISCMATHS::optimise), or lbfgs, which is experimental
+    //  until it has been compared with them on real registrations
     globaloptions::get().optimisationtype = words[2];
     return 0;
   } else if (option=="costfunction") {
@@ -2040,6 +2544,10 @@ int usrsetoption(const std::vector<string> &words)
   } else if (option=="boundguess") {
     globaloptions::get().boundguess = fvalues;
     return 0;
+  } else if (option=="gradientstep") {
+    // for the (experimental) lbfgs optimisation type only
+    globaloptions::get().gradientstep = fvalues(1);
+    return 0;
   } else if (option=="nosubset") {
     globaloptions::get().usrsubset = false;
     return 0;
@@ -2062,7 +2570,13 @@ int usrsetoption(const std::vector<string> &words)
     globaloptions::get().min_sampling = fvalues(1);
     return 0;
   } else if (option=="bbrstep") {
-    globaloptions::get().impair->set_bbr_step(fvalues(1));
+    globaloptions::get().bbrstep = (int) fvalues(1);
+    if (globaloptions::get().impair)
+      globaloptions::get().impair->set_bbr_step(globaloptions::get().bbrstep);
+    global_costcache.clear();  // previous BBR costs are no longer valid
+    return 0;
+  } else if (option=="gridtopk") {
+    globaloptions::get().gridtopk = (int) fvalues(1);
     return 0;
   } else {
     cerr << "Option " << option << " is unrecognised - ignoring" << endl;
@@ -2252,6 +2766,15 @@ void usrprintparams(MatVecPtr usrmatptr,
 }
 
 
+int usrnumrows(MatVecPtr usrmatptr, unsigned int usrrow1, unsigned int usrrow2)
+{
+  // number of rows (from usrrow1 to usrrow2) actually present in usrmatptr
+  unsigned int lastrow = Min(usrrow2,usrmatptr->size());
+  if (lastrow<usrrow1) return 0;
+  return lastrow - usrrow1 + 1;
+}
+
+
 void usrmeasurecost(MatVecPtr stdresultmat,
 		    MatVecPtr usrmatptr,
 		    unsigned int usrrow1, unsigned int usrrow2, int usrdof,
@@ -2259,33 +2782,47 @@ void usrmeasurecost(MatVecPtr stdresultmat,
 {
   Tracer tr("usrmeasurecost");
   // MEASURE COST
-  Matrix delta, perturbmask, matresult;
+  // rows are done concurrently (each with its own context) and the results
+  //  stored by row, then added to stdresultmat in the original row order
+  Matrix delta, perturbmask;
   set_perturbations(delta,perturbmask);
   int dof = Min(globaloptions::get().dof,usrdof);
-  ColumnVector params(12);
-  RowVector rowresult(17);
-  for (unsigned int crow=usrrow1; crow<=Min(usrrow2,usrmatptr->size()); crow++)
-    {
+  int nrows = usrnumrows(usrmatptr,usrrow1,usrrow2);
+  int nthreads = Min(globaloptions::get().nthreads,nrows);
+  RegistrationContext ctx;
+  std::vector<RegistrationContext*> workers;
+  setup_worker_contexts(ctx,workers,nthreads);
+  MatVec rowresults(nrows);
+  parallel_for(nrows,nthreads,[&](int r, int thread) {
+      RegistrationContext& wctx = worker_context(ctx,workers,thread);
+      unsigned int crow = usrrow1 + r;
+      Matrix matresult;
+      ColumnVector params(12);
+      RowVector rowresult(17);
       // the pre-optimised case with perturbations
       Matrix reshaped = (*usrmatptr)[crow-1].SubMatrix(1,1,2,17);
       reshape(matresult,reshaped,4,4);
-      affmat2vector(matresult,12,params);
+      affmat2vector(wctx,matresult,12,params);
       // use the elementwise product to produce the perturbation
       if (usrperturbrelative) {
 	params += SP(usrperturbation,delta); // rel
       } else {
 	params += usrperturbation; // abs
       }
-      vector2affine(params,12,matresult);
+      vector2affine(wctx,params,12,matresult);
 
       float costval=0.0;
-      costval = measure_cost(matresult,dof);
+      costval = measure_cost(wctx,matresult,dof);
       reshape(reshaped,matresult,1,16);
       rowresult(1) = costval;
       rowresult.SubMatrix(1,1,2,17) = reshaped;
-      // store result
-      stdresultmat->push_back(rowresult);
-    }
+      rowresults[r] = rowresult;
+    });
+  free_worker_contexts(workers);
+  // store results
+  for (int r=0; r<nrows; r++) {
+    stdresultmat->push_back(rowresults[r]);
+  }
 }
 
 
@@ -2296,52 +2833,85 @@ void usrgridmeasurecost(MatVecPtr stdresultmat,
 			ColumnVector& usrperturbation2, bool usrperturbrelative)
 {
   Tracer tr("usrgridmeasurecost");
-  // OPTIMISE
-  Matrix delta, perturbmask, matresult;
+  // MEASURE COST over a grid of perturbations
+  // all (row,gridpoint) pairs are treated as one flat index space that is
+  //  split over the threads, with gridpoint n using the same perturbation
+  //  as the nth step of the original odometer (nested loop) ordering
+  // if the gridtopk option is set then only the best K results for each
+  //  row are kept (in order of increasing cost), otherwise all are kept
+  Matrix delta, perturbmask;
   set_perturbations(delta,perturbmask);
   int dof = Min(globaloptions::get().dof,usrdof);
-  ColumnVector params0(12), params(12), usrperturbation;
-  RowVector rowresult(17);
-  for (unsigned int crow=usrrow1; crow<=Min(usrrow2,usrmatptr->size()); crow++)
-    {
-      Matrix reshaped = (*usrmatptr)[crow-1].SubMatrix(1,1,2,17);
-      reshape(matresult,reshaped,4,4);
-      affmat2vector(matresult,12,params0);
-      ColumnVector nsteps(usrperturbation1.Nrows());
-      for (int n=1; n<=nsteps.Nrows(); n++) {
-	nsteps(n) = ceil(Max((usrperturbation2(n)-usrperturbation1(n))/usrpertstep(n),1e-6)+0.000001);
+  int nrows = usrnumrows(usrmatptr,usrrow1,usrrow2);
+  ColumnVector nsteps(usrperturbation1.Nrows());
+  for (int n=1; n<=nsteps.Nrows(); n++) {
+    nsteps(n) = ceil(Max((usrperturbation2(n)-usrperturbation1(n))/usrpertstep(n),1e-6)+0.000001);
+  }
+  int nit = 1;
+  for (int n=1; n<=nsteps.Nrows(); n++) { nit *= MISCMATHS::round(nsteps(n)); }
+
+  RegistrationContext ctx;
+  std::vector<ColumnVector> rowparams(nrows);
+  for (int r=0; r<nrows; r++) {
+    Matrix matresult;
+    Matrix reshaped = (*usrmatptr)[usrrow1+r-1].SubMatrix(1,1,2,17);
+    reshape(matresult,reshaped,4,4);
+    rowparams[r].ReSize(12);
+    affmat2vector(ctx,matresult,12,rowparams[r]);
+  }
+
+  int ntotal = nrows*nit;
+  int nthreads = Min(globaloptions::get().nthreads,ntotal);
+  std::vector<RegistrationContext*> workers;
+  setup_worker_contexts(ctx,workers,nthreads);
+  MatVec gridresults(ntotal);
+  parallel_for(ntotal,nthreads,[&](int idx, int thread) {
+      RegistrationContext& wctx = worker_context(ctx,workers,thread);
+      int r = idx / nit;
+      int n = idx % nit + 1;
+      // the odometer position after n steps (wrapping to zero at n=nit)
+      ColumnVector nvec(nsteps.Nrows());
+      int count = n % nit;
+      for (int m=1; m<=nsteps.Nrows(); m++) {
+	int nm = MISCMATHS::round(nsteps(m));
+	nvec(m) = count % nm;
+	count /= nm;
       }
-      int nit = 1;
-      for (int n=1; n<=nsteps.Nrows(); n++) { nit *= MISCMATHS::round(nsteps(n)); }
-      ColumnVector nvec;
-      nvec = nsteps * 0.0f;
-      for (int n=1; n<=nit; n++) {
-	params = params0;  // start with the unperturbed params
-	// the following increments the step pointer (to simulate n nested loops)
-	int step=1;
-	for (int m=1; m<=nsteps.Nrows(); m++) {
-	  nvec(m)+=step;
-	  if (MISCMATHS::round(nvec(m))<MISCMATHS::round(nsteps(m))) { step=0; }
-	  else { nvec(m)=0.0f; }
-	}
-	usrperturbation = usrperturbation1 + SP(nvec,usrpertstep);
-	// use the elementwise product to produce the perturbation
-	if (usrperturbrelative) {
-	  params += SP(usrperturbation,delta); // rel
-	} else {
-	  params += usrperturbation; // abs
-	}
-	vector2affine(params,12,matresult);
-
-	float costval=0.0;
-	costval = measure_cost(matresult,dof);
-	reshape(reshaped,matresult,1,16);
-	rowresult(1) = costval;
-	rowresult.SubMatrix(1,1,2,17) = reshaped;
-	// store result
-	stdresultmat->push_back(rowresult);
+      ColumnVector params(rowparams[r]), usrperturbation;
+      usrperturbation = usrperturbation1 + SP(nvec,usrpertstep);
+      // use the elementwise product to produce the perturbation
+      if (usrperturbrelative) {
+	params += SP(usrperturbation,delta); // rel
+      } else {
+	params += usrperturbation; // abs
       }
+      Matrix matresult, reshaped;
+      vector2affine(wctx,params,12,matresult);
+
+      float costval=0.0;
+      costval = measure_cost(wctx,matresult,dof);
+      reshape(reshaped,matresult,1,16);
+      RowVector rowresult(17);
+      rowresult(1) = costval;
+      rowresult.SubMatrix(1,1,2,17) = reshaped;
+      gridresults[idx] = rowresult;
+    });
+  free_worker_contexts(workers);
+
+  // store results
+  int topk = globaloptions::get().gridtopk;
+  for (int r=0; r<nrows; r++) {
+    std::vector<int> order(nit);
+    for (int n=0; n<nit; n++) { order[n] = r*nit + n; }
+    if ((topk>0) && (topk<nit)) {
+      std::stable_sort(order.begin(),order.end(),[&](int i1, int i2) {
+	  return gridresults[i1](1) < gridresults[i2](1); });
+      order.resize(topk);
+    }
+    for (unsigned int n=0; n<order.size(); n++) {
+      stdresultmat->push_back(gridresults[order[n]]);
     }
+  }
 }
 
 
@@ -2353,54 +2923,322 @@ void usroptimise(MatVecPtr stdresultmat,
 {
   Tracer tr("usroptimise");
   // OPTIMISE
-  Matrix delta, perturbmask, matresult;
+  // rows are done concurrently (as for usrmeasurecost)
+  Matrix delta, perturbmask;
   set_perturbations(delta,perturbmask);
   int dof = Min(globaloptions::get().dof,usrdof);
-  ColumnVector params(12);
-  RowVector rowresult(17);
-  for (unsigned int crow=usrrow1; crow<=Min(usrrow2,usrmatptr->size()); crow++)
-    {
+  int nrows = usrnumrows(usrmatptr,usrrow1,usrrow2);
+  int nthreads = Min(globaloptions::get().nthreads,nrows);
+  RegistrationContext ctx;
+  std::vector<RegistrationContext*> workers;
+  setup_worker_contexts(ctx,workers,nthreads);
+  MatVec rowresults(nrows);
+  parallel_for(nrows,nthreads,[&](int r, int thread) {
+      RegistrationContext& wctx = worker_context(ctx,workers,thread);
+      unsigned int crow = usrrow1 + r;
+      Matrix matresult;
+      ColumnVector params(12);
+      RowVector rowresult(17);
       // the pre-optimised case with perturbations
       Matrix reshaped = (*usrmatptr)[crow-1].SubMatrix(1,1,2,17);
       reshape(matresult,reshaped,4,4);
-      affmat2vector(matresult,12,params);
+      affmat2vector(wctx,matresult,12,params);
       // use the elementwise product to produce the perturbation
       if (usrperturbrelative) {
 	params += SP(usrperturbation,delta); // rel
       } else {
 	params += usrperturbation; // abs
       }
-      vector2affine(params,12,matresult);
+      vector2affine(wctx,params,12,matresult);
 
       float costval=0.0;
       if (globaloptions::get().usrsubset) {
-	optimise_strategy0(matresult,costval,usrmaxitn);
+	optimise_strategy0(wctx,matresult,costval,usrmaxitn);
       } else {
-	optimise_strategy1(matresult,costval,dof,usrmaxitn);
+	optimise_strategy1(wctx,matresult,costval,dof,usrmaxitn);
       }
       reshape(reshaped,matresult,1,16);
       rowresult(1) = costval;
       rowresult.SubMatrix(1,1,2,17) = reshaped;
-      // store result
-      stdresultmat->push_back(rowresult);
-    }
+      rowresults[r] = rowresult;
+    });
+  free_worker_contexts(workers);
+  // store results
+  for (int r=0; r<nrows; r++) {
+    stdresultmat->push_back(rowresults[r]);
+  }
 }
 
 
 
+// reference volumes (and weights) for any scales other than 8, 4, 2 and 1,
+//  each resampled directly from the original reference volume
+struct RefLevel {
+  float scale;
+  volume<float> refvol, refweight;
+};
+
+std::vector<RefLevel*> global_reflevels;
+
+
+RefLevel* make_resampled_ref_level(float scale)
+{
+  Tracer tr("make_resampled_ref_level");
+  for (unsigned int n=0; n<global_reflevels.size(); n++) {
+    if (fabs(global_reflevels[n]->scale - scale)<0.01)
+      return global_reflevels[n];
+  }
+  RefLevel *reflevel = new RefLevel;
+  reflevel->scale = scale;
+  reflevel->refvol = global_init_refvol;
+  if (globaloptions::get().useweights) global_refweight = global_init_refweight;
+  resample_refvol(reflevel->refvol,scale);
+  if (globaloptions::get().useweights) {
+    resample_refvol(global_refweight,scale);
+    reflevel->refweight = global_refweight;
+  }
+  global_reflevels.push_back(reflevel);
+  return reflevel;
+}
+
+
+void clear_ref_levels()
+{
+  for (unsigned int n=0; n<global_reflevels.size(); n++) {
+    delete global_reflevels[n];
+  }
+  global_reflevels.clear();
+}
+
+
+// the blurred test volume and weights, and the image pair, for each scale
+//  that has been used, so that returning to a scale does not redo them
+struct ScaleLevel {
+  float scale;
+  volume<float> testvol, testweight, refweight;
+  Costfn *pair;
+};
+
+std::vector<ScaleLevel*> global_scalelevels;
+
+
+ScaleLevel* find_scale_level(float scale)
+{
+  for (unsigned int n=0; n<global_scalelevels.size(); n++) {
+    if (fabs(global_scalelevels[n]->scale - scale)<0.01)
+      return global_scalelevels[n];
+  }
+  return 0;
+}
+
+
+ScaleLevel* find_pair_level(const Costfn* pair)
+{
+  for (unsigned int n=0; n<global_scalelevels.size(); n++) {
+    if (global_scalelevels[n]->pair == pair) return global_scalelevels[n];
+  }
+  return 0;
+}
+
+
+bool is_scale_level_pair(const Costfn* pair)
+{
+  return (find_pair_level(pair)!=0);
+}
+
+
+void release_impair()
+{
+  // deletes the current image pair, unless it belongs to a stored scale
+  if (!is_scale_level_pair(globaloptions::get().impair))
+    delete globaloptions::get().impair;
+  globaloptions::get().impair = NULL;
+  clear_worker_pairs();
+}
+
+
+void clear_scale_levels()
+{
+  clear_worker_pairs();
+  if (is_scale_level_pair(globaloptions::get().impair))
+    globaloptions::get().impair = NULL;
+  for (unsigned int n=0; n<global_scalelevels.size(); n++) {
+    delete global_scalelevels[n]->pair;
+    delete global_scalelevels[n];
+  }
+  global_scalelevels.clear();
+}
+
+
+bool starts_with_setscale(const std::vector<string>& schedulecoms)
+{
+  // true if the first command (ignoring comments) in the schedule is setscale
+  for (unsigned int i=0; i<schedulecoms.size(); i++) {
+    std::vector<string> words(0);
+    parseline(schedulecoms[i],words);
+    if (words.size()<1) continue;
+    if ((words[0])[0] == '#') continue;
+    return (words[0]=="setscale");
+  }
+  return false;
+}
+
+
+void make_ref_level(int factor, volume<float>& refvol,
+		    volume<float>& refvol_2, volume<float>& refvol_4,
+		    volume<float>& refvol_8)
+{
+  // builds (only the first time it is needed) the reference volume and
+  //  weight subsampled by factor (2, 4 or 8) from the next finer level
+  Tracer tr("make_ref_level");
+  volume<float> *src=0, *srcweight=0, *dest=0, *destweight=0;
+  bool *levelOK=0;
+  float maxsampling=0.0;
+  if (factor==2) {
+    src = &refvol;  srcweight = &global_refweight1;
+    dest = &refvol_2;  destweight = &global_refweight2;
+    levelOK = &global_refvol2OK;  maxsampling = 1.9;
+  } else if (factor==4) {
+    make_ref_level(2,refvol,refvol_2,refvol_4,refvol_8);
+    src = &refvol_2;  srcweight = &global_refweight2;
+    dest = &refvol_4;  destweight = &global_refweight4;
+    levelOK = &global_refvol4OK;  maxsampling = 3.9;
+  } else if (factor==8) {
+    make_ref_level(4,refvol,refvol_2,refvol_4,refvol_8);
+    src = &refvol_4;  srcweight = &global_refweight4;
+    dest = &refvol_8;  destweight = &global_refweight8;
+    levelOK = &global_refvol8OK;  maxsampling = 7.9;
+  } else {
+    return;
+  }
+  if (*levelOK) return;
+
+  bool useweights = globaloptions::get().useweights;
+  // the following test enforces a maximum subsampling (i.e. for large voxel sizes, do not subsample as much as if the voxels are small)
+  if ( globaloptions::get().resample &&
+       (globaloptions::get().min_sampling < maxsampling) ) {
+    if (globaloptions::get().verbose >= 2)
+      cout << "Subsampling the reference volume by " << factor << endl;
+    // the image and the weight do not depend on each other, so are
+    //  subsampled at the same time, with the image given its own copy of
+    //  the weight (newimage volumes cache some values lazily, so one volume
+    //  must not be read by both threads)
+    int nthreads = (useweights ? Min(globaloptions::get().nthreads,2) : 1);
+    volume<float> imageweight;
+    if (nthreads>1) imageweight = *srcweight;
+    const volume<float>& srcimageweight = ((nthreads>1) ? imageweight : *srcweight);
+    parallel_for((useweights ? 2 : 1),nthreads,[&](int idx, int thread) {
+	if (idx==0) {
+	  filter_image(*dest,*src,srcimageweight,useweights,filter_subsample_by_2);
+	} else {
+	  filter_weight(*destweight,*srcweight,filter_subsample_by_2);
+	}
+      });
+  } else {
+    *dest = *src;
+    if (useweights) { *destweight = *srcweight; }
+  }
+  *levelOK = true;
+}
+
+
+// the on-disk reference cache holds refvol, refvol_2, refvol_4 and refvol_8
+//  (and the matching weights, if used) as made from the reference volume
+//  read in by get_refvol()
+
+refcachekey reference_cache_key(const volume<float>& refvol)
+{
+  // everything that changes the preprocessed reference volumes
+  refcachekey key = hash_volume(refvol,1);
+  key = hash_value(globaloptions::get().useweights,key);
+  if (globaloptions::get().useweights) key = hash_volume(global_refweight,key);
+  key = hash_value(globaloptions::get().resample,key);
+  key = hash_value(globaloptions::get().min_sampling,key);
+  key = hash_value(globaloptions::get().clamping,key);
+  key = hash_value(globaloptions::get().basescale,key);
+  return key;
+}
+
+
+void ref_pyramid_volumes(volume<float>& refvol, volume<float>& refvol_2,
+			 volume<float>& refvol_4, volume<float>& refvol_8,
+			 std::vector<volume<float>*>& vols)
+{
+  vols.clear();
+  vols.push_back(&refvol);
+  vols.push_back(&refvol_2);
+  vols.push_back(&refvol_4);
+  vols.push_back(&refvol_8);
+  if (globaloptions::get().useweights) {
+    vols.push_back(&global_refweight1);
+    vols.push_back(&global_refweight2);
+    vols.push_back(&global_refweight4);
+    vols.push_back(&global_refweight8);
+  }
+}
+
+
+bool load_ref_pyramid(volume<float>& refvol, volume<float>& refvol_2,
+		      volume<float>& refvol_4, volume<float>& refvol_8)
+{
+  Tracer tr("load_ref_pyramid");
+  std::vector<volume<float>*> vols;
+  ref_pyramid_volumes(refvol,refvol_2,refvol_4,refvol_8,vols);
+  std::vector<const volume<float>*> protos;
+  for (unsigned int n=0; n<vols.size(); n++) {
+    protos.push_back( (n<4) ? &global_init_refvol : &global_init_refweight );
+  }
+  if (!global_refcache.load(vols,protos)) return false;
+  if (globaloptions::get().useweights) global_refweight = global_refweight1;
+  global_refvol2OK = true;
+  global_refvol4OK = true;
+  global_refvol8OK = true;
+  if (globaloptions::get().verbose >= 2)
+    cout << "Using the reference volumes in " << global_refcache.filename() << endl;
+  return true;
+}
+
+
+int save_ref_pyramid(volume<float>& refvol, volume<float>& refvol_2,
+		     volume<float>& refvol_4, volume<float>& refvol_8)
+{
+  Tracer tr("save_ref_pyramid");
+  // all the levels are stored, so make any that the schedule did not use
+  make_ref_level(8,refvol,refvol_2,refvol_4,refvol_8);
+  std::vector<volume<float>*> vols;
+  ref_pyramid_volumes(refvol,refvol_2,refvol_4,refvol_8,vols);
+  std::vector<const volume<float>*> cvols(vols.begin(),vols.end());
+  if (global_refcache.save(cvols)!=0) {
+    cerr << "WARNING: could not write the reference cache file "
+	 << global_refcache.filename() << endl;
+    return -1;
+  }
+  if (globaloptions::get().verbose >= 2)
+    cout << "Saved the reference volumes to " << global_refcache.filename() << endl;
+  return 0;
+}
+
+
 void usrsetscale(float usrscale, bool usrforce,
 		 volume<float>& testvol, volume<float>& refvol,
 		 volume<float>& refvol_2, volume<float>& refvol_4,
 		 volume<float>& refvol_8) {
   // SETSCALE (int usrscale = 8,4,2,1)
-  // testvol must be passed in as a static storage is needed so that
-  //  the object pointed to in globaloptions::get().impair does not go
-  //  out of scope
+  // the blurred testvol, weights and image pair for each scale are kept in
+  //  global_scalelevels, so that the volumes used by the object pointed to
+  //  in globaloptions::get().impair do not go out of scope, and so that
+  //  returning to a previous scale reuses them
   Tracer tr("usrsetscale");
   float scale = usrscale;
   bool forcescale=usrforce;
   if (globaloptions::get().force_scaling) forcescale=true;
   Costfn *globalpair=0;
+  if ( (globaloptions::get().impair==NULL) && !( (forcescale) ||
+	 (globaloptions::get().min_sampling<=1.25 * scale) ) ) {
+    // no image pair has been made yet (see main) and this scale will not
+    //  make one, so start with the 8mm pair as would have been made in main
+    usrsetscale(8.0,true,testvol,refvol,refvol_2,refvol_4,refvol_8);
+  }
   if (usrscale > 0.0) globaloptions::get().requestedscale = usrscale;
 
   if (globaloptions::get().debug) {
@@ -2410,60 +3248,68 @@ void usrsetscale(float usrscale, bool usrforce,
     print_volume_info(testvol,"testvol DEBUG");
   }
 
-  // refresh the testvol (get rid of previous blurred version)
-  get_testvol(testvol);
-
   if ( (forcescale) || (globaloptions::get().min_sampling<=1.25 * scale) ) {  // MJ NOTE: SHOULD THE SCALE BE FORCED TO BE THE NEXT HIGHEST SENSIBLE ONE TO STOP IT STARTING AT 8MM (THE DEFAULT) AND THEN NOT GOING TO 1MM (BUT INSTEAD MAKING IT GO TO 2MM?)
     globaloptions::get().lastsampling = scale;
-    // blur test volume to correct scale
-    volume<float> testvolnew;
-    filter_image(testvolnew,testvol,global_testweight,scale,
-		 globaloptions::get().useweights,filter_blur);
-    if (globaloptions::get().useweights) {
-      filter_weight(global_testweight,global_testweight,scale,filter_blur);
-    }
-    testvol = testvolnew;
-
-    // select correct refvol
-    volume<float> *refvolnew=0;
-    if (fabs(scale-8.0)<0.01) {
-      refvolnew = &refvol_8;
-      if (globaloptions::get().useweights) {
-	global_refweight = global_refweight8;
-      }
-    } else if (fabs(scale-4.0)<0.01) {
-      refvolnew = &refvol_4;
-      if (globaloptions::get().useweights) {
-	global_refweight = global_refweight4;
+    ScaleLevel *level = find_scale_level(scale);
+    if (level) {
+      // been at this scale before, so reuse its volumes and image pair
+      globalpair = level->pair;
+      if (globaloptions::get().verbose>=3) {
+	cout << "Reusing the image pair for scale " << scale << endl;
       }
-    } else if (fabs(scale-2.0)<0.01) {
-      refvolnew = &refvol_2;
+    } else {
+      level = new ScaleLevel;
+      level->scale = scale;
+      // blur test volume to correct scale (starting from the original testvol)
+      volume<float> rawtestvol;
+      get_testvol(rawtestvol);
+      filter_image(level->testvol,rawtestvol,global_testweight,scale,
+		   globaloptions::get().useweights,filter_blur);
       if (globaloptions::get().useweights) {
-	global_refweight = global_refweight2;
+	filter_weight(level->testweight,global_testweight,scale,filter_blur);
       }
-    } else if (global_scale1OK && (fabs(scale-1.0)<0.01) ) {
-      refvolnew = &refvol;
-      if (globaloptions::get().useweights) {
-	global_refweight = global_refweight1;
+
+      // select correct refvol
+      volume<float> *refvolnew=0;
+      if (fabs(scale-8.0)<0.01) {
+	make_ref_level(8,refvol,refvol_2,refvol_4,refvol_8);
+	refvolnew = &refvol_8;
+	if (globaloptions::get().useweights) {
+	  level->refweight = global_refweight8;
+	}
+      } else if (fabs(scale-4.0)<0.01) {
+	make_ref_level(4,refvol,refvol_2,refvol_4,refvol_8);
+	refvolnew = &refvol_4;
+	if (globaloptions::get().useweights) {
+	  level->refweight = global_refweight4;
+	}
+      } else if (fabs(scale-2.0)<0.01) {
+	make_ref_level(2,refvol,refvol_2,refvol_4,refvol_8);
+	refvolnew = &refvol_2;
+	if (globaloptions::get().useweights) {
+	  level->refweight = global_refweight2;
+	}
+      } else if (fabs(scale-1.0)<0.01) {
+	refvolnew = &refvol;
+	if (globaloptions::get().useweights) {
+	  level->refweight = global_refweight1;
+	}
+      } else {
+	// any other scale is resampled from the original refvol
+	RefLevel *reflevel = make_resampled_ref_level(scale);
+	refvolnew = &(reflevel->refvol);
+	if (globaloptions::get().useweights) {
+	  level->refweight = reflevel->refweight;
+	}
       }
-    } else {
-      // make a new refvol at this requested scale
-      global_scale1OK = false;
-      volume<float> tmpvol;
-      get_refvol(tmpvol);  // gets raw refvol and global_refweight
-      resample_refvol(tmpvol,scale);
-      refvol = tmpvol;  // destroy base refvol!
-      refvolnew = &refvol;
       if (globaloptions::get().useweights) {
-	resample_refvol(global_refweight,scale);
-	global_refweight1 = global_refweight;  // destroy global_refweight
+	level->pair = new Costfn(*refvolnew,level->testvol,
+				 level->refweight,level->testweight);
+      } else {
+	level->pair = new Costfn(*refvolnew,level->testvol);
       }
-    }
-    if (globaloptions::get().useweights) {
-      globalpair = new Costfn(*refvolnew,testvol,
-			      global_refweight,global_testweight);
-    } else {
-      globalpair = new Costfn(*refvolnew,testvol);
+      global_scalelevels.push_back(level);
+      globalpair = level->pair;
     }
 
     setup_costfn(globalpair,globaloptions::get().currentcostfn,
@@ -2473,10 +3319,25 @@ void usrsetscale(float usrscale, bool usrforce,
       if (globaloptions::get().impair) {
 	cout << "Previous scale used " << globaloptions::get().impair->count()
 	     << " cost function evaluations" << endl;
+	print_costcache_stats();
       }
     }
-    if (globaloptions::get().impair)  delete globaloptions::get().impair;
+    if (globaloptions::get().impair != globalpair)  release_impair();
     globaloptions::get().impair = globalpair;
+  } else if (globaloptions::get().impair) {
+    // a skipped scale leaves the current reference paired with the original
+    //  (unblurred) test volume and weight, as it always has - these replace
+    //  the blurred ones of the pair's level, which is then not reused
+    ScaleLevel *level = find_pair_level(globaloptions::get().impair);
+    if (level) {
+      get_testvol(level->testvol);
+      if (globaloptions::get().useweights) {
+	level->testweight = global_testweight;
+      }
+      level->scale = -1.0;
+      clear_worker_pairs();
+      global_costcache.clear();  // costs found with the blurred test volume
+    }
   }
 }
 
@@ -2815,13 +3676,14 @@ void interpretcommand(const string& comline, bool& skip,
 
 ////////////////////////////////////////////////////////////////////////////
 
-int main(int argc,char *argv[])
+int run_flirt(int argc,char *argv[])
 {
-  Tracer tr("main");
+  Tracer tr("run_flirt");
 
   try {
 
     globaloptions::get().parse_command_line(argc, argv,version);
+    global_costcache.set_capacity(globaloptions::get().costcachesize);
 
     if (!globaloptions::get().do_optimise) {
       do_applyxfm();
@@ -2835,6 +3697,9 @@ int main(int argc,char *argv[])
 
     volume<float> refvol, testvol;
     get_refvol(refvol);
+    // keep the original reference (and weight) for resampling to other scales
+    global_init_refvol = refvol;
+    if (globaloptions::get().useweights) global_init_refweight = global_refweight;
     get_testvol(testvol);
     set_initmat(refvol,testvol);
 
@@ -2881,66 +3746,65 @@ int main(int argc,char *argv[])
     //    QUESTION: IS IT OK TO RECURSIVELY DEFINE WEIGHTS AND SUBSAMPLE LIKE THIS?
     //              OR WOULD DIRECT IMPLEMENTATION OF 4 AND 8 TIMES SUBSAMPLING BE
     //              BETTER?  (SEP2010)
+    // Only the base level is made here: the levels subsampled by factors of
+    //  2, 4 and 8 are made by make_ref_level() when a scale first needs them
+    // With -refcache all the levels are mapped from the cache file, if one
+    //  has been made for this reference and these options, or otherwise are
+    //  made as usual and saved to it once the schedule has run
+    // (the key is formed from the reference as read and clamped above, so
+    //  every run still reads and clamps it, but no more)
     volume<float> refvol_2, refvol_4, refvol_8;
-    if (globaloptions::get().resample) {
-      // set up subsampled volumes by factors of 2, 4 and 8
-      if (globaloptions::get().verbose >= 2)
-	cout << "Subsampling the volumes" << endl;
-      resample_refvol(refvol,globaloptions::get().min_sampling);
-      filter_weight(global_refweight,global_refweight,
-		    globaloptions::get().min_sampling,filter_resamp_blur);
-      // the following tests enforce a maximum subsampling (i.e. for large voxel sizes, do not subsample as much as if the voxels are small)
+    bool refcached = false;
+    if (globaloptions::get().refcachedir.length()>0) {
+      global_refcache.set_directory(globaloptions::get().refcachedir);
+      global_refcache.set_key(reference_cache_key(refvol));
+      refcached = load_ref_pyramid(refvol,refvol_2,refvol_4,refvol_8);
+    }
+    if (!refcached) {
+      if (globaloptions::get().resample) {
+	if (globaloptions::get().verbose >= 2)
+	  cout << "Subsampling the volumes" << endl;
+	resample_refvol(refvol,globaloptions::get().min_sampling);
+	filter_weight(global_refweight,global_refweight,
+		      globaloptions::get().min_sampling,filter_resamp_blur);
+      }
       global_refweight1 = global_refweight;
-      // SCALE 2
-      if (globaloptions::get().min_sampling < 1.9) {
-	filter_image(refvol_2,refvol,global_refweight,
-		     globaloptions::get().useweights,filter_subsample_by_2);
-	if (globaloptions::get().useweights) {
-	  filter_weight(global_refweight2,global_refweight1,filter_subsample_by_2);
-	}
+    }
+
+    // READ THE SCHEDULE
+
+    std::vector<string> schedulecoms(0);
+    string comline;
+    if (globaloptions::get().schedulefname.length()<1) {
+      if (globaloptions::get().mode2D) {
+	set2Ddefaultschedule(schedulecoms);
       } else {
-	refvol_2 = refvol;
-	if (globaloptions::get().useweights) { global_refweight2 = global_refweight1; }
+	setdefaultschedule(schedulecoms);
       }
-      // SCALE 4
-      if (globaloptions::get().min_sampling < 3.9) {
-	filter_image(refvol_4,refvol_2,global_refweight2,
-		     globaloptions::get().useweights,filter_subsample_by_2);
-	if (globaloptions::get().useweights) {
-	  filter_weight(global_refweight4,global_refweight2,filter_subsample_by_2);
-	}
-      } else {
-	refvol_4 = refvol_2;
-	if (globaloptions::get().useweights) { global_refweight4 = global_refweight2; }
+    } else {
+      // open the schedule file
+      ifstream schedulefile(globaloptions::get().schedulefname.c_str());
+      if (!schedulefile) {
+	cerr << "Could not open file" << globaloptions::get().schedulefname << endl;
+	return -1;
       }
-      // SCALE 8
-      if (globaloptions::get().min_sampling < 7.9) {
-	filter_image(refvol_8,refvol_4,global_refweight4,
-		     globaloptions::get().useweights,filter_subsample_by_2);
-	if (globaloptions::get().useweights) {
-	  filter_weight(global_refweight8,global_refweight4,filter_subsample_by_2);
-	}
-      } else {
-	refvol_8 = refvol_4;
-	if (globaloptions::get().useweights) { global_refweight8 = global_refweight4; }
+      while (!schedulefile.eof()) {
+	getline(schedulefile,comline);
+	schedulecoms.push_back(comline);
       }
+      schedulefile.close();
+    }
 
-    } else {
-      // if no resampling chosen, then refvol is simply copied and nothing done to testvol
-      refvol_8 = refvol;
-      refvol_4 = refvol;
-      refvol_2 = refvol;
-      if (globaloptions::get().useweights) {
-	global_refweight1 = global_refweight;
-	global_refweight2 = global_refweight;
-	global_refweight4 = global_refweight;
-	global_refweight8 = global_refweight;
-      }
+    // the 8mm image pair (and so the 8mm levels) is only needed if the
+    //  schedule does anything before its first setscale
+    bool initialscale8 = !starts_with_setscale(schedulecoms);
+    if (initialscale8 || globaloptions::get().debug) {
+      make_ref_level(8,refvol,refvol_2,refvol_4,refvol_8);
     }
 
 
     // TESTVOL RESAMPLING
-    if (globaloptions::get().resample) {
+    if (globaloptions::get().resample && initialscale8) {
       volume<float> testvol_8;
       filter_image(testvol_8,testvol,global_testweight,8.0,
 		   globaloptions::get().useweights,filter_blur);
@@ -2965,21 +3829,25 @@ int main(int argc,char *argv[])
 
     // set up image pair and global pointer, plus setup cost function params
     if (globaloptions::get().impair)  delete globaloptions::get().impair;
-    global_refweight = global_refweight8;
-    globaloptions::get().lastsampling = 8;
-    if (globaloptions::get().useweights) {
-      globaloptions::get().impair  = new Costfn(refvol_8,testvol,
-						global_refweight,
-						global_testweight);
-    } else {
-      globaloptions::get().impair = new Costfn(refvol_8,testvol);
-    }
-
+    globaloptions::get().impair = NULL;
+    clear_worker_pairs();
     globaloptions::get().currentcostfn = globaloptions::get().maincostfn;
-    setup_costfn(globaloptions::get().impair, globaloptions::get().currentcostfn,
-		 globaloptions::get().no_bins/8,
-		 globaloptions::get().smoothsize,globaloptions::get().fuzzyfrac);
-    if (globaloptions::get().verbose>=2) print_volume_info(testvol,"TESTVOL");
+    if (initialscale8) {
+      global_refweight = global_refweight8;
+      globaloptions::get().lastsampling = 8;
+      if (globaloptions::get().useweights) {
+	globaloptions::get().impair  = new Costfn(refvol_8,testvol,
+						  global_refweight,
+						  global_testweight);
+      } else {
+	globaloptions::get().impair = new Costfn(refvol_8,testvol);
+      }
+
+      setup_costfn(globaloptions::get().impair, globaloptions::get().currentcostfn,
+		   globaloptions::get().no_bins/8,
+		   globaloptions::get().smoothsize,globaloptions::get().fuzzyfrac);
+      if (globaloptions::get().verbose>=2) print_volume_info(testvol,"TESTVOL");
+    }
 
 
     Matrix matresult(4,4);
@@ -2988,28 +3856,6 @@ int main(int argc,char *argv[])
 
     // PERFORM THE OPTIMISATION
 
-    std::vector<string> schedulecoms(0);
-    string comline;
-    if (globaloptions::get().schedulefname.length()<1) {
-      if (globaloptions::get().mode2D) {
-	set2Ddefaultschedule(schedulecoms);
-      } else {
-	setdefaultschedule(schedulecoms);
-      }
-    } else {
-      // open the schedule file
-      ifstream schedulefile(globaloptions::get().schedulefname.c_str());
-      if (!schedulefile) {
-	cerr << "Could not open file" << globaloptions::get().schedulefname << endl;
-	return -1;
-      }
-      while (!schedulefile.eof()) {
-	getline(schedulefile,comline);
-	schedulecoms.push_back(comline);
-      }
-      schedulefile.close();
-    }
-
     // interpret each line in the schedule command vector
     bool skip=false;
     for (unsigned int i=0; i<schedulecoms.size(); i++) {
@@ -3019,6 +3865,10 @@ int main(int argc,char *argv[])
       }
       interpretcommand(comline,skip,testvol,refvol,refvol_2,refvol_4,refvol_8);
     }
+    if (globaloptions::get().verbose>=1) print_costcache_stats();
+    if (!refcached && global_refcache.enabled()) {
+      save_ref_pyramid(refvol,refvol_2,refvol_4,refvol_8);
+    }
 
     if (globaloptions::get().debug) {  // run this to save out any cost function debug info
       cerr << "Final DEBUG call in FLIRT" << endl;
@@ -3036,7 +3886,8 @@ int main(int argc,char *argv[])
 
     // FINISHED OPTIMISATION - NOW GENERATE OUTPUTS
 
-    // re-read the initial volume, and transform it by the optimised result
+    // take the initial volumes (as read at the start, so the same as
+    //  re-reading them with unity basescale), and transform by the result
 
     Matrix reshaped;
     if (globaloptions::get().usrmat[0].size()>0) {
@@ -3047,12 +3898,13 @@ int main(int argc,char *argv[])
       float oldbasescale = globaloptions::get().basescale;
       globaloptions::get().basescale = 1.0;
       // make sure the old images don't get used
-      if (globaloptions::get().impair) {
-	delete globaloptions::get().impair;
-	globaloptions::get().impair = NULL;
-      }
-      FLIRT_read_volume(testvol,globaloptions::get().inputfname);
-      FLIRT_read_volume(refvol,globaloptions::get().reffname);
+      release_impair();
+      clear_scale_levels();
+      clear_ref_levels();
+      testvol = global_raw_testvol;
+      refvol = global_raw_refvol;
+      global_raw_testvol = volume<float>();
+      global_raw_refvol = volume<float>();
       if (globaloptions::get().verbose>=2) {
 	print_volume_info(testvol,"testvol");
 	print_volume_info(refvol,"refvol");
@@ -3066,6 +3918,8 @@ int main(int argc,char *argv[])
 	cout << "Final transform matrix is:" << endl << finalmat << endl;
       }
       save_matrix_data(finalmat,testvol,refvol);
+      global_finalmat = finalmat;
+      global_finalcost = (globaloptions::get().usrmat[0])[0](1);
 
       // generate the outputvolume (not safe_save st -out overrides -nosave)
       if (globaloptions::get().outputfname.size()>0) {
@@ -3077,7 +3931,8 @@ int main(int argc,char *argv[])
 	  filter_image(testvol,testvol,testvol,min_sampling_ref,
 		       false,filter_blur);
 	}
-	final_transform(testvol,refvol,finalmat,newtestvol);
+	final_transform(testvol,refvol,finalmat,newtestvol,
+			globaloptions::get().nthreads);
 	if (globaloptions::get().verbose>=2) {
 	  print_volume_info(newtestvol,"Transformed testvol");
 	}
@@ -3100,3 +3955,144 @@ int main(int argc,char *argv[])
 
   return(0);
 }
+
+
+//////////////////////////////////////////////////////////////////////////
+
+// SERVER MODE
+
+// runs one job in a child of the server (in the directory of the client),
+//  with the reference already read if it is one the server holds, and the
+//  server's reference cache unless the job names its own
+
+string global_serve_refcachedir;
+
+int serve_job(const std::vector<string>& args)
+{
+  std::vector<string> jobargs;
+  jobargs.push_back("flirt");
+  jobargs.push_back("-refcache");
+  jobargs.push_back(global_serve_refcachedir);
+  jobargs.insert(jobargs.end(),args.begin(),args.end());
+  std::vector<char*> jobargv;
+  for (unsigned int n=0; n<jobargs.size(); n++) {
+    jobargv.push_back(const_cast<char*>(jobargs[n].c_str()));
+  }
+  jobargv.push_back(NULL);
+
+  int retval = run_flirt(jobargs.size(),&(jobargv[0]));
+  if (global_finalmat.Nrows()!=4) return 1;
+  cout << serve_result_tag << " " << global_finalcost << endl;
+  for (int r=1; r<=4; r++) {
+    for (int c=1; c<=4; c++) {
+      cout << global_finalmat(r,c) << ((c<4) ? "  " : "");
+    }
+    cout << endl;
+  }
+  return retval;
+}
+
+
+// removes a file or directory found by nftw (for the reference cache)
+
+int remove_cache_entry(const char *path, const struct stat *, int, struct FTW *)
+{
+  if (remove(path)!=0) {
+    cerr << "Could not remove " << path << endl;
+  }
+  return 0;
+}
+
+
+// reads the reference volumes and serves jobs until the server is stopped
+
+int serve_refs(const string& socketname, int maxjobs, int nrefs, char *refs[])
+{
+  try {
+    for (int n=0; n<nrefs; n++) {
+      // stamped before reading, so a change while reading is seen later
+      PreloadedRef preloaded;
+      preloaded.stamp = preload_stamp(preload_name(refs[n]));
+      read_volume(preloaded.vol,refs[n]);  // as radiological
+      global_preloaded_refs[preload_name(refs[n])] = preloaded;
+      cout << "Loaded reference " << refs[n] << endl;
+    }
+  }
+  catch(std::exception &e) {
+    cerr << e.what() << endl;
+    return -1;
+  }
+
+  int listenfd = open_server_socket(socketname);
+  if (listenfd<0) return -1;
+  cout << "Serving registrations on " << socketname << " (reference cache "
+       << global_serve_refcachedir << ")" << endl;
+  int retval = serve_jobs(listenfd,maxjobs,serve_job);
+  close(listenfd);
+  unlink(socketname.c_str());
+  return retval;
+}
+
+
+
+// flirt -serve <socket> [-refcache <directory>] [-maxjobs <n>] <refvol> ...
+//  reads the reference volumes once and then runs jobs sent by flirt_client
+//  (each in its own process, started with these volumes in memory, and at
+//  most maxjobs at once - by default the number of processors); the
+//  preprocessed reference volumes go in the reference cache, so that they
+//  are only made by the first job using each reference and set of options;
+//  the server stops on SIGINT or SIGTERM, removing the socket and (unless
+//  -refcache was given) the reference cache
+
+int serve_flirt(int argc,char *argv[])
+{
+  Tracer tr("serve_flirt");
+  if (argc<4) {
+    cerr << "Usage: " << argv[0] << " -serve <socket> [-refcache <directory>] [-maxjobs <n>] <refvol> [<refvol> ...]" << endl;
+    return -1;
+  }
+  string socketname = argv[2];
+  int maxjobs = Max((int) sysconf(_SC_NPROCESSORS_ONLN),1);
+  int n=3;
+  while ((n+1<argc) && (argv[n][0]=='-')) {
+    string arg = argv[n];
+    if (arg=="-refcache") {
+      global_serve_refcachedir = argv[n+1];
+    } else if (arg=="-maxjobs") {
+      maxjobs = atoi(argv[n+1]);
+    } else {
+      cerr << "Unrecognised option " << arg << endl;
+      return -1;
+    }
+    n+=2;
+  }
+  bool owncachedir = (global_serve_refcachedir.length()<1);
+  if (owncachedir) {
+    char tmpname[] = "/tmp/flirtserveXXXXXX";
+    if (mkdtemp(tmpname)==NULL) {
+      cerr << "Could not make a directory for the reference cache" << endl;
+      return -1;
+    }
+    global_serve_refcachedir = tmpname;
+  }
+  int retval = -1;
+  if (n>=argc) {
+    cerr << "No reference volumes given" << endl;
+  } else {
+    retval = serve_refs(socketname,maxjobs,argc-n,argv+n);
+  }
+  if (owncachedir) {
+    nftw(global_serve_refcachedir.c_str(),remove_cache_entry,16,
+	 FTW_DEPTH | FTW_PHYS);
+  }
+  return retval;
+}
+
+
+int main(int argc,char *argv[])
+{
+  if ( (argc>1) && ((string(argv[1])=="-serve") || (string(argv[1])=="--serve")) ) {
+    return serve_flirt(argc,argv);
+  }
+  return run_flirt(argc,argv);
+}
@@ -0,0 +1,94 @@
+/*  flirt_client.cc
+
+    Sends a registration to a flirt -serve process and prints the result
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+
+#include "flirtserver.h"
+
+using namespace std;
+
+
+int main(int argc, char *argv[])
+{
+  if (argc<3) {
+    cerr << "Usage: " << argv[0] << " <socket> [flirt options] -in <inputvol> -ref <refvol> ..." << endl;
+    cerr << "        Runs the registration in the flirt -serve process listening on <socket>" << endl;
+    cerr << "        and prints the final cost and matrix (all other outputs, such as" << endl;
+    cerr << "        -omat and -out, are written by the server as flirt would write them)" << endl;
+    return -1;
+  }
+
+  vector<string> job;
+  char *cwd = getcwd(NULL,0);
+  if (cwd==NULL) {
+    cerr << "Could not find the current directory" << endl;
+    return -1;
+  }
+  job.push_back(cwd);
+  free(cwd);
+  for (int n=2; n<argc; n++) {
+    job.push_back(argv[n]);
+  }
+
+  int fd = connect_server_socket(argv[1]);
+  if (fd<0) return -1;
+  if (send_strings(fd,job)!=0) {
+    cerr << "Could not send the job to " << argv[1] << endl;
+    close(fd);
+    return -1;
+  }
+
+  // everything up to the result tag is what the job printed
+  string reply;
+  char buf[4096];
+  while (true) {
+    ssize_t nb = read(fd,buf,sizeof(buf));
+    if (nb<0) {
+      if (errno==EINTR) continue;
+      break;
+    }
+    if (nb==0) break;
+    reply.append(buf,nb);
+  }
+  close(fd);
+
+  // the last line gives the exit status of the job
+  string statustag = string("\n") + serve_status_tag + " ";
+  size_t statuspos = reply.rfind(statustag);
+  if ( (statuspos==string::npos) ||
+       (reply.find('\n',statuspos+statustag.length())+1!=reply.length()) ) {
+    cout << reply;
+    cerr << "The registration did not finish" << endl;
+    return 1;
+  }
+  int status = atoi(reply.c_str()+statuspos+statustag.length());
+  reply.erase(statuspos);
+
+  string tag = string(serve_result_tag) + " ";
+  size_t pos = reply.rfind(tag);
+  while ((pos!=string::npos) && (pos>0) && (reply[pos-1]!='\n')) {
+    pos = reply.rfind(tag,pos-1);
+  }
+  if (pos==string::npos) {
+    cout << reply;
+  } else {
+    cout << reply.substr(0,pos);
+    cout << "Final cost = " << reply.substr(pos+tag.length());
+  }
+  if (status!=0) {
+    cerr << "The registration failed (exit status " << status << ")" << endl;
+  }
+  return status;
+}
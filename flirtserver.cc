@@ -0,0 +1,343 @@
+/*  flirtserver.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // for struct ucred
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "flirtserver.h"
+
+using namespace std;
+
+const char serve_result_tag[] = "FLIRT_SERVE_RESULT";
+const char serve_status_tag[] = "FLIRT_SERVE_STATUS";
+
+// the longest job accepted (all the strings together)
+static const size_t max_job_length = 1<<20;
+
+
+static bool socket_address(const string& path, struct sockaddr_un& addr)
+{
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.length()>=sizeof(addr.sun_path)) {
+    cerr << "Socket name " << path << " is too long" << endl;
+    return false;
+  }
+  strncpy(addr.sun_path,path.c_str(),sizeof(addr.sun_path)-1);
+  return true;
+}
+
+
+int open_server_socket(const string& path)
+{
+  struct sockaddr_un addr;
+  if (!socket_address(path,addr)) return -1;
+  // a socket left behind by a server that was killed would stop the bind,
+  //  but anything else at that path is left alone
+  struct stat info;
+  if (lstat(path.c_str(),&info)==0) {
+    if (!S_ISSOCK(info.st_mode)) {
+      cerr << path << " exists and is not a socket" << endl;
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+  int fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd<0) {
+    cerr << "Could not create a socket: " << strerror(errno) << endl;
+    return -1;
+  }
+  // only the owner of the server may connect (peers are checked as well)
+  mode_t oldmask = umask(0077);
+  int bound = bind(fd,(struct sockaddr *) &addr,sizeof(addr));
+  umask(oldmask);
+  if ( (bound!=0) || (chmod(path.c_str(),S_IRUSR | S_IWUSR)!=0) ||
+       (listen(fd,64)!=0) ) {
+    cerr << "Could not listen on " << path << ": " << strerror(errno) << endl;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+int connect_server_socket(const string& path)
+{
+  struct sockaddr_un addr;
+  if (!socket_address(path,addr)) return -1;
+  int fd = socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd<0) {
+    cerr << "Could not create a socket: " << strerror(errno) << endl;
+    return -1;
+  }
+  if (connect(fd,(struct sockaddr *) &addr,sizeof(addr))!=0) {
+    cerr << "Could not connect to " << path << ": " << strerror(errno) << endl;
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+// each string is sent as its length and then its characters, after the
+//  number of strings (all lengths as 32 bit unsigned integers, since both
+//  ends are on the same machine)
+
+static int write_all(int fd, const char *data, size_t nbytes)
+{
+  size_t sent=0;
+  while (sent<nbytes) {
+    ssize_t nb = write(fd,data+sent,nbytes-sent);
+    if (nb<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    sent += nb;
+  }
+  return 0;
+}
+
+
+static int read_all(int fd, char *data, size_t nbytes)
+{
+  size_t got=0;
+  while (got<nbytes) {
+    ssize_t nb = read(fd,data+got,nbytes-got);
+    if (nb<0) {
+      if (errno==EINTR) continue;
+      return -1;
+    }
+    if (nb==0) return -1;   // closed before the whole job was sent
+    got += nb;
+  }
+  return 0;
+}
+
+
+int send_strings(int fd, const vector<string>& strs)
+{
+  string buf;
+  uint32_t count = strs.size();
+  buf.append((const char *) &count,sizeof(count));
+  for (unsigned int n=0; n<strs.size(); n++) {
+    uint32_t len = strs[n].length();
+    buf.append((const char *) &len,sizeof(len));
+    buf.append(strs[n]);
+  }
+  return write_all(fd,buf.data(),buf.size());
+}
+
+
+int read_strings(int fd, vector<string>& strs)
+{
+  strs.clear();
+  uint32_t count=0;
+  if (read_all(fd,(char *) &count,sizeof(count))!=0) return -1;
+  size_t total=0;
+  for (uint32_t n=0; n<count; n++) {
+    uint32_t len=0;
+    if (read_all(fd,(char *) &len,sizeof(len))!=0) return -1;
+    total += len + sizeof(len);
+    if (total>max_job_length) return -1;
+    string str(len,'\0');
+    if ((len>0) && (read_all(fd,&(str[0]),len)!=0)) return -1;
+    strs.push_back(str);
+  }
+  return 0;
+}
+
+
+// true if the process at the other end of conn has the same user as this one
+
+static bool same_user(int conn)
+{
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn,SOL_SOCKET,SO_PEERCRED,&cred,&len)!=0) return false;
+  return (cred.uid==geteuid());
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(conn,&uid,&gid)!=0) return false;
+  return (uid==geteuid());
+#endif
+}
+
+
+// the child for one connection: runs the job (in a child of its own, as
+//  the job may exit without returning) with its standard output and error
+//  going to the client, and then sends its exit status
+
+static void run_connection(int conn,
+			   int (*runjob)(const vector<string>& args))
+{
+  // _exit, as the static objects belong to the server
+  vector<string> job;
+  if ((read_strings(conn,job)!=0) || (job.size()<1)) _exit(1);
+  pid_t pid = fork();
+  if (pid==0) {
+    if ((dup2(conn,STDOUT_FILENO)<0) || (dup2(conn,STDERR_FILENO)<0)) _exit(1);
+    close(conn);
+    int retval = 1;
+    if (chdir(job[0].c_str())!=0) {
+      cerr << "Could not change to the directory " << job[0] << endl;
+    } else {
+      retval = runjob(vector<string>(job.begin()+1,job.end()));
+    }
+    cout.flush();
+    cerr.flush();
+    fflush(NULL);
+    _exit(retval);
+  }
+  int status = 1;
+  if (pid<0) {
+    string msg = string("Could not start the job: ") + strerror(errno) + "\n";
+    write_all(conn,msg.data(),msg.size());
+  } else {
+    int wstatus=0;
+    while (waitpid(pid,&wstatus,0)<0) {
+      if (errno!=EINTR) { wstatus = -1;  break; }
+    }
+    if ((wstatus!=-1) && WIFEXITED(wstatus)) status = WEXITSTATUS(wstatus);
+    else if ((wstatus!=-1) && WIFSIGNALED(wstatus)) status = 128 + WTERMSIG(wstatus);
+  }
+  // on a line of its own, whether or not the job ended its last line
+  char line[64];
+  snprintf(line,sizeof(line),"\n%s %d\n",serve_status_tag,status);
+  write_all(conn,line,strlen(line));
+  _exit(status);
+}
+
+
+// SIGINT and SIGTERM stop the server, through a pipe so that a signal
+//  arriving just before poll is not missed
+
+static int stop_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+  stop_requested = 1;
+  int saved = errno;
+  if (write(stop_pipe[1],"x",1)<0) { }
+  errno = saved;
+}
+
+
+int serve_jobs(int listenfd, int maxjobs,
+	       int (*runjob)(const vector<string>& args))
+{
+  // a client that goes away only ends its own job
+  signal(SIGPIPE,SIG_IGN);
+  if (pipe(stop_pipe)!=0) {
+    cerr << "Could not create a pipe: " << strerror(errno) << endl;
+    return -1;
+  }
+  for (int n=0; n<2; n++) {
+    fcntl(stop_pipe[n],F_SETFL,fcntl(stop_pipe[n],F_GETFL) | O_NONBLOCK);
+    fcntl(stop_pipe[n],F_SETFD,FD_CLOEXEC);
+  }
+  struct sigaction act, oldint, oldterm;
+  memset(&act,0,sizeof(act));
+  act.sa_handler = request_stop;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;   // not restarted, so a wait for a job is interrupted
+  sigaction(SIGINT,&act,&oldint);
+  sigaction(SIGTERM,&act,&oldterm);
+
+  if (maxjobs<1) maxjobs=1;
+  int running=0;
+  int retval=0;
+  while (!stop_requested) {
+    // reap finished jobs, and wait for one when the limit is reached (new
+    //  connections meanwhile wait in the listen queue)
+    while (running>0) {
+      pid_t done = waitpid(-1,NULL,(running>=maxjobs) ? 0 : WNOHANG);
+      if (done>0) { running--; continue; }
+      if ((done<0) && (errno==EINTR)) {
+	if (stop_requested) break;
+	continue;
+      }
+      if (done<0) running=0;   // no children left
+      break;
+    }
+    if (stop_requested) break;
+    struct pollfd fds[2];
+    fds[0].fd = listenfd;      fds[0].events = POLLIN;  fds[0].revents = 0;
+    fds[1].fd = stop_pipe[0];  fds[1].events = POLLIN;  fds[1].revents = 0;
+    int nready = poll(fds,2,-1);
+    if ((nready<0) && (errno!=EINTR)) {
+      cerr << "Could not wait for a connection: " << strerror(errno) << endl;
+      retval = -1;
+      break;
+    }
+    if ((nready<=0) || !(fds[0].revents & POLLIN)) continue;
+    int conn = accept(listenfd,NULL,NULL);
+    if (conn<0) {
+      if ((errno==EINTR) || (errno==ECONNABORTED)) continue;
+      cerr << "Could not accept a connection: " << strerror(errno) << endl;
+      retval = -1;
+      break;
+    }
+    if (!same_user(conn)) {
+      cerr << "Refused a connection from another user" << endl;
+      close(conn);
+      continue;
+    }
+    // anything buffered would otherwise be written by the child as well
+    cout.flush();
+    cerr.flush();
+    pid_t pid = fork();
+    if (pid==0) {
+      close(listenfd);
+      close(stop_pipe[0]);
+      close(stop_pipe[1]);
+      sigaction(SIGINT,&oldint,NULL);
+      sigaction(SIGTERM,&oldterm,NULL);
+      signal(SIGPIPE,SIG_DFL);
+      run_connection(conn,runjob);
+    }
+    if (pid<0) {
+      cerr << "Could not start a job: " << strerror(errno) << endl;
+    } else {
+      running++;
+    }
+    close(conn);
+  }
+
+  // let the running jobs finish, as they may be using the reference cache
+  while (running>0) {
+    pid_t done = waitpid(-1,NULL,0);
+    if (done>0) { running--; continue; }
+    if ((done<0) && (errno==EINTR)) continue;
+    break;
+  }
+  sigaction(SIGINT,&oldint,NULL);
+  sigaction(SIGTERM,&oldterm,NULL);
+  close(stop_pipe[0]);
+  close(stop_pipe[1]);
+  stop_pipe[0] = stop_pipe[1] = -1;
+  return retval;
+}
@@ -0,0 +1,49 @@
+/*  flirtserver.h
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#ifndef __FLIRTSERVER_
+#define __FLIRTSERVER_
+
+#include <string>
+#include <vector>
+
+// The local (UNIX domain) socket used by flirt -serve and flirt_client.
+//
+// A job is sent as a list of strings (the number of strings, then the
+//  length and characters of each): the first is the working directory of
+//  the client and the rest are the flirt options.  The socket can only be
+//  used by its owner, and the server refuses connections from other users.
+//  The server forks a child for each connection (running at most maxjobs
+//  at a time, with further connections waiting to be accepted), which runs
+//  the job in that directory with its standard output and error sent back
+//  over the connection, so the client sees everything a flirt run would
+//  print.  A successful registration ends with a line starting with the
+//  result tag, giving the final cost, followed by the four rows of the
+//  final matrix.  Every job then ends with a line of its own starting with
+//  the status tag and giving the exit status of the job (as flirt would
+//  return it, or 128 plus the signal that killed it), after which the
+//  connection is closed.
+
+extern const char serve_result_tag[];
+extern const char serve_status_tag[];
+
+// return a socket file descriptor, or -1 (with a message) on failure
+//  (an existing socket at path is replaced, but nothing else)
+int open_server_socket(const std::string& path);
+int connect_server_socket(const std::string& path);
+
+int send_strings(int fd, const std::vector<std::string>& strs);
+int read_strings(int fd, std::vector<std::string>& strs);
+
+// accepts connections until SIGINT or SIGTERM (or a failure of the socket),
+//  running runjob (on the options) in a child process for each, and then
+//  waits for the running jobs and returns 0 (or -1 if the socket failed)
+int serve_jobs(int listenfd, int maxjobs,
+	       int (*runjob)(const std::vector<std::string>& args));
+
+#endif
@@ -94,6 +94,10 @@ void globaloptions::parse_command_line(int argc,char** argv,
       interpblur = false;
       n++;
       continue;
+    } else if ( arg == "-fastresample") {
+      fastresample = true;
+      n++;
+      continue;
     } else if ( arg == "-usesqform") {
       initmatsqform = true;
       n++;
@@ -249,6 +253,26 @@ void globaloptions::parse_command_line(int argc,char** argv,
       bbr_slope = atof(argv[n+1]);
       n+=2;
       continue;
+    } else if ( arg == "-nthreads") {
+      nthreads = atoi(argv[n+1]);
+      if (nthreads<1) {
+	cerr << "Number of threads must be at least 1, not " << argv[n+1] << endl;
+	exit(-1);
+      }
+      n+=2;
+      continue;
+    } else if ( arg == "-costcache") {
+      costcachesize = atoi(argv[n+1]);
+      if (costcachesize<0) {
+	cerr << "Cost cache size must not be negative, not " << argv[n+1] << endl;
+	exit(-1);
+      }
+      n+=2;
+      continue;
+    } else if ( arg == "-refcache") {
+      refcachedir = argv[n+1];
+      n+=2;
+      continue;
     } else if ( arg == "-verbose") {
       verbose = atoi(argv[n+1]);
       n+=2;
@@ -397,7 +421,9 @@ void globaloptions::print_usage(int argc, char *argv[])
   cout << endl;
   cout << "Usage: " << argv[0] << " [options] -in <inputvol> -ref <refvol> -out <outputvol>\n"
        << "       " << argv[0] << " [options] -in <inputvol> -ref <refvol> -omat <outputmatrix>\n"
-       << "       " << argv[0] << " [options] -in <inputvol> -ref <refvol> -applyxfm -init <matrix> -out <outputvol>\n\n"
+       << "       " << argv[0] << " [options] -in <inputvol> -ref <refvol> -applyxfm -init <matrix> -out <outputvol>\n"
+       << "       " << argv[0] << " -serve <socket> [-refcache <directory>] [-maxjobs <n>] <refvol> [<refvol> ...]\n"
+       << "            (runs registrations sent by flirt_client, with these references kept loaded)\n\n"
        << "  Available options are:\n"
        << "        -in  <inputvol>                    (no default)\n"
        << "        -ref <refvol>                      (no default)\n"
@@ -431,6 +457,7 @@ void globaloptions::print_usage(int argc, char *argv[])
        << "        -coarsesearch <delta_angle>        (angle in degrees: default is 60)\n"
        << "        -finesearch <delta_angle>          (angle in degrees: default is 18)\n"
        << "        -schedule <schedule-file>          (replaces default schedule)\n"
+       << "                                           (\"setoption optimisationtype lbfgs\" in a schedule is experimental)\n"
        << "        -refweight <volume>                (use weights for reference volume)\n"
        << "        -inweight <volume>                 (use weights for input volume)\n"
        << "        -wmseg <volume>                    (white matter segmentation volume needed by BBR cost function)\n"
@@ -446,6 +473,10 @@ void globaloptions::print_usage(int argc, char *argv[])
        << "        -noclamp                           (do not use intensity clamping)\n"
        << "        -noresampblur                      (do not use blurring on downsampling)\n"
        << "        -2D                                (use 2D rigid body mode - ignores dof)\n"
+       << "        -nthreads <number>                 (number of threads used in the search and optimisation: default is 1)\n"
+       << "        -costcache <number>                (number of cost evaluations remembered for reuse: default is 0 = none)\n"
+       << "        -refcache <directory>              (directory for cached copies of the preprocessed reference volumes)\n"
+       << "        -fastresample                      (threaded resampling of the output - experimental)\n"
        << "        -verbose <num>                     (0 is least and default)\n"
        << "        -v                                 (same as -verbose 1)\n"
        << "        -i                                 (pauses at each stage: default is off)\n"
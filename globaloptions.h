@@ -52,6 +52,7 @@ class globaloptions {
   std::string wmnormsfname;
   std::string fmapfname;
   std::string fmapmaskfname;
+  std::string refcachedir;
   bool initmatsqform;
   bool printinit;
   NEWMAT::Matrix initmat;
@@ -82,6 +83,7 @@ class globaloptions {
   float fuzzyfrac;
   NEWMAT::ColumnVector tolerance;
   NEWMAT::ColumnVector boundguess;
+  float gradientstep;   // lbfgs finite difference step (in tolerances)
 
   NEWMAT::ColumnVector searchrx;
   NEWMAT::ColumnVector searchry;
@@ -114,8 +116,13 @@ class globaloptions {
   float echo_spacing;
   std::string bbr_type;
   float bbr_slope;
+  int bbrstep;
 
   int single_param;
+  int nthreads;
+  int gridtopk;
+  int costcachesize;
+  bool fastresample;
 
   void parse_command_line(int argc, char** argv, const std::string &);
 
@@ -170,6 +177,7 @@ inline globaloptions::globaloptions()
   wmnormsfname = "";
   fmapfname = "";
   fmapmaskfname = "";
+  refcachedir = "";
   initmat = NEWMAT::IdentityMatrix(4);
   initmatsqform = false;
   printinit = false;
@@ -205,6 +213,7 @@ inline globaloptions::globaloptions()
 	    << 0.002 << 0.002 << 0.001 << 0.001 << 0.001;
   boundguess.ReSize(2);
   boundguess << 10.0 << 1.0;
+  gradientstep = 1.0;
 
   searchrx.ReSize(2);
   searchry.ReSize(2);
@@ -240,8 +249,13 @@ inline globaloptions::globaloptions()
   echo_spacing = 5e-4;  // random guess (0.5ms) - units of seconds
   bbr_type = "signed";
   bbr_slope = -0.5;
+  bbrstep = 0;   // 0 = leave the cost function default
 
   single_param = -1;
+  nthreads = 1;
+  gridtopk = 0;  // 0 = keep all gridmeasurecost results
+  costcachesize = 0;  // 0 = no caching of cost evaluations
+  fastresample = false;
 }
 
 #endif
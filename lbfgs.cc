@@ -0,0 +1,191 @@
+/*  lbfgs.cc
+
+    Limited memory BFGS optimisation for FLIRT
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+#include "lbfgs.h"
+
+using namespace NEWMAT;
+
+// number of previous steps used to approximate the inverse Hessian
+static const unsigned int lbfgs_memory = 5;
+// maximum number of step halvings in the line search
+static const int max_backtracks = 12;
+// sufficient decrease (Armijo) constant
+static const double armijo_c = 1e-4;
+
+
+// All the work below is done in scaled coordinates, z = x / tolerance,
+//  so that the parameters (angles, translations, scales, skews) are
+//  commensurate and a change of less than 1 in every z is converged.
+
+class ScaledProblem {
+ public:
+  ScaledProblem(const ColumnVector& params, int nparams,
+		const ColumnVector& param_tol, BatchCostFunction costs)
+    : x0(params), n(nparams), tol(nparams), batchcost(costs)
+    {
+      for (int i=1; i<=n; i++) {
+	tol(i) = (fabs(param_tol(i))>0.0) ? fabs(param_tol(i)) : 1.0;
+      }
+    }
+
+  ColumnVector unscale(const ColumnVector& z) const
+    {
+      ColumnVector x(x0);
+      for (int i=1; i<=n; i++) x(i) = z(i)*tol(i);
+      return x;
+    }
+
+  ColumnVector scale(const ColumnVector& x) const
+    {
+      ColumnVector z(n);
+      for (int i=1; i<=n; i++) z(i) = x(i)/tol(i);
+      return z;
+    }
+
+  float cost(const ColumnVector& z) const
+    {
+      std::vector<ColumnVector> points(1,unscale(z));
+      std::vector<float> costs;
+      batchcost(points,costs);
+      return costs[0];
+    }
+
+  void gradient(const ColumnVector& z, double h, ColumnVector& grad) const
+    {
+      std::vector<ColumnVector> points;
+      for (int i=1; i<=n; i++) {
+	ColumnVector zp(z), zm(z);
+	zp(i) += h;
+	zm(i) -= h;
+	points.push_back(unscale(zp));
+	points.push_back(unscale(zm));
+      }
+      std::vector<float> costs;
+      batchcost(points,costs);
+      grad.ReSize(n);
+      for (int i=1; i<=n; i++) {
+	grad(i) = (costs[2*i-2] - costs[2*i-1])/(2.0*h);
+      }
+    }
+
+ private:
+  ColumnVector x0;
+  int n;
+  ColumnVector tol;
+  BatchCostFunction batchcost;
+};
+
+
+static double dot(const ColumnVector& a, const ColumnVector& b)
+{
+  return (a.t() * b).AsScalar();
+}
+
+
+static ColumnVector lbfgs_direction(const ColumnVector& grad,
+				    const std::deque<ColumnVector>& svec,
+				    const std::deque<ColumnVector>& yvec)
+{
+  // standard two-loop recursion for -H*grad
+  int m = svec.size();
+  std::vector<double> alpha(m), rho(m);
+  ColumnVector q(grad);
+  for (int k=m-1; k>=0; k--) {
+    rho[k] = 1.0/dot(yvec[k],svec[k]);
+    alpha[k] = rho[k]*dot(svec[k],q);
+    q -= alpha[k]*yvec[k];
+  }
+  double gamma = dot(svec[m-1],yvec[m-1])/dot(yvec[m-1],yvec[m-1]);
+  ColumnVector r = gamma*q;
+  for (int k=0; k<m; k++) {
+    double beta = rho[k]*dot(yvec[k],r);
+    r += svec[k]*(alpha[k]-beta);
+  }
+  return -r;
+}
+
+
+float lbfgs_optimise(ColumnVector& params, int no_params,
+		     const ColumnVector& param_tol,
+		     BatchCostFunction batchcost, int& no_its, int itmax,
+		     double firststep, double fdstep, int batchsize)
+{
+  ScaledProblem problem(params,no_params,param_tol,batchcost);
+  if (firststep<1.0) firststep=1.0;
+  if (fdstep<=0.0) fdstep=1.0;
+  if (batchsize<1) batchsize=1;
+  int maxits = itmax*no_params;
+
+  ColumnVector z = problem.scale(params);
+  float fz = problem.cost(z);
+  ColumnVector grad;
+  problem.gradient(z,fdstep,grad);
+  std::deque<ColumnVector> svec, yvec;
+
+  no_its=0;
+  while (no_its<maxits) {
+    if (grad.MaximumAbsoluteValue()<=0.0) break;
+    // without any history take a steepest descent step of size firststep
+    ColumnVector dir;
+    if (svec.size()>0) dir = lbfgs_direction(grad,svec,yvec);
+    double slope = (svec.size()>0) ? dot(grad,dir) : 0.0;
+    if ((svec.size()==0) || (slope>=0.0)) {
+      svec.clear();  yvec.clear();
+      dir = -grad * (firststep/grad.MaximumAbsoluteValue());
+      slope = dot(grad,dir);
+    }
+
+    // backtracking line search, trying batchsize step lengths (1, 1/2, 1/4,
+    //  ...) at a time and taking the longest that decreases the cost enough
+    ColumnVector znew;
+    float fnew=fz;
+    bool accepted=false;
+    for (int k0=0; (k0<max_backtracks) && !accepted; k0+=batchsize) {
+      int kend = std::min(k0+batchsize,max_backtracks);
+      std::vector<ColumnVector> points;
+      for (int k=k0; k<kend; k++) {
+	points.push_back(problem.unscale(z + ldexp(1.0,-k)*dir));
+      }
+      std::vector<float> costs;
+      batchcost(points,costs);
+      for (int k=k0; k<kend; k++) {
+	if (costs[k-k0] <= fz + armijo_c*ldexp(1.0,-k)*slope) {
+	  znew = z + ldexp(1.0,-k)*dir;
+	  fnew = costs[k-k0];
+	  accepted=true;
+	  break;
+	}
+      }
+    }
+    no_its++;
+    if (!accepted) break;   // no further decrease along a descent direction
+
+    ColumnVector gnew;
+    problem.gradient(znew,fdstep,gnew);
+    ColumnVector s = znew - z, y = gnew - grad;
+    if (dot(s,y)>1e-10) {
+      svec.push_back(s);
+      yvec.push_back(y);
+      if (svec.size()>lbfgs_memory) { svec.pop_front(); yvec.pop_front(); }
+    }
+    z = znew;
+    fz = fnew;
+    grad = gnew;
+    // converged when no parameter moved by more than its tolerance
+    if (s.MaximumAbsoluteValue()<1.0) break;
+  }
+
+  params = problem.unscale(z);
+  return fz;
+}
@@ -0,0 +1,40 @@
+/*  lbfgs.h
+
+    Limited memory BFGS optimisation for FLIRT
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// Minimises a cost function of the first no_params entries of params using
+//  L-BFGS with a backtracking line search.  Gradients are found by central
+//  finite differences, with all 2*no_params perturbed points handed to the
+//  batch cost function together so that they can be evaluated concurrently,
+//  and the line search hands over batchsize trial steps at a time.
+//
+// The arguments mirror MISCMATHS::optimise: param_tol gives the tolerance
+//  (and natural scale) of each parameter, at most itmax*no_params
+//  iterations are made, no_its returns the number of iterations used and
+//  the return value is the final cost.  All steps are measured in
+//  tolerances: firststep is the size of a steepest descent step (the
+//  largest change of any parameter) and fdstep the finite difference step.
+
+#if !defined(__lbfgs_h)
+#define __lbfgs_h
+
+#include <functional>
+#include <vector>
+
+#include "armawrap/newmat.h"
+
+typedef std::function<void (const std::vector<NEWMAT::ColumnVector>& points,
+			    std::vector<float>& costs)> BatchCostFunction;
+
+float lbfgs_optimise(NEWMAT::ColumnVector& params, int no_params,
+		     const NEWMAT::ColumnVector& param_tol,
+		     BatchCostFunction batchcost, int& no_its, int itmax,
+		     double firststep, double fdstep, int batchsize);
+
+#endif
@@ -0,0 +1,142 @@
+/*  matseries.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <unistd.h>
+
+#include "miscmaths/miscmaths.h"
+#include "matseries.h"
+
+using namespace std;
+using namespace NEWMAT;
+using namespace MISCMATHS;
+
+static const char matseriesmagic[8] = { 'F','S','L','M','A','T','S','1' };
+
+
+Matrix MatrixSeries::matrix(int index) const
+{
+  std::map<int,Matrix>::const_iterator it = mats.find(index);
+  if (it==mats.end()) return Matrix();
+  return it->second;
+}
+
+
+std::vector<int> MatrixSeries::indices() const
+{
+  std::vector<int> idx;
+  for (std::map<int,Matrix>::const_iterator it=mats.begin(); it!=mats.end(); ++it) {
+    idx.push_back(it->first);
+  }
+  return idx;
+}
+
+
+int MatrixSeries::read(const string& filename)
+{
+  clear();
+  ifstream matfile(filename.c_str(),ios::in | ios::binary);
+  if (!matfile) return -1;
+  char magic[8];
+  int nmats=0;
+  matfile.read(magic,8);
+  matfile.read((char *) &nmats,sizeof(nmats));
+  if (!matfile || (memcmp(magic,matseriesmagic,8)!=0) || (nmats<0)) return -1;
+  for (int n=0; n<nmats; n++) {
+    int index;
+    double vals[16];
+    matfile.read((char *) &index,sizeof(index));
+    matfile.read((char *) vals,sizeof(vals));
+    if (!matfile) { clear(); return -1; }
+    Matrix mat(4,4);
+    for (int r=1; r<=4; r++) {
+      for (int c=1; c<=4; c++) { mat(r,c) = vals[(r-1)*4+c-1]; }
+    }
+    add(index,mat);
+  }
+  return 0;
+}
+
+
+int MatrixSeries::write(const string& filename) const
+{
+  ofstream matfile(filename.c_str(),ios::out | ios::binary);
+  if (!matfile) return -1;
+  int nmats = size();
+  matfile.write(matseriesmagic,8);
+  matfile.write((const char *) &nmats,sizeof(nmats));
+  for (std::map<int,Matrix>::const_iterator it=mats.begin(); it!=mats.end(); ++it) {
+    if ((it->second.Nrows()!=4) || (it->second.Ncols()!=4)) return -1;
+    int index = it->first;
+    double vals[16];
+    for (int r=1; r<=4; r++) {
+      for (int c=1; c<=4; c++) { vals[(r-1)*4+c-1] = it->second(r,c); }
+    }
+    matfile.write((const char *) &index,sizeof(index));
+    matfile.write((const char *) vals,sizeof(vals));
+  }
+  matfile.close();
+  return (matfile ? 0 : -1);
+}
+
+
+int MatrixSeries::read_directory(const string& dirname, const string& prefix)
+{
+  clear();
+  for (int n=0; ; n++) {
+    ostringstream matname;
+    matname << dirname << "/" << prefix << setw(4) << setfill('0') << n;
+    if (access(matname.str().c_str(),R_OK)!=0) break;
+    Matrix mat = read_ascii_matrix(matname.str());
+    if ((mat.Nrows()!=4) || (mat.Ncols()!=4)) {
+      cerr << "Could not read matrix " << matname.str() << endl;
+      return -1;
+    }
+    add(n,mat);
+  }
+  return ((size()>0) ? 0 : -1);
+}
+
+
+bool is_matrix_series(const string& filename)
+{
+  ifstream matfile(filename.c_str(),ios::in | ios::binary);
+  if (!matfile) return false;
+  char magic[8];
+  matfile.read(magic,8);
+  return (matfile && (memcmp(magic,matseriesmagic,8)==0));
+}
+
+
+Matrix read_matrix_or_series_entry(const string& name)
+{
+  MatrixSeries series;
+  if (is_matrix_series(name)) {
+    if ((series.read(name)!=0) || (series.size()!=1)) return Matrix();
+    return series.matrix(series.indices()[0]);
+  }
+  // <series-file>:<index>
+  string::size_type colon = name.rfind(':');
+  if ((colon!=string::npos) && (colon+1<name.size())) {
+    string seriesname = name.substr(0,colon);
+    string indexstr = name.substr(colon+1);
+    char *end=0;
+    long index = strtol(indexstr.c_str(),&end,10);
+    if ((*end=='\0') && is_matrix_series(seriesname)) {
+      if (series.read(seriesname)!=0) return Matrix();
+      return series.matrix((int) index);
+    }
+  }
+  return read_ascii_matrix(name);
+}
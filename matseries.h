@@ -0,0 +1,57 @@
+/*  matseries.h
+
+    A single file holding a series of 4x4 transformation matrices
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// The packed matrix series file replaces a directory of MAT_NNNN ascii
+//  files: an 8 byte identifier ("FSLMATS1"), the number of entries (as a
+//  32 bit integer) and then, for each entry, its (volume) index as a 32 bit
+//  integer followed by the 16 matrix elements, row by row, as doubles.
+//  All values are in the native byte order.  Entries are kept in index
+//  order, and there is no limit on the number of them.
+//
+// Wherever a single matrix is expected, "<series-file>:<index>" selects
+//  one entry of a series (and a series of one entry may be given alone).
+
+#if !defined(__matseries_h)
+#define __matseries_h
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "armawrap/newmat.h"
+
+class MatrixSeries {
+ public:
+  int size() const { return mats.size(); }
+  void clear() { mats.clear(); }
+  void add(int index, const NEWMAT::Matrix& mat) { mats[index] = mat; }
+  bool has(int index) const { return (mats.find(index)!=mats.end()); }
+  // an empty matrix if there is no entry with this index
+  NEWMAT::Matrix matrix(int index) const;
+  // all the indices, in order
+  std::vector<int> indices() const;
+
+  int read(const std::string& filename);
+  int write(const std::string& filename) const;
+  // reads <dirname>/<prefix>NNNN (ascii) for NNNN = 0000, 0001, ...
+  //  up to the first that does not exist
+  int read_directory(const std::string& dirname, const std::string& prefix="MAT_");
+
+ private:
+  std::map<int,NEWMAT::Matrix> mats;
+};
+
+bool is_matrix_series(const std::string& filename);
+
+// reads a single matrix: an ascii matrix file, "<series-file>:<index>"
+//  or a series file with only one entry (an empty matrix on failure)
+NEWMAT::Matrix read_matrix_or_series_entry(const std::string& name);
+
+#endif
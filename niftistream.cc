@@ -0,0 +1,222 @@
+/*  niftistream.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+#include "niftistream.h"
+
+using namespace std;
+
+
+static bool ends_with(const string& name, const string& ext)
+{
+  return (name.size()>=ext.size()) &&
+    (name.compare(name.size()-ext.size(),ext.size(),ext)==0);
+}
+
+
+string nifti_stream_filename(const string& basename, bool forwriting)
+{
+  if (ends_with(basename,".nii.gz") || ends_with(basename,".nii")) return basename;
+  if (ends_with(basename,".hdr") || ends_with(basename,".img") ||
+      ends_with(basename,".hdr.gz") || ends_with(basename,".img.gz")) return "";
+  if (forwriting) {
+    // as set by FSLOUTPUTTYPE (NIFTI_GZ if not set)
+    const char* outtype = getenv("FSLOUTPUTTYPE");
+    string type = ((outtype==0) ? "NIFTI_GZ" : outtype);
+    if (type=="NIFTI_GZ") return basename + ".nii.gz";
+    if (type=="NIFTI") return basename + ".nii";
+    return "";
+  }
+  if (access((basename + ".nii.gz").c_str(),R_OK)==0) return basename + ".nii.gz";
+  if (access((basename + ".nii").c_str(),R_OK)==0) return basename + ".nii";
+  return "";
+}
+
+
+int nifti_bytes_per_voxel(short datatype)
+{
+  switch (datatype) {
+  case DT_UNSIGNED_CHAR: case DT_INT8: return 1;
+  case DT_SIGNED_SHORT: case DT_UINT16: return 2;
+  case DT_SIGNED_INT: case DT_UINT32: case DT_FLOAT: return 4;
+  case DT_DOUBLE: return 8;
+  }
+  return 0;
+}
+
+
+long nifti_voxels_per_volume(const nifti_1_header& hdr)
+{
+  long nvox = 1;
+  for (int d=1; d<=3; d++) {
+    if ((hdr.dim[0]>=d) && (hdr.dim[d]>1)) nvox *= hdr.dim[d];
+  }
+  return nvox;
+}
+
+
+bool nifti_neurological(const nifti_1_header& hdr)
+{
+  // the same rule as the FSL left-right order: the sign of the determinant
+  //  of the sform if set, or else the qform (radiological if neither is set)
+  if (hdr.sform_code>0) {
+    double det = hdr.srow_x[0]*(hdr.srow_y[1]*hdr.srow_z[2] - hdr.srow_y[2]*hdr.srow_z[1])
+      - hdr.srow_x[1]*(hdr.srow_y[0]*hdr.srow_z[2] - hdr.srow_y[2]*hdr.srow_z[0])
+      + hdr.srow_x[2]*(hdr.srow_y[0]*hdr.srow_z[1] - hdr.srow_y[1]*hdr.srow_z[0]);
+    return (det>0.0);
+  }
+  if (hdr.qform_code>0) {
+    // the rotation has unit determinant, so only qfac matters
+    return (hdr.pixdim[0]>=0.0);
+  }
+  return false;
+}
+
+
+static bool valid_header(const nifti_1_header& hdr)
+{
+  if (hdr.sizeof_hdr!=348) return false;   // also rejects swapped bytes
+  if (std::strncmp(hdr.magic,"n+1",4)!=0) return false;
+  if ((hdr.dim[0]<1) || (hdr.dim[0]>7)) return false;
+  for (int d=1; d<=hdr.dim[0]; d++) { if (hdr.dim[d]<1) return false; }
+  // only the first four dimensions may be used
+  for (int d=5; d<=hdr.dim[0]; d++) { if (hdr.dim[d]>1) return false; }
+  return (nifti_bytes_per_voxel(hdr.datatype)>0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+NiftiStreamReader::NiftiStreamReader()
+  : fp(NULL), nextvol(0)
+{
+  std::memset(&hdr,0,sizeof(hdr));
+}
+
+
+NiftiStreamReader::~NiftiStreamReader()
+{
+  close();
+}
+
+
+void NiftiStreamReader::close()
+{
+  if (!znz_isnull(fp)) znzclose(fp);
+  fp = NULL;
+}
+
+
+int NiftiStreamReader::nvolumes() const
+{
+  return ((hdr.dim[0]>=4) && (hdr.dim[4]>1)) ? hdr.dim[4] : 1;
+}
+
+
+bool NiftiStreamReader::neurological() const
+{
+  return nifti_neurological(hdr);
+}
+
+
+int NiftiStreamReader::open(const string& filename)
+{
+  close();
+  string fullname = nifti_stream_filename(filename,false);
+  if (fullname.length()<1) return -1;
+  fp = znzopen(fullname.c_str(),"rb",ends_with(fullname,".gz") ? 1 : 0);
+  if (znz_isnull(fp)) return -1;
+  if ( (znzread(&hdr,sizeof(hdr),1,fp)!=1) || !valid_header(hdr) ) {
+    close();
+    return -1;
+  }
+  // skip to the start of the data (past any extensions)
+  long offset = (long) hdr.vox_offset;
+  long skip = offset - (long) sizeof(hdr);
+  if (skip<0) { close(); return -1; }
+  std::vector<char> extbuffer(skip);
+  if ((skip>0) && (znzread(&(extbuffer[0]),1,skip,fp)!=(size_t) skip)) {
+    close();
+    return -1;
+  }
+  nextvol = 0;
+  return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+NiftiStreamWriter::NiftiStreamWriter()
+  : fp(NULL), nwritten(0)
+{
+  std::memset(&hdr,0,sizeof(hdr));
+}
+
+
+NiftiStreamWriter::~NiftiStreamWriter()
+{
+  close();
+}
+
+
+int NiftiStreamWriter::open(const string& filename, const nifti_1_header& basehdr,
+			    int nvols, short datatype)
+{
+  close();
+  fullname = nifti_stream_filename(filename,true);
+  if ((fullname.length()<1) || (nifti_bytes_per_voxel(datatype)<1)) return -1;
+  hdr = basehdr;
+  hdr.dim[0] = 4;
+  for (int d=1; d<=3; d++) { if (basehdr.dim[0]<d) hdr.dim[d] = 1; }
+  hdr.dim[4] = nvols;
+  for (int d=5; d<=7; d++) { hdr.dim[d] = 1; }
+  hdr.datatype = datatype;
+  hdr.bitpix = 8*nifti_bytes_per_voxel(datatype);
+  hdr.vox_offset = 352;
+  hdr.scl_slope = 1.0;
+  hdr.scl_inter = 0.0;
+  hdr.cal_max = 0.0;
+  hdr.cal_min = 0.0;
+  std::memcpy(hdr.magic,"n+1",4);
+  fp = znzopen(fullname.c_str(),"wb",ends_with(fullname,".gz") ? 1 : 0);
+  if (znz_isnull(fp)) return -1;
+  char extender[4] = { 0, 0, 0, 0 };
+  if ( (znzwrite(&hdr,sizeof(hdr),1,fp)!=1) ||
+       (znzwrite(extender,1,4,fp)!=4) ) {
+    discard();
+    return -1;
+  }
+  nwritten = 0;
+  return 0;
+}
+
+
+int NiftiStreamWriter::close()
+{
+  if (znz_isnull(fp)) return 0;
+  int retval = ((nwritten==hdr.dim[4]) ? 0 : -1);
+  if (znzclose(fp)!=0) retval = -1;
+  fp = NULL;
+  return retval;
+}
+
+
+void NiftiStreamWriter::discard()
+{
+  if (!znz_isnull(fp)) {
+    znzclose(fp);
+    fp = NULL;
+  }
+  if (fullname.length()>0) std::remove(fullname.c_str());
+  fullname = "";
+}
@@ -0,0 +1,208 @@
+/*  niftistream.h
+
+    Reading and writing NIfTI-1 timeseries one volume at a time
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// Only single file (.nii or .nii.gz) images in the native byte order are
+//  handled; open() fails for anything else, so that callers can fall back
+//  to reading the whole image with newimage.
+//
+// newimage holds volumes in radiological voxel order, so (as read_volume
+//  and save_volume do) volumes from neurological files are flipped in x as
+//  they are read, and flipped back as they are written.
+
+#if !defined(__niftistream_h)
+#define __niftistream_h
+
+#include <string>
+#include <vector>
+
+#include "NewNifti/nifti1.h"
+#include "znzlib/znzlib.h"
+
+class NiftiStreamReader {
+ public:
+  NiftiStreamReader();
+  ~NiftiStreamReader();
+
+  int open(const std::string& filename);
+  void close();
+
+  const nifti_1_header& header() const { return hdr; }
+  int xsize() const { return hdr.dim[1]; }
+  int ysize() const { return hdr.dim[2]; }
+  int zsize() const { return hdr.dim[3]; }
+  int nvolumes() const;
+  bool neurological() const;
+
+  // reads the next volume, converted to T (with any intensity scaling)
+  template <class T>
+  int read_next(T* data);
+
+ private:
+  znzFile fp;
+  nifti_1_header hdr;
+  std::vector<char> rawbuffer;
+  int nextvol;
+
+  NiftiStreamReader(const NiftiStreamReader&);
+  const NiftiStreamReader& operator=(const NiftiStreamReader&);
+};
+
+
+class NiftiStreamWriter {
+ public:
+  NiftiStreamWriter();
+  ~NiftiStreamWriter();
+
+  // hdr gives everything but the number of volumes (and the data layout)
+  int open(const std::string& filename, const nifti_1_header& hdr,
+	   int nvols, short datatype);
+  int close();
+  // closes (if still open) and removes the file, e.g. after an error
+  void discard();
+
+  template <class T>
+  int write_next(const T* data);
+
+ private:
+  znzFile fp;
+  std::string fullname;
+  nifti_1_header hdr;
+  std::vector<char> rawbuffer;
+  int nwritten;
+
+  NiftiStreamWriter(const NiftiStreamWriter&);
+  const NiftiStreamWriter& operator=(const NiftiStreamWriter&);
+};
+
+
+// the filename that newimage would use for reading (or writing) basename
+std::string nifti_stream_filename(const std::string& basename, bool forwriting);
+
+// the NIfTI datatype that newimage saves a volume<T> as
+inline short nifti_datatype(const unsigned char*) { return DT_UNSIGNED_CHAR; }
+inline short nifti_datatype(const char*) { return DT_UNSIGNED_CHAR; }
+inline short nifti_datatype(const short*) { return DT_SIGNED_SHORT; }
+inline short nifti_datatype(const int*) { return DT_SIGNED_INT; }
+inline short nifti_datatype(const float*) { return DT_FLOAT; }
+inline short nifti_datatype(const double*) { return DT_DOUBLE; }
+
+bool nifti_neurological(const nifti_1_header& hdr);
+long nifti_voxels_per_volume(const nifti_1_header& hdr);
+int nifti_bytes_per_voxel(short datatype);
+
+
+//////////////////////////////////////////////////////////////////////////
+
+// TEMPLATE IMPLEMENTATIONS
+
+template <class S, class T>
+void nifti_convert(const char* raw, long nvox, T* data, bool scale,
+		   float slope, float inter)
+{
+  const S* src = (const S*) raw;
+  if (scale) {
+    for (long n=0; n<nvox; n++) data[n] = (T) (src[n]*slope + inter);
+  } else {
+    for (long n=0; n<nvox; n++) data[n] = (T) src[n];
+  }
+}
+
+
+template <class T>
+void nifti_flip_x(T* data, int nx, long nrows)
+{
+  for (long r=0; r<nrows; r++) {
+    T* row = data + r*nx;
+    for (int x=0; x<nx/2; x++) {
+      T tmp = row[x];  row[x] = row[nx-1-x];  row[nx-1-x] = tmp;
+    }
+  }
+}
+
+
+template <class T>
+int NiftiStreamReader::read_next(T* data)
+{
+  if (znz_isnull(fp) || (nextvol>=nvolumes())) return -1;
+  long nvox = nifti_voxels_per_volume(hdr);
+  size_t nbytes = (size_t) nvox * nifti_bytes_per_voxel(hdr.datatype);
+  rawbuffer.resize(nbytes);
+  if (znzread(&(rawbuffer[0]),1,nbytes,fp)!=nbytes) return -1;
+  bool scale = (hdr.scl_slope!=0.0) && ((hdr.scl_slope!=1.0) || (hdr.scl_inter!=0.0));
+  const char* raw = &(rawbuffer[0]);
+  switch (hdr.datatype) {
+  case DT_UNSIGNED_CHAR:
+    nifti_convert<unsigned char>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_INT8:
+    nifti_convert<signed char>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_SIGNED_SHORT:
+    nifti_convert<short>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_UINT16:
+    nifti_convert<unsigned short>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_SIGNED_INT:
+    nifti_convert<int>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_UINT32:
+    nifti_convert<unsigned int>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_FLOAT:
+    nifti_convert<float>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  case DT_DOUBLE:
+    nifti_convert<double>(raw,nvox,data,scale,hdr.scl_slope,hdr.scl_inter); break;
+  default:
+    return -1;
+  }
+  if (neurological()) nifti_flip_x(data,xsize(),nvox/xsize());
+  nextvol++;
+  return 0;
+}
+
+
+template <class T>
+int NiftiStreamWriter::write_next(const T* data)
+{
+  if (znz_isnull(fp) || (nwritten>=hdr.dim[4])) return -1;
+  long nvox = nifti_voxels_per_volume(hdr);
+  size_t nbytes = (size_t) nvox * nifti_bytes_per_voxel(hdr.datatype);
+  rawbuffer.resize(nbytes);
+  char* raw = &(rawbuffer[0]);
+  switch (hdr.datatype) {
+  case DT_UNSIGNED_CHAR:
+    nifti_convert<T>((const char*) data,nvox,(unsigned char*) raw,false,1,0); break;
+  case DT_INT8:
+    nifti_convert<T>((const char*) data,nvox,(signed char*) raw,false,1,0); break;
+  case DT_SIGNED_SHORT:
+    nifti_convert<T>((const char*) data,nvox,(short*) raw,false,1,0); break;
+  case DT_UINT16:
+    nifti_convert<T>((const char*) data,nvox,(unsigned short*) raw,false,1,0); break;
+  case DT_SIGNED_INT:
+    nifti_convert<T>((const char*) data,nvox,(int*) raw,false,1,0); break;
+  case DT_UINT32:
+    nifti_convert<T>((const char*) data,nvox,(unsigned int*) raw,false,1,0); break;
+  case DT_FLOAT:
+    nifti_convert<T>((const char*) data,nvox,(float*) raw,false,1,0); break;
+  case DT_DOUBLE:
+    nifti_convert<T>((const char*) data,nvox,(double*) raw,false,1,0); break;
+  default:
+    return -1;
+  }
+  if (nifti_neurological(hdr)) {
+    int nx = hdr.dim[1];
+    switch (nifti_bytes_per_voxel(hdr.datatype)) {
+    case 1: nifti_flip_x((unsigned char*) raw,nx,nvox/nx); break;
+    case 2: nifti_flip_x((unsigned short*) raw,nx,nvox/nx); break;
+    case 4: nifti_flip_x((unsigned int*) raw,nx,nvox/nx); break;
+    case 8: nifti_flip_x((unsigned long long*) raw,nx,nvox/nx); break;
+    }
+  }
+  if (znzwrite(raw,1,nbytes,fp)!=nbytes) return -1;
+  nwritten++;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*  parallelfor.h
+
+    Simple multi-threaded loop support for the FLIRT tools
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+// Runs func(idx,thread) for idx = 0 to n-1 over a pool of worker threads
+//  - iterations are handed out one at a time, so the work of any single
+//    index must not depend on which thread (or in what order) it is run
+//  - thread is the number (0 to nthreads-1) of the worker doing the call,
+//    so that callers can keep per-thread state (e.g. a private Costfn)
+//  - with nthreads<=1 everything is run in order in the calling thread
+
+#if !defined(__parallelfor_h)
+#define __parallelfor_h
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+template <class F>
+void parallel_for(int n, int nthreads, F func)
+{
+  if (nthreads>n) nthreads=n;
+  if (nthreads<=1) {
+    for (int idx=0; idx<n; idx++) { func(idx,0); }
+    return;
+  }
+  std::atomic<int> next(0);
+  std::exception_ptr firsterr;
+  std::mutex errmutex;
+  std::vector<std::thread> pool;
+  for (int t=0; t<nthreads; t++) {
+    pool.push_back(std::thread([&,t]() {
+      try {
+	int idx;
+	while ((idx=next++)<n) { func(idx,t); }
+      } catch (...) {
+	std::lock_guard<std::mutex> lock(errmutex);
+	if (!firsterr) firsterr = std::current_exception();
+	next = n;  // stop handing out any more work
+      }
+    }));
+  }
+  for (unsigned int t=0; t<pool.size(); t++) { pool[t].join(); }
+  if (firsterr) std::rethrow_exception(firsterr);
+}
+
+#endif
@@ -0,0 +1,265 @@
+/*  refcache.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <iomanip>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "NewNifti/NewNifti.h"
+#include "refcache.h"
+
+using namespace NEWMAT;
+using namespace NEWIMAGE;
+
+// the layout of the file: a header, one descriptor per volume and then the
+//  voxel data of each volume, starting on a 64 byte boundary
+//  (the version must be changed whenever the layout or the processing
+//   that produces the stored volumes changes)
+
+static const char refcachemagic[8] = { 'F','L','R','T','R','P','Y','R' };
+static const unsigned int refcacheversion = 1;
+static const size_t refcachealign = 64;
+
+struct RefCacheHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int nvols;
+  refcachekey key;
+  unsigned long long filesize;
+};
+
+struct RefCacheVolume {
+  int nx, ny, nz;
+  int sformcode, qformcode;
+  float xdim, ydim, zdim;
+  double sform[16], qform[16];
+  unsigned long long offset;
+};
+
+
+// a simple 64 bit hash, mixing in one 8 byte word at a time
+
+static refcachekey mix(refcachekey h, unsigned long long word)
+{
+  h ^= word + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+
+static refcachekey hash_bytes(const void *data, size_t nbytes, refcachekey h)
+{
+  const unsigned char *ptr = (const unsigned char *) data;
+  size_t nwords = nbytes/8;
+  for (size_t n=0; n<nwords; n++) {
+    unsigned long long word;
+    std::memcpy(&word,ptr+8*n,8);
+    h = mix(h,word);
+  }
+  unsigned long long last = 0;
+  std::memcpy(&last,ptr+8*nwords,nbytes-8*nwords);
+  return mix(h,last ^ ((unsigned long long) nbytes << 56));
+}
+
+
+refcachekey hash_value(double val, refcachekey seed)
+{
+  return hash_bytes(&val,sizeof(val),seed);
+}
+
+
+static refcachekey hash_matrix(const Matrix& mat, refcachekey h)
+{
+  for (int r=1; r<=mat.Nrows(); r++) {
+    for (int c=1; c<=mat.Ncols(); c++) { h = hash_value(mat(r,c),h); }
+  }
+  return h;
+}
+
+
+refcachekey hash_volume(const volume<float>& vol, refcachekey seed)
+{
+  refcachekey h = seed;
+  h = hash_value(vol.xsize(),h);
+  h = hash_value(vol.ysize(),h);
+  h = hash_value(vol.zsize(),h);
+  h = hash_value(vol.xdim(),h);
+  h = hash_value(vol.ydim(),h);
+  h = hash_value(vol.zdim(),h);
+  h = hash_value(vol.sform_code(),h);
+  h = hash_value(vol.qform_code(),h);
+  h = hash_matrix(vol.sform_mat(),h);
+  h = hash_matrix(vol.qform_mat(),h);
+  if (vol.nvoxels()>0) {
+    h = hash_bytes(vol.fbegin(),(size_t) vol.nvoxels()*sizeof(float),h);
+  }
+  return h;
+}
+
+
+static void store_matrix(const Matrix& mat, double *vals)
+{
+  for (int r=1; r<=4; r++) {
+    for (int c=1; c<=4; c++) { vals[(r-1)*4+c-1] = mat(r,c); }
+  }
+}
+
+
+static Matrix stored_matrix(const double *vals)
+{
+  Matrix mat(4,4);
+  for (int r=1; r<=4; r++) {
+    for (int c=1; c<=4; c++) { mat(r,c) = vals[(r-1)*4+c-1]; }
+  }
+  return mat;
+}
+
+
+static size_t aligned(size_t pos)
+{
+  return ((pos + refcachealign - 1)/refcachealign)*refcachealign;
+}
+
+
+RefPyramidCache::RefPyramidCache()
+  : dirname(""), key(0), mapaddr(0), maplength(0)
+{
+}
+
+
+RefPyramidCache::~RefPyramidCache()
+{
+  if (mapaddr) munmap(mapaddr,maplength);
+}
+
+
+std::string RefPyramidCache::filename() const
+{
+  std::ostringstream name;
+  name << dirname << "/flirt_ref_" << std::hex << std::setw(16)
+       << std::setfill('0') << key << ".cache";
+  return name.str();
+}
+
+
+bool RefPyramidCache::load(const std::vector<volume<float>*>& vols,
+			   const std::vector<const volume<float>*>& protos)
+{
+  if (!enabled() || mapaddr) return false;
+  int fd = open(filename().c_str(),O_RDONLY);
+  if (fd<0) return false;
+  struct stat info;
+  if ((fstat(fd,&info)!=0) || (info.st_size<(off_t) sizeof(RefCacheHeader))) {
+    close(fd);
+    return false;
+  }
+  size_t length = info.st_size;
+  // private, so that any writes to the volumes stay in this process
+  void *addr = mmap(0,length,PROT_READ | PROT_WRITE,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (addr==MAP_FAILED) return false;
+
+  // check that the file is complete and is for this key and set of volumes
+  const char *base = (const char *) addr;
+  RefCacheHeader header;
+  std::memcpy(&header,base,sizeof(header));
+  bool valid = ( (std::memcmp(header.magic,refcachemagic,8)==0) &&
+		 (header.version==refcacheversion) && (header.key==key) &&
+		 (header.filesize==length) && (header.nvols==vols.size()) &&
+		 (protos.size()==vols.size()) &&
+		 (sizeof(header) + vols.size()*sizeof(RefCacheVolume) <= length) );
+  std::vector<RefCacheVolume> desc(valid ? vols.size() : 0);
+  for (unsigned int n=0; n<desc.size(); n++) {
+    std::memcpy(&(desc[n]),base + sizeof(header) + n*sizeof(RefCacheVolume),
+		sizeof(RefCacheVolume));
+    size_t nbytes = (size_t) desc[n].nx*desc[n].ny*desc[n].nz*sizeof(float);
+    if ( (desc[n].nx<1) || (desc[n].ny<1) || (desc[n].nz<1) ||
+	 (desc[n].offset % refcachealign != 0) ||
+	 (desc[n].offset + nbytes > length) ) valid=false;
+  }
+  if (!valid) {
+    munmap(addr,length);
+    return false;
+  }
+
+  for (unsigned int n=0; n<vols.size(); n++) {
+    float *data = (float *) (base + desc[n].offset);
+    vols[n]->reinitialize(desc[n].nx,desc[n].ny,desc[n].nz,data,false);
+    vols[n]->copyproperties(*(protos[n]));
+    vols[n]->setdims(desc[n].xdim,desc[n].ydim,desc[n].zdim);
+    vols[n]->set_sform(desc[n].sformcode,stored_matrix(desc[n].sform));
+    vols[n]->set_qform(desc[n].qformcode,stored_matrix(desc[n].qform));
+  }
+  mapaddr = addr;
+  maplength = length;
+  return true;
+}
+
+
+int RefPyramidCache::save(const std::vector<const volume<float>*>& vols) const
+{
+  if (!enabled()) return -1;
+  RefCacheHeader header;
+  std::memset(&header,0,sizeof(header));
+  std::memcpy(header.magic,refcachemagic,8);
+  header.version = refcacheversion;
+  header.nvols = vols.size();
+  header.key = key;
+  std::vector<RefCacheVolume> desc(vols.size());
+  size_t pos = aligned(sizeof(header) + vols.size()*sizeof(RefCacheVolume));
+  for (unsigned int n=0; n<vols.size(); n++) {
+    std::memset(&(desc[n]),0,sizeof(RefCacheVolume));
+    desc[n].nx = vols[n]->xsize();
+    desc[n].ny = vols[n]->ysize();
+    desc[n].nz = vols[n]->zsize();
+    desc[n].xdim = vols[n]->xdim();
+    desc[n].ydim = vols[n]->ydim();
+    desc[n].zdim = vols[n]->zdim();
+    desc[n].sformcode = vols[n]->sform_code();
+    desc[n].qformcode = vols[n]->qform_code();
+    store_matrix(vols[n]->sform_mat(),desc[n].sform);
+    store_matrix(vols[n]->qform_mat(),desc[n].qform);
+    desc[n].offset = pos;
+    pos = aligned(pos + (size_t) vols[n]->nvoxels()*sizeof(float));
+  }
+  header.filesize = pos;
+
+  // write to a temporary file in the same directory, then rename it
+  std::ostringstream tmpname;
+  tmpname << filename() << ".tmp" << getpid();
+  FILE *fp = fopen(tmpname.str().c_str(),"wb");
+  if (fp==0) return -1;
+  bool ok = (fwrite(&header,sizeof(header),1,fp)==1);
+  for (unsigned int n=0; ok && (n<vols.size()); n++) {
+    ok = (fwrite(&(desc[n]),sizeof(RefCacheVolume),1,fp)==1);
+  }
+  const char zeros[refcachealign] = { 0 };
+  for (unsigned int n=0; ok && (n<vols.size()); n++) {
+    long here = ftell(fp);
+    ok = (here>=0) && (fwrite(zeros,1,desc[n].offset - here,fp)==desc[n].offset - here);
+    size_t nvox = vols[n]->nvoxels();
+    if (ok && (nvox>0)) ok = (fwrite(vols[n]->fbegin(),sizeof(float),nvox,fp)==nvox);
+  }
+  if (ok) {
+    long here = ftell(fp);
+    ok = (here>=0) && (fwrite(zeros,1,header.filesize - here,fp)==header.filesize - here);
+  }
+  if (fclose(fp)!=0) ok=false;
+  if (!ok || (rename(tmpname.str().c_str(),filename().c_str())!=0)) {
+    remove(tmpname.str().c_str());
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,62 @@
+/*  refcache.h
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#ifndef __REFCACHE_
+#define __REFCACHE_
+
+#include <string>
+#include <vector>
+
+#include "newimage/newimage.h"
+
+// An on-disk cache of the preprocessed (resampled and subsampled) reference
+//  volumes and weights, so that runs with the same reference image and
+//  options can map them from a file instead of recomputing them.
+//
+// Each cache file holds one set of volumes and is named from a 64 bit key,
+//  which the caller forms (with hash_volume and hash_value) from the image
+//  contents and all the options that affect the preprocessing.  Files are
+//  written to a temporary name and then renamed, so concurrent runs never
+//  see a partial file.  Loaded volumes point straight into a private
+//  read-only mapping of the file (copied only if written to), which stays
+//  in place until the cache object is destroyed.
+
+typedef unsigned long long refcachekey;
+
+refcachekey hash_value(double val, refcachekey seed);
+refcachekey hash_volume(const NEWIMAGE::volume<float>& vol, refcachekey seed);
+
+class RefPyramidCache {
+ public:
+  RefPyramidCache();
+  ~RefPyramidCache();
+
+  void set_directory(const std::string& dir) { dirname = dir; }
+  bool enabled() const { return (dirname.length()>0); }
+  void set_key(refcachekey newkey) { key = newkey; }
+  std::string filename() const;
+
+  // maps the cache file for the current key (if there is one) and points
+  //  vols[n] at the stored data, with the properties of protos[n] apart
+  //  from the voxel dimensions and sform/qform, which are those stored
+  bool load(const std::vector<NEWIMAGE::volume<float>*>& vols,
+	    const std::vector<const NEWIMAGE::volume<float>*>& protos);
+  // writes the volumes to the cache file for the current key
+  int save(const std::vector<const NEWIMAGE::volume<float>*>& vols) const;
+
+ private:
+  std::string dirname;
+  refcachekey key;
+  void *mapaddr;
+  size_t maplength;
+
+  RefPyramidCache(const RefPyramidCache&);
+  const RefPyramidCache& operator=(const RefPyramidCache&);
+};
+
+#endif
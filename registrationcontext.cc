@@ -0,0 +1,85 @@
+/*  registrationcontext.cc
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include "miscmaths/miscmaths.h"
+#include "registrationcontext.h"
+
+using namespace NEWMAT;
+using namespace NEWIMAGE;
+
+thread_local RegistrationContext* RegistrationContext::boundctx = NULL;
+
+
+RegistrationContext::RegistrationContext()
+  : impair(globaloptions::get().impair),
+    refparams(globaloptions::get().refparams),
+    parammask(globaloptions::get().parammask),
+    no_params(globaloptions::get().no_params),
+    currentcostfn(globaloptions::get().currentcostfn),
+    verbose(globaloptions::get().verbose),
+    anglerep(globaloptions::get().anglerep),
+    nthreads(globaloptions::get().nthreads),
+    ownpair(false)
+{
+}
+
+
+RegistrationContext::RegistrationContext(const RegistrationContext& src)
+  : impair(src.impair), refparams(src.refparams), parammask(src.parammask),
+    no_params(src.no_params), currentcostfn(src.currentcostfn),
+    verbose(src.verbose), anglerep(src.anglerep), nthreads(src.nthreads),
+    ownpair(false), pinvmask(src.pinvmask), pinvcache(src.pinvcache)
+{
+}
+
+
+RegistrationContext::~RegistrationContext()
+{
+  if (ownpair) delete impair;
+}
+
+
+void RegistrationContext::set_private_pair(Costfn *newpair)
+{
+  if (ownpair) delete impair;
+  impair = newpair;
+  ownpair = true;
+}
+
+
+RegistrationContext& RegistrationContext::current()
+{
+  if (boundctx) return *boundctx;
+  static thread_local RegistrationContext defaultctx;
+  defaultctx.impair = globaloptions::get().impair;
+  defaultctx.refparams = globaloptions::get().refparams;
+  defaultctx.parammask = globaloptions::get().parammask;
+  defaultctx.no_params = globaloptions::get().no_params;
+  defaultctx.currentcostfn = globaloptions::get().currentcostfn;
+  defaultctx.verbose = globaloptions::get().verbose;
+  defaultctx.anglerep = globaloptions::get().anglerep;
+  defaultctx.nthreads = globaloptions::get().nthreads;
+  return defaultctx;
+}
+
+
+const Matrix& RegistrationContext::parammask_pinv() const
+{
+  bool same = ( (pinvmask.Nrows()==parammask.Nrows()) &&
+		(pinvmask.Ncols()==parammask.Ncols()) );
+  for (int r=1; same && r<=parammask.Nrows(); r++) {
+    for (int c=1; same && c<=parammask.Ncols(); c++) {
+      if (pinvmask(r,c)!=parammask(r,c)) same=false;
+    }
+  }
+  if (!same) {
+    pinvmask = parammask;
+    pinvcache = MISCMATHS::pinv(parammask);
+  }
+  return pinvcache;
+}
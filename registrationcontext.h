@@ -0,0 +1,78 @@
+/*  registrationcontext.h
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#ifndef __REGISTRATIONCONTEXT_
+#define __REGISTRATIONCONTEXT_
+
+#include "armawrap/newmat.h"
+#include "newimage/costfns.h"
+#include "globaloptions.h"
+
+// The state that is read and written while the cost function is being
+//  evaluated and optimised for one registration (or for one candidate
+//  within a registration).  The optimisation routines work from one of
+//  these rather than from globaloptions, so that several contexts, each
+//  with their own image pair, can be used at the same time.
+//
+// A new context takes its initial state from globaloptions.  Copies share
+//  the image pair unless set_private_pair() is used to give the copy its
+//  own one (which is then deleted along with the context).
+
+class RegistrationContext {
+ public:
+  RegistrationContext();
+  RegistrationContext(const RegistrationContext& src);
+  ~RegistrationContext();
+
+  NEWIMAGE::Costfn *impair;
+  NEWMAT::ColumnVector refparams;
+  NEWMAT::Matrix parammask;
+  int no_params;
+  NEWIMAGE::costfns currentcostfn;
+  int verbose;
+  NEWIMAGE::anglereps anglerep;
+  int nthreads;   // threads this context may use for its own evaluations
+
+  void set_private_pair(NEWIMAGE::Costfn *newpair);
+
+  // pinv(parammask), only recalculated when parammask has changed
+  const NEWMAT::Matrix& parammask_pinv() const;
+
+  // the context bound to the calling thread (by a ContextBinding) or NULL
+  //  - needed by the cost functions passed to MISCMATHS::optimise, as these
+  //    can only be given the parameter vector
+  static RegistrationContext* bound() { return boundctx; }
+
+  // the bound context or, when there is none, a context kept for this
+  //  thread that is brought up to date with globaloptions (so that the
+  //  parammask_pinv() cache is kept from one call to the next)
+  static RegistrationContext& current();
+
+ private:
+  bool ownpair;
+  mutable NEWMAT::Matrix pinvmask;   // the parammask that pinvcache is for
+  mutable NEWMAT::Matrix pinvcache;
+  static thread_local RegistrationContext* boundctx;
+
+  const RegistrationContext& operator=(const RegistrationContext&);
+
+  friend class ContextBinding;
+};
+
+
+// Binds a context to the calling thread for the lifetime of this object
+class ContextBinding {
+ public:
+  ContextBinding(RegistrationContext& ctx) : prevctx(RegistrationContext::boundctx)
+    { RegistrationContext::boundctx = &ctx; }
+  ~ContextBinding() { RegistrationContext::boundctx = prevctx; }
+ private:
+  RegistrationContext* prevctx;
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*  resamplebench.cc
+
+    Times the row-order and tiled traversals of the FLIRT output
+    resampling under 0, 45 and 90 degree rotations
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+
+#include "armawrap/newmat.h"
+#include "miscmaths/miscmaths.h"
+#include "newimage/newimageall.h"
+#include "fastresample.h"
+
+using namespace std;
+using namespace NEWMAT;
+using namespace MISCMATHS;
+using namespace NEWIMAGE;
+
+
+// a rotation of angle degrees about the given axis (1=x, 2=y, 3=z),
+//  centred on the middle of vol (in mm)
+
+Matrix centred_rotation(const volume<float>& vol, int axis, float angle)
+{
+  int a1 = (axis==1) ? 2 : 1;
+  int a2 = (axis==3) ? 2 : 3;
+  float theta = angle*M_PI/180.0;
+  Matrix rot = IdentityMatrix(4);
+  rot(a1,a1) = cos(theta);  rot(a1,a2) = -sin(theta);
+  rot(a2,a1) = sin(theta);  rot(a2,a2) = cos(theta);
+  Matrix shift = IdentityMatrix(4);
+  shift(1,4) = (vol.xsize()-1)*vol.xdim()/2.0;
+  shift(2,4) = (vol.ysize()-1)*vol.ydim()/2.0;
+  shift(3,4) = (vol.zsize()-1)*vol.zdim()/2.0;
+  return shift * rot * shift.i();
+}
+
+
+// the best of nrep timings (in seconds) of one resampling
+
+double time_resample(const volume<float>& invol, volume<float>& outvol,
+		     const Matrix& aff, const string& interp, int nthreads,
+		     bool tiled, int nrep)
+{
+  double best=-1.0;
+  for (int rep=0; rep<nrep; rep++) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (interp=="sinc") {
+      fast_sinc_transform(invol,outvol,aff,0.0,"blackman",7,nthreads,tiled);
+    } else if (interp=="spline") {
+      fast_spline_transform(invol,outvol,aff,0.0,nthreads,tiled);
+    } else {
+      fast_affine_transform(invol,outvol,aff,0.0,nthreads,tiled);
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if ((best<0.0) || (secs<best)) best = secs;
+  }
+  return best;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if ((argc>1) && (string(argv[1])=="-help")) {
+    cerr << "Usage: " << argv[0] << " [size (def 256)] [voxel size in mm (def 1)]"
+	 << " [nthreads (def 1)] [trilinear|sinc|spline (def trilinear)]" << endl;
+    cerr << "        Times the row-order and tiled resampling of a size^3 volume" << endl;
+    return -1;
+  }
+  int size = (argc>1) ? atoi(argv[1]) : 256;
+  float vox = (argc>2) ? atof(argv[2]) : 1.0;
+  int nthreads = (argc>3) ? atoi(argv[3]) : 1;
+  string interp = (argc>4) ? argv[4] : "trilinear";
+  int nrep = 3;
+
+  // a deterministic textured volume
+  volume<float> invol(size,size,size);
+  invol.setdims(vox,vox,vox);
+  float *data = invol.nsfbegin();
+  long nvox = (long) size*size*size;
+  for (long n=0; n<nvox; n++) { data[n] = (float) ((n*2654435761UL) % 1000); }
+  invol.setpadvalue(0.0);
+  invol.setextrapolationmethod(constpad);
+  if (interp=="sinc") {
+    invol.setinterpolationmethod(sinc);
+    invol.definesincinterpolation("blackman",7);
+  } else if (interp=="spline") {
+    invol.setinterpolationmethod(spline);
+  } else {
+    invol.setinterpolationmethod(trilinear);
+  }
+  volume<float> rowvol(invol), tiledvol(invol);
+
+  cout << "axis  angle   rows (s)  tiled (s)  speedup  max diff" << endl;
+  for (int axis=1; axis<=3; axis++) {
+    for (int angle=0; angle<=90; angle+=45) {
+      if ((angle==0) && (axis>1)) continue;
+      Matrix aff = centred_rotation(invol,axis,angle);
+      double rowtime = time_resample(invol,rowvol,aff,interp,nthreads,false,nrep);
+      double tiledtime = time_resample(invol,tiledvol,aff,interp,nthreads,true,nrep);
+      float maxdiff = 0.0;
+      const float *r = rowvol.fbegin(), *t = tiledvol.fbegin();
+      for (long n=0; n<nvox; n++) { maxdiff = Max(maxdiff,(float) fabs(r[n]-t[n])); }
+      cout << "  " << ((axis==1) ? "x" : ((axis==2) ? "y" : "z")) << "    " << angle
+	   << "\t" << rowtime << "\t" << tiledtime << "\t" << rowtime/tiledtime
+	   << "\t" << maxdiff << endl;
+    }
+  }
+  return 0;
+}
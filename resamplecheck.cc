@@ -0,0 +1,167 @@
+/*  resamplecheck.cc
+
+    Compares the FLIRT output resampling (fastresample) with newimage
+    affine_transform for each interpolation and extrapolation method
+
+    FMRIB Image Analysis Group
+
+    Copyright (C) 2026 University of Oxford  */
+
+/*  CCOPYRIGHT  */
+
+#include <string>
+#include <iostream>
+#include <cstdlib>
+
+#include "armawrap/newmat.h"
+#include "miscmaths/miscmaths.h"
+#include "newimage/newimageall.h"
+#include "NewNifti/NewNifti.h"
+#include "fastresample.h"
+
+using namespace std;
+using namespace NEWMAT;
+using namespace MISCMATHS;
+using namespace NEWIMAGE;
+
+
+// a rotation of angle degrees about the axis (ax,ay,az), with a scaling
+//  and then a translation (in mm)
+
+Matrix test_affine(float ax, float ay, float az, float angle, float scale,
+		   float tx, float ty, float tz)
+{
+  float norm = sqrt(ax*ax + ay*ay + az*az);
+  ax /= norm;  ay /= norm;  az /= norm;
+  float c = cos(angle*M_PI/180.0), s = sin(angle*M_PI/180.0), t = 1.0 - c;
+  Matrix aff = IdentityMatrix(4);
+  aff(1,1) = t*ax*ax + c;     aff(1,2) = t*ax*ay - s*az;  aff(1,3) = t*ax*az + s*ay;
+  aff(2,1) = t*ax*ay + s*az;  aff(2,2) = t*ay*ay + c;     aff(2,3) = t*ay*az - s*ax;
+  aff(3,1) = t*ax*az - s*ay;  aff(3,2) = t*ay*az + s*ax;  aff(3,3) = t*az*az + c;
+  for (int r=1; r<=3; r++) {
+    for (int c2=1; c2<=3; c2++) aff(r,c2) *= scale;
+  }
+  aff(1,4) = tx;  aff(2,4) = ty;  aff(3,4) = tz;
+  return aff;
+}
+
+
+bool same_matrix(const Matrix& a, const Matrix& b)
+{
+  for (int r=1; r<=4; r++) {
+    for (int c=1; c<=4; c++) {
+      if (fabs(a(r,c)-b(r,c)) > 1e-4*(1.0 + fabs(a(r,c)))) return false;
+    }
+  }
+  return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if ((argc>1) && (string(argv[1])=="-help")) {
+    cerr << "Usage: " << argv[0] << " [nthreads (def 2)]" << endl;
+    cerr << "        Compares fast_affine_transform, fast_sinc_transform and" << endl;
+    cerr << "        fast_spline_transform with newimage affine_transform, and" << endl;
+    cerr << "        reports the largest differences (the exit status is 1 if" << endl;
+    cerr << "        any are beyond the expected float rounding)" << endl;
+    return -1;
+  }
+  int nthreads = (argc>1) ? atoi(argv[1]) : 2;
+
+  // a smooth pattern plus texture, with anisotropic voxels and an sform
+  int nx=41, ny=37, nz=23;
+  volume<float> invol(nx,ny,nz);
+  invol.setdims(1.5,1.25,2.0);
+  for (int z=0; z<nz; z++) {
+    for (int y=0; y<ny; y++) {
+      for (int x=0; x<nx; x++) {
+	invol(x,y,z) = 100.0 + 40.0*sin(0.3*x)*cos(0.2*y) + 20.0*sin(0.4*z)
+	  + (float) ((((long) x*7919 + y*104729 + z*1299709) % 1000)/50.0);
+      }
+    }
+  }
+  Matrix insform = IdentityMatrix(4);
+  insform(1,1) = -1.5;  insform(2,2) = 1.25;  insform(3,3) = 2.0;
+  insform(1,4) = 30.0;  insform(2,4) = -22.0;  insform(3,4) = -20.0;
+  invol.set_sform(NIFTI_XFORM_MNI_152,insform);
+  invol.set_qform(NIFTI_XFORM_SCANNER_ANAT,insform);
+  float range = invol.max() - invol.min();
+
+  // an output grid that is larger than the input, so every edge is crossed
+  volume<float> outproto(52,44,30);
+  outproto.setdims(1.3,1.3,1.6);
+
+  Matrix affs[4];
+  affs[0] = IdentityMatrix(4);
+  affs[1] = test_affine(1,0,0,0.0,1.0,0.75,-0.5,1.25);
+  affs[2] = test_affine(0.3,1.0,0.2,17.0,1.08,-3.0,4.0,2.0);
+  affs[3] = test_affine(1.0,0.2,0.9,90.0,0.95,5.0,-6.0,-4.0);
+  const char *affnames[4] = { "identity", "shift", "rot17", "rot90" };
+
+  interpolation interps[4] = { nearestneighbour, trilinear, sinc, spline };
+  const char *interpnames[4] = { "nearestneighbour", "trilinear", "sinc", "spline" };
+  extrapolation extraps[2] = { extraslice, constpad };
+  const char *extrapnames[2] = { "extraslice", "constpad" };
+  float paddings[2] = { 0.0, 1.5 };
+
+  bool allok=true;
+  cout << "interp            extrap      pad  transform  tiled  max diff  "
+       << "(fraction of range)  voxels differing  sform/qform" << endl;
+  for (int i=0; i<4; i++) {
+    for (int e=0; e<2; e++) {
+      for (int p=0; p<2; p++) {
+	for (int a=0; a<4; a++) {
+	  invol.setinterpolationmethod(interps[i]);
+	  invol.setextrapolationmethod(extraps[e]);
+	  invol.setpadvalue(-7.0);
+	  if (interps[i]==sinc) invol.definesincinterpolation("blackman",7);
+
+	  volume<float> refout(outproto);
+	  affine_transform(invol,refout,affs[a],paddings[p],false);
+
+	  for (int tiled=0; tiled<2; tiled++) {
+	    volume<float> fastout(outproto);
+	    if (interps[i]==sinc) {
+	      fast_sinc_transform(invol,fastout,affs[a],paddings[p],"blackman",7,
+				  nthreads,(tiled==1));
+	    } else if (interps[i]==spline) {
+	      fast_spline_transform(invol,fastout,affs[a],paddings[p],nthreads,(tiled==1));
+	    } else {
+	      fast_affine_transform(invol,fastout,affs[a],paddings[p],nthreads,(tiled==1));
+	    }
+
+	    float maxdiff=0.0;
+	    long ndiff=0, nvox=0;
+	    for (int z=0; z<refout.zsize(); z++) {
+	      for (int y=0; y<refout.ysize(); y++) {
+		for (int x=0; x<refout.xsize(); x++) {
+		  float d = fabs(refout(x,y,z) - fastout(x,y,z));
+		  maxdiff = Max(maxdiff,d);
+		  if (d > 1e-3*range) ndiff++;
+		  nvox++;
+		}
+	      }
+	    }
+	    bool sameform = (refout.sform_code()==fastout.sform_code()) &&
+	      (refout.qform_code()==fastout.qform_code()) &&
+	      same_matrix(refout.sform_mat(),fastout.sform_mat()) &&
+	      same_matrix(refout.qform_mat(),fastout.qform_mat());
+	    // nearest neighbour may pick the other voxel where a coordinate is
+	    //  (to within float rounding) half way between two
+	    bool ok = sameform &&
+	      ((interps[i]==nearestneighbour) ? (ndiff <= nvox/200) : (ndiff==0));
+	    if (!ok) allok=false;
+	    cout << interpnames[i] << "\t  " << extrapnames[e] << "  " << paddings[p]
+		 << "\t" << affnames[a] << "\t   " << tiled << "\t" << maxdiff
+		 << "\t" << maxdiff/range << "\t" << ndiff << "/" << nvox
+		 << "\t" << (sameform ? "same" : "DIFFERENT")
+		 << (ok ? "" : "   <-- FAIL") << endl;
+	  }
+	}
+      }
+    }
+  }
+  cout << (allok ? "All results agree" : "Some results differ") << endl;
+  return (allok ? 0 : 1);
+}
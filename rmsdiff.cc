@@ -14,6 +14,7 @@
 #include "armawrap/newmat.h"
 #include "miscmaths/miscmaths.h"
 #include "newimage/newimageall.h"
+#include "matseries.h"
 
 using namespace std;
 using namespace MISCMATHS;
@@ -23,29 +24,13 @@ using namespace NEWIMAGE;
 
 ////////////////////////////////////////////////////////////////////////////
 
-int main(int argc,char *argv[])
-{
-
-  float rmax=80.0;
-
-  if (argc<4) {
-    cerr << "Usage: " << argv[0] << " matrixfile1 matrixfile2 refvol [mask]" << endl;
-    cerr << "        Outputs rms deviation between matrices (in mm)" << endl;
-    return -1;
-  }
-
-  Matrix affmat1(4,4), affmat2(4,4);
-  affmat1 = read_ascii_matrix(argv[1]);
-  if (affmat1.Nrows()<4) {
-    cerr << "Could not read matrix " << argv[1] << endl;
-    return -2;
-  }
-  affmat2 = read_ascii_matrix(argv[2]);
-  if (affmat2.Nrows()<4) {
-    cerr << "Could not read matrix " << argv[2] << endl;
-    return -2;
-  }
+// prints the rms deviation (or, with a mask, the maximum and rms
+//  deviations over the mask) between two matrices
 
+void print_deviation(const Matrix& affmat1, const Matrix& affmat2,
+		     const volume<float>& refvol, const ColumnVector& centre,
+		     const volume<float>& mask, bool usemask, float rmax)
+{
   if (fabs(affmat1.Determinant())<0.1) {
     cerr << "WARNING:: matrix 1 has low determinant" << endl;
     cerr << affmat1 << endl;
@@ -56,16 +41,8 @@ int main(int argc,char *argv[])
     cerr << affmat2 << endl;
   }
 
-  ColumnVector centre(3);
-  centre = 0;
-
-  volume<float> refvol;
-  read_volume(refvol,argv[3]);
-
-  if (argc<5) {
+  if (!usemask) {
     // do the RMS
-    // compute the centre of gravity
-    centre = refvol.cog("scaled_mm");
     float rms = rms_deviation(affmat1,affmat2,centre,rmax);
     cout << rms << endl;
   } else {
@@ -74,8 +51,6 @@ int main(int argc,char *argv[])
     ColumnVector cvec(4);
     cvec=0;  cvec(4)=1;
     long int nvox=0;
-    volume<float> mask;
-    read_volume(mask,argv[4]);
     for (int z=mask.minz(); z<=mask.maxz(); z++) {
       for (int y=mask.miny(); y<=mask.maxy(); y++) {
 	for (int x=mask.minx(); x<=mask.maxx(); x++) {
@@ -93,6 +68,80 @@ int main(int argc,char *argv[])
     double rms = sqrt(sumdistsq/nvox);
     cout << rms << endl;
   }
+}
+
+
+// reads a whole packed series (returning true), or else a single matrix
+
+bool read_series_or_matrix(const string& name, MatrixSeries& series, Matrix& mat)
+{
+  if (is_matrix_series(name) && (series.read(name)==0) && (series.size()!=1)) {
+    return true;
+  }
+  series.clear();
+  mat = read_matrix_or_series_entry(name);
+  return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////
+
+int main(int argc,char *argv[])
+{
+
+  float rmax=80.0;
+
+  if (argc<4) {
+    cerr << "Usage: " << argv[0] << " matrixfile1 matrixfile2 refvol [mask]" << endl;
+    cerr << "        Outputs rms deviation between matrices (in mm)" << endl;
+    cerr << "        (a matrix may be given as <series-file>:<index>, and for a" << endl;
+    cerr << "         whole packed series the deviation of each entry is output)" << endl;
+    return -1;
+  }
+
+  MatrixSeries series1, series2;
+  Matrix affmat1(4,4), affmat2(4,4);
+  bool isseries1 = read_series_or_matrix(argv[1],series1,affmat1);
+  if (!isseries1 && (affmat1.Nrows()<4)) {
+    cerr << "Could not read matrix " << argv[1] << endl;
+    return -2;
+  }
+  bool isseries2 = read_series_or_matrix(argv[2],series2,affmat2);
+  if (!isseries2 && (affmat2.Nrows()<4)) {
+    cerr << "Could not read matrix " << argv[2] << endl;
+    return -2;
+  }
+
+  ColumnVector centre(3);
+  centre = 0;
+
+  volume<float> refvol, mask;
+  read_volume(refvol,argv[3]);
+  bool usemask = (argc>=5);
+  if (usemask) {
+    read_volume(mask,argv[4]);
+  } else {
+    // compute the centre of gravity
+    centre = refvol.cog("scaled_mm");
+  }
+
+  if (!isseries1 && !isseries2) {
+    print_deviation(affmat1,affmat2,refvol,centre,mask,usemask,rmax);
+    return 0;
+  }
+
+  // one result per entry (a single matrix is compared with every entry)
+  std::vector<int> indices = (isseries1 ? series1.indices() : series2.indices());
+  for (unsigned int n=0; n<indices.size(); n++) {
+    int index = indices[n];
+    if (isseries1) affmat1 = series1.matrix(index);
+    if (isseries2) affmat2 = series2.matrix(index);
+    if ((affmat1.Nrows()<4) || (affmat2.Nrows()<4)) {
+      cerr << "No matrix for entry " << index << endl;
+      return -2;
+    }
+    print_deviation(affmat1,affmat2,refvol,centre,mask,usemask,rmax);
+  }
 
   return 0;
 